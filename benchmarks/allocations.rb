@@ -0,0 +1,42 @@
+#!/usr/bin/env ruby
+#
+# Memory allocated per event delivered by NIO::Selector#select. On MRI this
+# counts Ruby objects, on JRuby the bytes allocated by the current thread
+#
+#   ruby benchmarks/allocations.rb [ios]
+
+$:.push File.expand_path('../../lib', __FILE__)
+require 'nio'
+
+ios = (ARGV[0] || 100).to_i
+iterations = 10_000
+
+selector = NIO::Selector.new
+pipes = Array.new(ios) { IO.pipe }
+pipes.each do |reader, writer|
+  selector.register(reader, :r)
+  writer << "X"
+end
+
+if defined?(JRUBY_VERSION)
+  require 'java'
+  thread_mx = java.lang.management.ManagementFactory.getThreadMXBean
+  thread_id = java.lang.Thread.currentThread.getId
+  unit = "bytes"
+  measure = lambda { thread_mx.getThreadAllocatedBytes(thread_id) }
+else
+  unit = "objects"
+  measure = lambda { GC.stat(:total_allocated_objects) }
+end
+
+[["select with a block", lambda { selector.select(0) { |monitor| monitor.readiness } }],
+ ["select returning an array", lambda { selector.select(0).each { |monitor| monitor.readiness } }]].each do |name, op|
+  # Warm up
+  100.times { op.call }
+
+  before = measure.call
+  iterations.times { op.call }
+  allocated = measure.call - before
+
+  puts "#{NIO.engine}: #{name}: #{(allocated.to_f / (iterations * ios)).round(3)} #{unit}/event"
+end
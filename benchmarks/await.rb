@@ -0,0 +1,51 @@
+#!/usr/bin/env ruby
+#
+# Thread-per-connection style code on top of a single selector: park many
+# JDK 21 virtual threads in NIO::Monitor#await and let one thread select on
+# their behalf. Requires JRuby on Java 21+ with the java engine. Each
+# connection is a pipe, so raise your file descriptor limit accordingly
+#
+#   jruby benchmarks/await.rb [threads]
+
+$:.push File.expand_path('../../lib', __FILE__)
+require 'nio'
+
+unless NIO.engine == 'java' && java.lang.Thread.respond_to?(:ofVirtual)
+  puts "#{NIO.engine}: skipped, Monitor#await needs the java engine on Java 21+"
+  exit
+end
+
+count = (ARGV[0] || 100_000).to_i
+selector = NIO::Selector.new
+runtime  = java.lang.Runtime.getRuntime
+memory   = lambda { runtime.totalMemory - runtime.freeMemory }
+
+pipes = Array.new(count) { IO.pipe }
+monitors = pipes.map { |reader, _| selector.register(reader, :r) }
+
+select_thread = Thread.new { loop { selector.select(1) } }
+
+java.lang.System.gc
+baseline = memory.call
+parked = java.util.concurrent.CountDownLatch.new(count)
+woken  = java.util.concurrent.CountDownLatch.new(count)
+
+started_at = Time.now
+threads = monitors.map do |monitor|
+  java.lang.Thread.ofVirtual.start do
+    parked.countDown
+    monitor.await(:r)
+    woken.countDown
+  end
+end
+parked.await
+puts "#{count} virtual threads parked in #{(Time.now - started_at).round(3)}s, " \
+     "#{((memory.call - baseline) / count.to_f).round} bytes/thread"
+
+started_at = Time.now
+pipes.each { |_, writer| writer << "X" }
+woken.await
+puts "woke all #{count} in #{(Time.now - started_at).round(3)}s"
+
+threads.each(&:join)
+select_thread.kill
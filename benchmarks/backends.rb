@@ -0,0 +1,48 @@
+#!/usr/bin/env ruby
+#
+# Cost of a wakeup against the number of registered fds, for each libev
+# backend available here. Only the most recently registered fd is ready,
+# so the poll and select backends have to scan past every other one to
+# find it
+#
+#   ruby benchmarks/backends.rb [iterations]
+
+$:.push File.expand_path('../../lib', __FILE__)
+require 'nio'
+require 'benchmark'
+
+iterations = (ARGV[0] || 2_000).to_i
+counts     = [100, 500, 1_000, 2_000]
+
+if NIO.engine != "libev"
+  puts "#{NIO.engine}: skipped (backends are a libev option)"
+  exit
+end
+
+backends = [:epoll, :kqueue, :port, :poll, :select].select do |backend|
+  begin
+    NIO::Selector.new(:backend => backend).close
+    true
+  rescue NotImplementedError
+    false
+  end
+end
+
+counts.each do |count|
+  pipes = Array.new(count) { IO.pipe }
+  pipes.last.last << "x"
+
+  results = backends.map do |backend|
+    selector = NIO::Selector.new(:backend => backend)
+    pipes.each { |reader, _| selector.register(reader, :r) }
+
+    100.times { selector.select(0) { |m| m } }
+    time = Benchmark.realtime { iterations.times { selector.select(0) { |m| m } } }
+    selector.close
+
+    "#{backend} #{(time / iterations * 1_000_000).round(2)} us"
+  end
+
+  puts "libev, #{count} fds: #{results.join(', ')} per wakeup"
+  pipes.flatten.each { |io| io.close }
+end
@@ -0,0 +1,82 @@
+#!/usr/bin/env ruby
+#
+# How long bursts of messages take to handle when the handlers allocate
+# heavily, with and without NIO::Selector#gc_when_idle= moving collections
+# into the gaps between bursts. A forked writer sends the bursts
+#
+#   ruby benchmarks/idle_gc.rb [bursts] [burst size] [gap ms]
+#   NIO4R_PURE=1 ruby benchmarks/idle_gc.rb [bursts] [burst size] [gap ms]
+
+$:.push File.expand_path('../../lib', __FILE__)
+require 'nio'
+require 'socket'
+
+bursts     = (ARGV[0] || 500).to_i
+burst_size = (ARGV[1] || 200).to_i
+gap        = (ARGV[2] || 5).to_i / 1000.0
+
+# Long-lived objects, some of which get replaced by each message, so old
+# objects pile up and major collections come round regularly
+$cache = Array.new(50_000) { "x" * 64 }
+
+def run(bursts, burst_size, gap, gc_when_idle)
+  selector = NIO::Selector.new
+  selector.gc_when_idle = gc_when_idle
+  reader, writer = UNIXSocket.pair
+  monitor = selector.register(reader, :r)
+
+  child = fork do
+    reader.close
+    bursts.times do
+      writer.write("X" * burst_size)
+      sleep gap
+    end
+    exit!
+  end
+  writer.close
+
+  GC.start
+  times = []
+  eof = false
+
+  until eof
+    selector.select do
+      started_at = Time.now
+
+      begin
+        reader.read_nonblock(burst_size).size.times do |n|
+          # Per message garbage, plus a little promoted to the old generation
+          Array.new(20) { "y" * 32 }
+          $cache[rand($cache.size)] = "z" * 64 if n % 4 == 0
+        end
+      rescue EOFError
+        eof = true
+      end
+
+      times << Time.now - started_at
+    end
+  end
+
+  Process.wait(child)
+  monitor.close
+  stats = selector.stats
+  selector.close
+  reader.close
+
+  times.sort!
+  [times[times.size / 2], times[(times.size * 0.99).floor], times.last, stats]
+end
+
+begin
+  NIO::Selector.new.gc_when_idle = true
+rescue NotImplementedError
+  puts "#{NIO.engine}: skipped (no GC.stat limits to go by)"
+  exit
+end
+
+[false, true].each do |gc_when_idle|
+  p50, p99, max, stats = run(bursts, burst_size, gap, gc_when_idle)
+  puts "#{NIO.engine} (gc_when_idle = #{gc_when_idle}): burst handling p50 #{(p50 * 1000).round(3)} ms, " \
+       "p99 #{(p99 * 1000).round(3)} ms, max #{(max * 1000).round(3)} ms " \
+       "(#{stats[:idle_gc_minor]} minor, #{stats[:idle_gc_major]} major idle collections)"
+end
@@ -0,0 +1,60 @@
+#!/usr/bin/env ruby
+#
+# Message throughput with CPU-heavy handlers, with and without a pipelined
+# selector (:pipelined => true) overlapping the kernel wait with dispatch.
+# A forked writer keeps the sockets busy while the handlers run
+#
+#   ruby benchmarks/pipelined.rb [ios] [messages] [work]
+
+$:.push File.expand_path('../../lib', __FILE__)
+require 'nio'
+require 'benchmark'
+require 'socket'
+
+ios      = (ARGV[0] || 100).to_i
+messages = (ARGV[1] || 20_000).to_i
+work     = (ARGV[2] || 2_000).to_i
+
+def run(ios, messages, work, options)
+  selector = NIO::Selector.new(options)
+  pairs = Array.new(ios) { UNIXSocket.pair }
+  pairs.each { |sock, _| selector.register(sock, :r) }
+
+  writer = fork do
+    pairs.each { |sock, _| sock.close }
+    messages.times { |i| pairs[i % ios][1].write("X") }
+    exit!
+  end
+  pairs.each { |_, peer| peer.close }
+
+  handled = 0
+  time = Benchmark.realtime do
+    while handled < messages
+      selector.select(1) do |monitor|
+        begin
+          handled += monitor.io.read_nonblock(4096).size
+          work.times { |n| n * n }
+        rescue EOFError
+          monitor.close
+        end
+      end
+    end
+  end
+
+  Process.wait(writer)
+  selector.close(true)
+  time
+end
+
+begin
+  NIO::Selector.new(:pipelined => true).close
+rescue NotImplementedError
+  puts "#{NIO.engine}: skipped (no pipelined polling here)"
+  exit
+end
+
+[["plain", {}], ["pipelined", { :pipelined => true }]].each do |name, options|
+  time = run(ios, messages, work, options)
+  puts "#{NIO.engine} (#{name}): #{messages} messages over #{ios} IOs in #{(time * 1000).round(2)} ms, " \
+       "#{(messages / time).round} messages/s"
+end
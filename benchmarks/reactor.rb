@@ -0,0 +1,53 @@
+#!/usr/bin/env ruby
+#
+# Request/response round trips through an NIO::Reactor echo server. A
+# forked client keeps every connection busy with one small request at a
+# time, so this measures per-event overhead rather than bandwidth
+#
+#   ruby benchmarks/reactor.rb [connections] [round trips per connection]
+
+$:.push File.expand_path('../../lib', __FILE__)
+require 'nio'
+require 'benchmark'
+require 'socket'
+
+connections = (ARGV[0] || 100).to_i
+round_trips = (ARGV[1] || 200).to_i
+
+class Echo < NIO::Reactor::Connection
+  def on_data(data)
+    write data
+  end
+
+  def on_close
+    reactor.stop if reactor.connections.zero?
+  end
+end
+
+server = TCPServer.new("127.0.0.1", 0)
+port = server.addr[1]
+
+reactor = NIO::Reactor.new(:idle_timeout => 30, :defer_accept => 5)
+reactor.listen(server, Echo)
+
+client = fork do
+  server.close
+  sockets = Array.new(connections) { TCPSocket.new("127.0.0.1", port) }
+
+  round_trips.times do
+    sockets.each { |socket| socket.write("PING\r\n") }
+    sockets.each { |socket| socket.readpartial(6) }
+  end
+
+  sockets.each { |socket| socket.close }
+  exit!
+end
+
+time = Benchmark.realtime { reactor.run }
+Process.wait(client)
+reactor.close
+server.close
+
+total = connections * round_trips
+puts "#{NIO.engine}: #{total} round trips over #{connections} connections in #{(time * 1000).round(2)} ms, " \
+     "#{(total / time).round} round trips/s"
@@ -0,0 +1,30 @@
+#!/usr/bin/env ruby
+#
+# NIO::Selector#select throughput with many registered IO objects, only a
+# few of which are ready at any given time
+#
+#   ruby benchmarks/select.rb [ios] [ready]
+#   NIO4R_PURE=1 ruby benchmarks/select.rb [ios] [ready]
+
+$:.push File.expand_path('../../lib', __FILE__)
+require 'nio'
+require 'benchmark'
+
+ios   = (ARGV[0] || 1000).to_i
+ready = (ARGV[1] || 10).to_i
+iterations = 2000
+
+selector = NIO::Selector.new
+pipes = Array.new(ios) { IO.pipe }
+pipes.each { |reader, _| selector.register(reader, :r) }
+pipes.first(ready).each { |_, writer| writer << "X" }
+
+# Warm up
+10.times { selector.select(0) }
+
+time = Benchmark.realtime do
+  iterations.times { selector.select(0) { |monitor| monitor } }
+end
+
+puts "#{NIO.engine}: #{ios} IOs, #{ready} ready: " \
+     "#{(iterations / time).round} selects/sec, #{(time / iterations * 1_000_000).round(1)} us/select"
@@ -0,0 +1,37 @@
+#!/usr/bin/env ruby
+#
+# How long NIO::Selector#close takes with many registered IO objects
+#
+#   ruby benchmarks/teardown.rb [ios] [close_ios]
+#   NIO4R_PURE=1 ruby benchmarks/teardown.rb [ios] [close_ios]
+
+$:.push File.expand_path('../../lib', __FILE__)
+require 'nio'
+require 'benchmark'
+require 'socket'
+
+ios = (ARGV[0] || 10_000).to_i
+close_ios = ARGV[1] == "close_ios"
+
+# Each socket pair takes two file descriptors
+soft, hard = Process.getrlimit(Process::RLIMIT_NOFILE)
+needed = ios * 2 + 64
+
+if needed > hard
+  puts "#{NIO.engine}: skipped (not enough file descriptors for #{ios} IOs)"
+  exit
+end
+Process.setrlimit(Process::RLIMIT_NOFILE, needed, hard) if soft < needed
+
+selector = NIO::Selector.new
+pairs = Array.new(ios) { UNIXSocket.pair }
+pairs.each { |sock, _| selector.register(sock, :r) }
+
+time = Benchmark.realtime { selector.close(close_ios) }
+
+pairs.each do |pair|
+  pair.each { |sock| sock.close unless sock.closed? }
+end
+
+puts "#{NIO.engine}: closed selector with #{ios} IOs#{' (and the IOs)' if close_ios} " \
+     "in #{(time * 1000).round(2)} ms, #{(time / ios * 1_000_000_000).round} ns/IO"
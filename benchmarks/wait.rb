@@ -0,0 +1,34 @@
+#!/usr/bin/env ruby
+#
+# Waiting on one IO at a time, as client libraries do: NIO.wait against
+# registering with a selector, selecting and deregistering, and against
+# IO.select. The IO is always ready, so this is the overhead of the wait
+#
+#   ruby benchmarks/wait.rb [iterations]
+
+$:.push File.expand_path('../../lib', __FILE__)
+require 'nio'
+require 'benchmark'
+
+iterations = (ARGV[0] || 100_000).to_i
+reader, writer = IO.pipe
+writer << "ready"
+selector = NIO::Selector.new
+
+waits = {
+  "NIO.wait" => lambda { NIO.wait(reader, :r, 1) },
+  "selector" => lambda do
+    selector.register(reader, :r)
+    selector.select(1)
+    selector.deregister(reader)
+  end,
+  "IO.select" => lambda { IO.select([reader], nil, nil, 1) }
+}
+
+waits.each do |name, wait|
+  1_000.times { wait.call }
+  time = Benchmark.realtime { iterations.times { wait.call } }
+  puts "#{NIO.engine}, #{name}: #{(time / iterations * 1_000_000).round(2)} us per wait"
+end
+
+selector.close
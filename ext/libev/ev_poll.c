@@ -39,6 +39,48 @@
 
 #include <poll.h>
 
+/* scan revents a vector of pollfds at a time where the compiler targets
+ * sse2 or avx2, skipping runs of quiet fds without looking at each one.
+ * define EV_SCAN_SIMD to 0 to always scan one pollfd at a time */
+#ifndef EV_SCAN_SIMD
+# define EV_SCAN_SIMD 1
+#endif
+
+#if EV_SCAN_SIMD && defined (__AVX2__)
+# include <immintrin.h>
+# define EV_POLL_SCAN_STEP 4
+#elif EV_SCAN_SIMD && defined (__SSE2__)
+# include <emmintrin.h>
+# define EV_POLL_SCAN_STEP 2
+#endif
+
+#ifdef EV_POLL_SCAN_STEP
+/* pollfds with only their revents bits set, for masking loaded vectors */
+static const struct pollfd poll_revents_mask [EV_POLL_SCAN_STEP] = {
+  { 0, 0, -1 }, { 0, 0, -1 },
+# if EV_POLL_SCAN_STEP > 2
+  { 0, 0, -1 }, { 0, 0, -1 },
+# endif
+};
+
+/* does any of the EV_POLL_SCAN_STEP pollfds starting at p have revents? */
+int inline_size
+poll_scan_any (const struct pollfd *p)
+{
+# if EV_POLL_SCAN_STEP > 2
+  __m256i v = _mm256_loadu_si256 ((const __m256i *)p);
+  __m256i m = _mm256_loadu_si256 ((const __m256i *)poll_revents_mask);
+
+  return !_mm256_testz_si256 (v, m);
+# else
+  __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+  __m128i m = _mm_loadu_si128 ((const __m128i *)poll_revents_mask);
+
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_and_si128 (v, m), _mm_setzero_si128 ())) != 0xffff;
+# endif
+}
+#endif
+
 void inline_size
 pollidx_init (int *base, int count)
 {
@@ -107,6 +149,13 @@ poll_poll (EV_P_ ev_tstamp timeout)
   else
     for (p = polls; res; ++p)
       {
+#ifdef EV_POLL_SCAN_STEP
+        /* the vectors only line up with whole pollfds when they're 8 bytes */
+        if (sizeof (struct pollfd) == 8)
+          while (p + EV_POLL_SCAN_STEP <= polls + pollcnt && !poll_scan_any (p))
+            p += EV_POLL_SCAN_STEP;
+#endif
+
         assert (("libev: poll() returned illegal result, broken BSD kernel?", p < polls + pollcnt));
 
         if (expect_false (p->revents)) /* this expect is debatable */
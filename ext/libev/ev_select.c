@@ -61,6 +61,42 @@
 # define NFDBITS 0
 #endif
 
+/* skip fd_mask words with nothing ready a vector at a time where the
+ * compiler targets sse2 or avx2. define EV_SCAN_SIMD to 0 to look at
+ * every word */
+#ifndef EV_SCAN_SIMD
+# define EV_SCAN_SIMD 1
+#endif
+
+#if EV_SCAN_SIMD && !EV_SELECT_USE_FD_SET && !defined (_WIN32) && defined (__AVX2__)
+# include <immintrin.h>
+# define EV_SELECT_SCAN_BYTES 32
+#elif EV_SCAN_SIMD && !EV_SELECT_USE_FD_SET && !defined (_WIN32) && defined (__SSE2__)
+# include <emmintrin.h>
+# define EV_SELECT_SCAN_BYTES 16
+#endif
+
+#ifdef EV_SELECT_SCAN_BYTES
+# define EV_SELECT_SCAN_WORDS (EV_SELECT_SCAN_BYTES / NFDBYTES)
+
+/* are the EV_SELECT_SCAN_WORDS words from word on empty in both sets? */
+int inline_size
+select_scan_empty (const fd_mask *r, const fd_mask *w, int word)
+{
+# if EV_SELECT_SCAN_BYTES > 16
+  __m256i v = _mm256_or_si256 (_mm256_loadu_si256 ((const __m256i *)(r + word)),
+                               _mm256_loadu_si256 ((const __m256i *)(w + word)));
+
+  return _mm256_testz_si256 (v, v);
+# else
+  __m128i v = _mm_or_si128 (_mm_loadu_si128 ((const __m128i *)(r + word)),
+                            _mm_loadu_si128 ((const __m128i *)(w + word)));
+
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, _mm_setzero_si128 ())) == 0xffff;
+# endif
+}
+#endif
+
 #if !EV_SELECT_USE_FD_SET
 # define NFDBYTES (NFDBITS / 8)
 #endif
@@ -245,26 +281,40 @@ select_poll (EV_P_ ev_tstamp timeout)
 
   {
     int word, bit;
-    for (word = vec_max; word--; )
+    for (word = 0; word < vec_max; ++word)
       {
-        fd_mask word_r = ((fd_mask *)vec_ro) [word];
-        fd_mask word_w = ((fd_mask *)vec_wo) [word];
+        fd_mask word_r, word_w, ready;
+
+        #ifdef EV_SELECT_SCAN_BYTES
+        /* most words are empty in mid-size sets, so skip them in bulk */
+        while (word + EV_SELECT_SCAN_WORDS <= vec_max
+               && select_scan_empty ((fd_mask *)vec_ro, (fd_mask *)vec_wo, word))
+          word += EV_SELECT_SCAN_WORDS;
+
+        if (word >= vec_max)
+          break;
+        #endif
+
+        word_r = ((fd_mask *)vec_ro) [word];
+        word_w = ((fd_mask *)vec_wo) [word];
         #ifdef _WIN32
         word_w |= ((fd_mask *)vec_eo) [word];
         #endif
 
-        if (word_r || word_w)
-          for (bit = NFDBITS; bit--; )
-            {
-              fd_mask mask = 1UL << bit;
-              int events = 0;
+        /* visit only the set bits, lowest first */
+        for (ready = word_r | word_w; ready; ready &= ready - 1)
+          {
+            fd_mask mask;
+            int events = 0;
 
-              events |= word_r & mask ? EV_READ  : 0;
-              events |= word_w & mask ? EV_WRITE : 0;
+            bit  = NFDBYTES > 4 ? ecb_ctz64 ((uint64_t)ready) : ecb_ctz32 ((uint32_t)ready);
+            mask = (fd_mask)1 << bit;
 
-              if (expect_true (events))
-                fd_event (EV_A_ word * NFDBITS + bit, events);
-            }
+            events |= word_r & mask ? EV_READ  : 0;
+            events |= word_w & mask ? EV_WRITE : 0;
+
+            fd_event (EV_A_ word * NFDBITS + bit, events);
+          }
       }
   }
 
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2011 Tony Arcieri. Distributed under the MIT License. See
+ * LICENSE.txt for further details.
+ */
+
+/* Background closes (see NIO::Monitor#close :close_io => :async)
+
+   close() can block: lingering sockets, big send queues and TCP teardown
+   all happen there, and tearing down thousands of connections from the
+   loop thread shows up as lag. Instead the monitor detaches the fd from
+   the Ruby IO, closes the IO (which leaves the fd open) and hands the fd
+   to a native thread that closes fds in batches.
+
+   The closer owns the fds outright, so an fd number can't be reused, and
+   then closed out from under whoever reused it, until the closer is done.
+   The last reference to the socket, and so the slow part, goes away on the
+   closer thread */
+
+#include "nio4r.h"
+#include <unistd.h>
+
+#ifdef NIO_HAVE_CLOSER
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Most fds the closer takes off the queue at a time */
+#define NIO_CLOSER_BATCH 256
+
+static pthread_mutex_t NIO_Closer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t NIO_Closer_pending = PTHREAD_COND_INITIALIZER;
+
+/* Queued fds. Only touched with the lock held */
+static int *NIO_Closer_fds;
+static int NIO_Closer_count, NIO_Closer_capacity;
+static int NIO_Closer_started, NIO_Closer_atfork;
+
+static void *NIO_Closer_run(void *data);
+static int NIO_Closer_start();
+static void NIO_Closer_prepare();
+static void NIO_Closer_parent();
+static void NIO_Closer_child();
+
+/* Close fd in the background. The closer owns it from here on */
+void NIO_Closer_close(int fd)
+{
+    int *fds;
+
+    pthread_mutex_lock(&NIO_Closer_lock);
+
+    if(!NIO_Closer_started && !NIO_Closer_start()) {
+        pthread_mutex_unlock(&NIO_Closer_lock);
+        close(fd);
+        return;
+    }
+
+    if(NIO_Closer_count == NIO_Closer_capacity) {
+        fds = (int *)realloc(NIO_Closer_fds, sizeof(int) * (NIO_Closer_capacity ? NIO_Closer_capacity * 2 : NIO_CLOSER_BATCH));
+        if(!fds) {
+            pthread_mutex_unlock(&NIO_Closer_lock);
+            close(fd);
+            return;
+        }
+
+        NIO_Closer_fds = fds;
+        NIO_Closer_capacity = NIO_Closer_capacity ? NIO_Closer_capacity * 2 : NIO_CLOSER_BATCH;
+    }
+
+    NIO_Closer_fds[NIO_Closer_count++] = fd;
+    pthread_cond_signal(&NIO_Closer_pending);
+    pthread_mutex_unlock(&NIO_Closer_lock);
+}
+
+/* Start the closer thread. Called with the lock held */
+static int NIO_Closer_start()
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    int result;
+
+    /* Forked children start with the lock and queue in a known state, and
+       no closer thread until they close something in the background */
+    if(!NIO_Closer_atfork) {
+        if(pthread_atfork(NIO_Closer_prepare, NIO_Closer_parent, NIO_Closer_child)) {
+            return 0;
+        }
+        NIO_Closer_atfork = 1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    result = pthread_create(&thread, &attr, NIO_Closer_run, 0);
+    pthread_attr_destroy(&attr);
+
+    if(result) {
+        return 0;
+    }
+
+    NIO_Closer_started = 1;
+    return 1;
+}
+
+/* Closer thread: take a batch of fds off the queue and close them without
+   holding the lock, so queueing never waits on a slow close */
+static void *NIO_Closer_run(void *data)
+{
+    int batch[NIO_CLOSER_BATCH];
+    int i, count;
+
+    for(;;) {
+        pthread_mutex_lock(&NIO_Closer_lock);
+        while(!NIO_Closer_count) {
+            pthread_cond_wait(&NIO_Closer_pending, &NIO_Closer_lock);
+        }
+
+        count = NIO_Closer_count < NIO_CLOSER_BATCH ? NIO_Closer_count : NIO_CLOSER_BATCH;
+        NIO_Closer_count -= count;
+        memcpy(batch, NIO_Closer_fds + NIO_Closer_count, sizeof(int) * count);
+        pthread_mutex_unlock(&NIO_Closer_lock);
+
+        for(i = 0; i < count; i++) {
+            close(batch[i]);
+        }
+    }
+
+    return 0;
+}
+
+static void NIO_Closer_prepare()
+{
+    pthread_mutex_lock(&NIO_Closer_lock);
+}
+
+static void NIO_Closer_parent()
+{
+    pthread_mutex_unlock(&NIO_Closer_lock);
+}
+
+/* The closer thread didn't survive the fork. The child's copies of the
+   queued fds are its own to close */
+static void NIO_Closer_child()
+{
+    int i;
+
+    for(i = 0; i < NIO_Closer_count; i++) {
+        close(NIO_Closer_fds[i]);
+    }
+
+    NIO_Closer_count = 0;
+    NIO_Closer_started = 0;
+
+    pthread_mutex_init(&NIO_Closer_lock, 0);
+    pthread_cond_init(&NIO_Closer_pending, 0);
+}
+
+#else
+
+/* Without native threads, close in the foreground */
+void NIO_Closer_close(int fd)
+{
+    close(fd);
+}
+
+#endif /* NIO_HAVE_CLOSER */
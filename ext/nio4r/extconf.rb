@@ -4,16 +4,42 @@ if have_func('rb_thread_blocking_region')
   $defs << '-DHAVE_RB_THREAD_BLOCKING_REGION'
 end
 
+if have_func('rb_mutex_new')
+  $defs << '-DHAVE_RB_MUTEX_NEW'
+end
+
+if have_func('rb_io_read_pending')
+  $defs << '-DHAVE_RB_IO_READ_PENDING'
+end
+
+if have_func('rb_gc_stat')
+  $defs << '-DHAVE_RB_GC_STAT'
+end
+
+if have_func('rb_last_status_set')
+  $defs << '-DHAVE_RB_LAST_STATUS_SET'
+end
+
 if have_header('sys/select.h')
   $defs << '-DEV_USE_SELECT'
 end
 
 if have_header('poll.h')
   $defs << '-DEV_USE_POLL'
+  $defs << '-DHAVE_POLL_H'
+end
+
+if have_func('ppoll', 'poll.h')
+  $defs << '-DHAVE_PPOLL'
 end
 
 if have_header('sys/epoll.h')
   $defs << '-DEV_USE_EPOLL'
+  $defs << '-DHAVE_SYS_EPOLL_H'
+end
+
+if have_header('pthread.h')
+  $defs << '-DHAVE_PTHREAD_H'
 end
 
 if have_header('sys/event.h') and have_header('sys/queue.h')
@@ -24,6 +50,18 @@ if have_header('port.h')
   $defs << '-DEV_USE_PORT'
 end
 
+if have_header('sys/socket.h')
+  $defs << '-DHAVE_SYS_SOCKET_H'
+end
+
+if have_header('netinet/tcp.h')
+  $defs << '-DHAVE_NETINET_TCP_H'
+end
+
+if have_header('sys/ioctl.h')
+  $defs << '-DHAVE_SYS_IOCTL_H'
+end
+
 if have_header('sys/resource.h')
   $defs << '-DHAVE_SYS_RESOURCE_H'
 end
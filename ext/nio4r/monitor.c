@@ -4,6 +4,51 @@
  */
 
 #include "nio4r.h"
+#include <string.h>
+
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+/* accept_nonblock's first read */
+#ifdef MSG_DONTWAIT
+#define NIO_HAVE_RECV_DONTWAIT 1
+#endif
+#endif
+
+#if defined(__linux__) && defined(HAVE_NETINET_TCP_H)
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef TCP_INFO
+#define NIO_HAVE_TCP_INFO 1
+#endif
+/* Linux's TCP poll honours SO_RCVLOWAT */
+#ifdef SO_RCVLOWAT
+#define NIO_HAVE_KERNEL_RCVLOWAT 1
+#endif
+#ifdef SO_TIMESTAMPNS
+#define NIO_HAVE_RECEIVE_TIMESTAMPS 1
+#endif
+/* Listeners that only wake up once a new connection has sent something */
+#ifdef TCP_DEFER_ACCEPT
+#define NIO_HAVE_DEFER_ACCEPT 1
+#endif
+#endif
+
+/* How often to check whether enough bytes have arrived when emulating
+   SO_RCVLOWAT */
+#define MIN_READABLE_POLL_INTERVAL 0.001
+
+/* Most bytes accept_nonblock reads from a new connection by default */
+#define ACCEPT_READ_SIZE 16384
 
 static VALUE mNIO = Qnil;
 static VALUE cNIO_Monitor = Qnil;
@@ -19,15 +64,54 @@ static VALUE NIO_Monitor_close(int argc, VALUE *argv, VALUE self);
 static VALUE NIO_Monitor_is_closed(VALUE self);
 static VALUE NIO_Monitor_io(VALUE self);
 static VALUE NIO_Monitor_interests(VALUE self);
+static VALUE NIO_Monitor_set_interests(VALUE self, VALUE interests);
+static int NIO_Monitor_parse_interests(VALUE interests);
 static VALUE NIO_Monitor_selector(VALUE self);
 static VALUE NIO_Monitor_is_readable(VALUE self);
 static VALUE NIO_Monitor_is_writable(VALUE self);
 static VALUE NIO_Monitor_value(VALUE self);
 static VALUE NIO_Monitor_set_value(VALUE self, VALUE obj);
 static VALUE NIO_Monitor_readiness(VALUE self);
+static VALUE NIO_Monitor_tcp_info(int argc, VALUE *argv, VALUE self);
+static VALUE NIO_Monitor_is_slow(VALUE self);
+static VALUE NIO_Monitor_recycle(VALUE self);
+static VALUE NIO_Monitor_read_nonblock(int argc, VALUE *argv, VALUE self);
+static VALUE NIO_Monitor_write_nonblock(int argc, VALUE *argv, VALUE self);
+static VALUE NIO_Monitor_bytes_read(VALUE self);
+static VALUE NIO_Monitor_bytes_written(VALUE self);
+static VALUE NIO_Monitor_events(VALUE self);
+static VALUE NIO_Monitor_handler_time(VALUE self);
+static VALUE NIO_Monitor_last_activity(VALUE self);
+static VALUE NIO_Monitor_rate_limit(int argc, VALUE *argv, VALUE self);
+static VALUE NIO_Monitor_is_throttled(VALUE self);
+static VALUE NIO_Monitor_set_min_readable_bytes(VALUE self, VALUE bytes);
+static VALUE NIO_Monitor_min_readable_bytes(VALUE self);
+static VALUE NIO_Monitor_group(VALUE self);
+static VALUE NIO_Monitor_migrate_to(VALUE self, VALUE selector);
+static VALUE NIO_Monitor_set_receive_timestamps(VALUE self, VALUE enabled);
+static VALUE NIO_Monitor_is_receive_timestamps(VALUE self);
+static VALUE NIO_Monitor_received_at(VALUE self);
+static VALUE NIO_Monitor_set_defer_accept(VALUE self, VALUE seconds);
+static VALUE NIO_Monitor_accept_nonblock(int argc, VALUE *argv, VALUE self);
 
 /* Internal functions */
+static VALUE NIO_Monitor_io_call(VALUE self, const char *method, int argc, VALUE *argv);
 static void NIO_Monitor_callback(struct ev_loop *ev_loop, struct ev_io *io, int revents);
+static void NIO_Monitor_update_events(struct NIO_Monitor *monitor);
+static void NIO_Monitor_refill(struct NIO_Monitor *monitor);
+static void NIO_Monitor_rate_callback(struct ev_loop *ev_loop, struct ev_timer *timer, int revents);
+static int NIO_Monitor_short_of_bytes(struct NIO_Monitor *monitor);
+static void NIO_Monitor_min_readable_callback(struct ev_loop *ev_loop, struct ev_timer *timer, int revents);
+static VALUE NIO_Monitor_recvmsg(VALUE self, struct NIO_Monitor *monitor, int argc, VALUE *argv);
+#ifdef NIO_HAVE_RECEIVE_TIMESTAMPS
+static void NIO_Monitor_record_latency(struct NIO_Monitor *monitor);
+#endif
+static void NIO_Monitor_close_io(VALUE io, int async);
+static VALUE NIO_Monitor_close_io_protected(VALUE io);
+#ifndef NIO_HAVE_RECV_DONTWAIT
+static VALUE NIO_Monitor_read_first(VALUE args);
+static VALUE NIO_Monitor_read_first_failed(VALUE data, VALUE exception);
+#endif
 
 #if HAVE_RB_IO_T
   rb_io_t *fptr;
@@ -47,6 +131,7 @@ void Init_NIO_Monitor()
     rb_define_method(cNIO_Monitor, "closed?", NIO_Monitor_is_closed, 0);
     rb_define_method(cNIO_Monitor, "io", NIO_Monitor_io, 0);
     rb_define_method(cNIO_Monitor, "interests", NIO_Monitor_interests, 0);
+    rb_define_method(cNIO_Monitor, "interests=", NIO_Monitor_set_interests, 1);
     rb_define_method(cNIO_Monitor, "selector", NIO_Monitor_selector, 0);
     rb_define_method(cNIO_Monitor, "value", NIO_Monitor_value, 0);
     rb_define_method(cNIO_Monitor, "value=", NIO_Monitor_set_value, 1);
@@ -54,11 +139,35 @@ void Init_NIO_Monitor()
     rb_define_method(cNIO_Monitor, "readable?", NIO_Monitor_is_readable, 0);
     rb_define_method(cNIO_Monitor, "writable?", NIO_Monitor_is_writable, 0);
     rb_define_method(cNIO_Monitor, "writeable?", NIO_Monitor_is_writable, 0);
+    rb_define_method(cNIO_Monitor, "tcp_info", NIO_Monitor_tcp_info, -1);
+    rb_define_method(cNIO_Monitor, "slow?", NIO_Monitor_is_slow, 0);
+    rb_define_method(cNIO_Monitor, "recycle", NIO_Monitor_recycle, 0);
+    rb_define_method(cNIO_Monitor, "read_nonblock", NIO_Monitor_read_nonblock, -1);
+    rb_define_method(cNIO_Monitor, "write_nonblock", NIO_Monitor_write_nonblock, -1);
+    rb_define_method(cNIO_Monitor, "bytes_read", NIO_Monitor_bytes_read, 0);
+    rb_define_method(cNIO_Monitor, "bytes_written", NIO_Monitor_bytes_written, 0);
+    rb_define_method(cNIO_Monitor, "events", NIO_Monitor_events, 0);
+    rb_define_method(cNIO_Monitor, "handler_time", NIO_Monitor_handler_time, 0);
+    rb_define_method(cNIO_Monitor, "last_activity", NIO_Monitor_last_activity, 0);
+    rb_define_method(cNIO_Monitor, "rate_limit", NIO_Monitor_rate_limit, -1);
+    rb_define_method(cNIO_Monitor, "throttled?", NIO_Monitor_is_throttled, 0);
+    rb_define_method(cNIO_Monitor, "min_readable_bytes=", NIO_Monitor_set_min_readable_bytes, 1);
+    rb_define_method(cNIO_Monitor, "min_readable_bytes", NIO_Monitor_min_readable_bytes, 0);
+    rb_define_method(cNIO_Monitor, "group", NIO_Monitor_group, 0);
+    rb_define_method(cNIO_Monitor, "migrate_to", NIO_Monitor_migrate_to, 1);
+    rb_define_method(cNIO_Monitor, "receive_timestamps=", NIO_Monitor_set_receive_timestamps, 1);
+    rb_define_method(cNIO_Monitor, "receive_timestamps?", NIO_Monitor_is_receive_timestamps, 0);
+    rb_define_method(cNIO_Monitor, "received_at", NIO_Monitor_received_at, 0);
+    rb_define_method(cNIO_Monitor, "defer_accept=", NIO_Monitor_set_defer_accept, 1);
+    rb_define_method(cNIO_Monitor, "accept_nonblock", NIO_Monitor_accept_nonblock, -1);
 }
 
 static VALUE NIO_Monitor_allocate(VALUE klass)
 {
     struct NIO_Monitor *monitor = (struct NIO_Monitor *)xmalloc(sizeof(struct NIO_Monitor));
+    monitor->selector = 0;
+    monitor->group = 0;
+    monitor->prev = monitor->next = 0;
 
     return Data_Wrap_Struct(klass, NIO_Monitor_mark, NIO_Monitor_free, monitor);
 }
@@ -72,11 +181,28 @@ static void NIO_Monitor_free(struct NIO_Monitor *monitor)
     xfree(monitor);
 }
 
+/* libev events for :r, :w or :rw */
+static int NIO_Monitor_parse_interests(VALUE interests)
+{
+    ID interests_id = SYM2ID(interests);
+
+    if(interests_id == rb_intern("r")) {
+        return EV_READ;
+    } else if(interests_id == rb_intern("w")) {
+        return EV_WRITE;
+    } else if(interests_id == rb_intern("rw")) {
+        return EV_READ | EV_WRITE;
+    }
+
+    rb_raise(rb_eArgError, "invalid event type %s (must be :r, :w, or :rw)",
+        RSTRING_PTR(rb_funcall(interests, rb_intern("inspect"), 0, 0)));
+    return 0;
+}
+
 static VALUE NIO_Monitor_initialize(VALUE self, VALUE io, VALUE interests, VALUE selector_obj)
 {
     struct NIO_Monitor *monitor;
     struct NIO_Selector *selector;
-    ID interests_id;
 
     #if HAVE_RB_IO_T
         rb_io_t *fptr;
@@ -84,20 +210,8 @@ static VALUE NIO_Monitor_initialize(VALUE self, VALUE io, VALUE interests, VALUE
         OpenFile *fptr;
     #endif
 
-    interests_id = SYM2ID(interests);
-
     Data_Get_Struct(self, struct NIO_Monitor, monitor);
-
-    if(interests_id == rb_intern("r")) {
-        monitor->interests = EV_READ;
-    } else if(interests_id == rb_intern("w")) {
-        monitor->interests = EV_WRITE;
-    } else if(interests_id == rb_intern("rw")) {
-        monitor->interests = EV_READ | EV_WRITE;
-    } else {
-        rb_raise(rb_eArgError, "invalid event type %s (must be :r, :w, or :rw)",
-            RSTRING_PTR(rb_funcall(interests, rb_intern("inspect"), 0, 0)));
-    }
+    monitor->interests = NIO_Monitor_parse_interests(interests);
 
     GetOpenFile(rb_convert_type(io, T_FILE, "IO", "to_io"), fptr);
     ev_io_init(&monitor->ev_io, NIO_Selector_monitor_callback, FPTR_TO_FD(fptr), monitor->interests);
@@ -109,46 +223,256 @@ static VALUE NIO_Monitor_initialize(VALUE self, VALUE io, VALUE interests, VALUE
     Data_Get_Struct(selector_obj, struct NIO_Selector, selector);
 
     monitor->self = self;
+    monitor->revents = 0;
+    monitor->group = 0;
+    monitor->sample_countdown = monitor->slow_samples = 0;
+    memset(&monitor->accounting, 0, sizeof(struct NIO_Accounting));
+
+    monitor->rate = monitor->burst = monitor->tokens = 0;
+    monitor->throttled = 0;
+    ev_init(&monitor->rate_timer, NIO_Monitor_rate_callback);
+    monitor->rate_timer.data = (void *)monitor;
+
+    monitor->min_readable = 1;
+    monitor->min_readable_emulated = -1;
+    monitor->awaiting_bytes = 0;
+    ev_init(&monitor->min_readable_timer, NIO_Monitor_min_readable_callback);
+    monitor->min_readable_timer.data = (void *)monitor;
+
+    monitor->receive_timestamps = 0;
+    monitor->received_at = monitor->dispatched_at = 0;
+    monitor->pipeline_generation = 0;
+    monitor->dirty = 0;
+    monitor->prev_dirty = monitor->next_dirty = 0;
     monitor->ev_io.data = (void *)monitor;
 
     /* We can safely hang onto this as we also hang onto a reference to the
        object where it originally came from */
     monitor->selector = selector;
 
-    ev_io_start(selector->ev_loop, &monitor->ev_io);
+    /* Link into the selector's registration table */
+    monitor->prev = 0;
+    monitor->next = selector->monitors;
+    if(selector->monitors) {
+        selector->monitors->prev = monitor;
+    }
+    selector->monitors = monitor;
+
+    if(selector->pipeline) {
+        NIO_Pipeline_add(selector->pipeline, monitor);
+    } else {
+        ev_io_start(selector->ev_loop, &monitor->ev_io);
+    }
 
     return Qnil;
 }
 
 static VALUE NIO_Monitor_close(int argc, VALUE *argv, VALUE self)
 {
-    VALUE deregister, selector;
+    VALUE deregister, options, close_io, selector, waiter;
     struct NIO_Monitor *monitor;
     Data_Get_Struct(self, struct NIO_Monitor, monitor);
 
     rb_scan_args(argc, argv, "01", &deregister);
     selector = rb_ivar_get(self, rb_intern("selector"));
+    close_io = Qnil;
+
+    /* close(:deregister => true, :close_io => true or :async) */
+    if(TYPE(deregister) == T_HASH) {
+        options = deregister;
+        deregister = rb_hash_aref(options, ID2SYM(rb_intern("deregister")));
+        close_io = rb_hash_aref(options, ID2SYM(rb_intern("close_io")));
+
+        if(RTEST(close_io) && close_io != Qtrue && close_io != ID2SYM(rb_intern("async"))) {
+            rb_raise(rb_eArgError, "close_io must be true, false or :async");
+        }
+    }
+
+    /* A closed selector has already invalidated all of its monitors */
+    if(monitor->selector) {
+        if(monitor->selector->pipeline) {
+            NIO_Pipeline_remove(monitor->selector->pipeline, monitor);
+        } else {
+            ev_io_stop(monitor->selector->ev_loop, &monitor->ev_io);
+        }
+        ev_timer_stop(monitor->selector->ev_loop, &monitor->rate_timer);
+        ev_timer_stop(monitor->selector->ev_loop, &monitor->min_readable_timer);
+        NIO_Monitor_reset_min_readable(monitor);
+        NIO_Monitor_leave_group(monitor);
+        NIO_Monitor_undirty(monitor);
+
+        if(monitor->prev) {
+            monitor->prev->next = monitor->next;
+        } else {
+            monitor->selector->monitors = monitor->next;
+        }
+        if(monitor->next) {
+            monitor->next->prev = monitor->prev;
+        }
+        monitor->prev = monitor->next = 0;
 
-    if(selector != Qnil) {
-        ev_io_stop(monitor->selector->ev_loop, &monitor->ev_io);
         monitor->selector = 0;
         rb_ivar_set(self, rb_intern("selector"), Qnil);
 
+        /* Watched processes own their IO, a pidfd or a waiter's pipe, and a
+           waiter's thread mustn't outlive the monitor */
+        if(RTEST(rb_ivar_defined(self, rb_intern("pid"))) && rb_ivar_get(self, rb_intern("pid")) != Qnil) {
+            waiter = rb_ivar_get(self, rb_intern("process_waiter"));
+            if(waiter != Qnil) {
+                rb_funcall(waiter, rb_intern("close"), 0);
+            } else if(!RTEST(close_io)) {
+                close_io = Qtrue;
+            }
+        }
+
         /* Default value is true */
         if(deregister == Qtrue || deregister == Qnil) {
             rb_funcall(selector, rb_intern("deregister"), 1, rb_ivar_get(self, rb_intern("io")));
         }
     }
 
+    if(RTEST(close_io)) {
+        NIO_Monitor_close_io(rb_ivar_get(self, rb_intern("io")), close_io != Qtrue);
+    }
+
     return Qnil;
 }
 
+/* Close a monitor's IO. Asynchronous closes detach the fd from the IO
+   first, so closing the IO here leaves it open, and the closer thread does
+   the real close. The fd number stays taken until then, so nothing can
+   reuse it while the loop's backend might still have it registered */
+static void NIO_Monitor_close_io(VALUE io, int async)
+{
+#if HAVE_RB_IO_T
+    rb_io_t *fptr;
+#else
+    OpenFile *fptr;
+#endif
+    VALUE io_obj;
+    int fd = -1, state = 0;
+
+    if(io == Qnil || RTEST(rb_funcall(io, rb_intern("closed?"), 0))) {
+        return;
+    }
+
+    if(async) {
+        io_obj = rb_convert_type(io, T_FILE, "IO", "to_io");
+        GetOpenFile(io_obj, fptr);
+        fd = FPTR_TO_FD(fptr);
+
+        /* Rubies without IO#autoclose= get a dup, which frees the fd number
+           straight away but still leaves the slow part to the closer */
+        if(rb_respond_to(io_obj, rb_intern("autoclose="))) {
+            rb_funcall(io_obj, rb_intern("autoclose="), 1, Qfalse);
+        } else {
+            fd = dup(fd);
+        }
+    }
+
+    /* If dup failed, this is an ordinary close */
+    rb_protect(NIO_Monitor_close_io_protected, io, &state);
+
+    if(fd >= 0) {
+        NIO_Closer_close(fd);
+    }
+
+    if(state) {
+        rb_jump_tag(state);
+    }
+}
+
+static VALUE NIO_Monitor_close_io_protected(VALUE io)
+{
+    return rb_funcall(io, rb_intern("close"), 0);
+}
+
+/* Close the monitor and hand it back to its selector, which reuses it for
+   the next register(io, interests, :reuse => true) */
+static VALUE NIO_Monitor_recycle(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    selector = monitor->selector;
+    if(!selector) {
+        return Qnil;
+    }
+
+    NIO_Monitor_close(0, 0, self);
+
+    /* Don't keep the IO or value alive while we sit in the pool */
+    rb_ivar_set(self, rb_intern("io"), Qnil);
+    rb_ivar_set(self, rb_intern("value"), Qnil);
+
+    /* Nor what Selector#watch_process left behind */
+    if(RTEST(rb_ivar_defined(self, rb_intern("pid")))) {
+        rb_ivar_set(self, rb_intern("pid"), Qnil);
+        rb_ivar_set(self, rb_intern("process_waiter"), Qnil);
+        rb_ivar_set(self, rb_intern("status"), Qnil);
+    }
+
+    if(!selector->closed && selector->free_count < NIO_MONITOR_POOL_SIZE) {
+        monitor->next = selector->free_monitors;
+        selector->free_monitors = monitor;
+        selector->free_count++;
+    }
+
+    return Qnil;
+}
+
+void NIO_Monitor_leave_group(struct NIO_Monitor *monitor)
+{
+    struct NIO_Group *group = monitor->group;
+
+    if(group) {
+        group->monitors--;
+        monitor->group = 0;
+        NIO_Selector_release_group(monitor->selector, group);
+    }
+}
+
+/* Move this monitor to another selector. Unlike deregistering and
+   registering again, it stays the same Monitor, with the same value */
+static VALUE NIO_Monitor_migrate_to(VALUE self, VALUE selector)
+{
+    VALUE current;
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    if(!monitor->selector) {
+        rb_raise(rb_eIOError, "monitor is closed");
+    }
+
+    current = rb_ivar_get(self, rb_intern("selector"));
+    if(current == selector) {
+        return self;
+    }
+
+    /* It may have been closed while we waited for the locks */
+    if(RARRAY_LEN(NIO_Selector_migrate(current, rb_ary_new3(1, self), selector)) == 0) {
+        rb_raise(rb_eIOError, "monitor is closed");
+    }
+
+    return self;
+}
+
+/* The group the monitor was registered with, if any */
+static VALUE NIO_Monitor_group(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    return monitor->group ? monitor->group->key : Qnil;
+}
+
 static VALUE NIO_Monitor_is_closed(VALUE self)
 {
     struct NIO_Monitor *monitor;
     Data_Get_Struct(self, struct NIO_Monitor, monitor);
 
-    return !monitor->selector;
+    return monitor->selector ? Qfalse : Qtrue;
 }
 
 static VALUE NIO_Monitor_io(VALUE self)
@@ -161,6 +485,44 @@ static VALUE NIO_Monitor_interests(VALUE self)
     return rb_ivar_get(self, rb_intern("interests"));
 }
 
+/* Change what the monitor waits for. The watcher isn't touched until the
+   next select, so a handler can flip interests back and forth and only
+   the last change costs anything */
+static VALUE NIO_Monitor_set_interests(VALUE self, VALUE interests)
+{
+    struct NIO_Monitor *monitor;
+    struct NIO_Selector *selector;
+    int events;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    selector = monitor->selector;
+    if(!selector) {
+        rb_raise(rb_eIOError, "monitor is closed");
+    }
+
+    events = NIO_Monitor_parse_interests(interests);
+    rb_ivar_set(self, rb_intern("interests"), interests);
+
+    if(events == monitor->interests) {
+        return interests;
+    }
+
+    monitor->interests = events;
+    selector->interest_changes++;
+
+    if(!monitor->dirty) {
+        monitor->dirty = 1;
+        monitor->prev_dirty = 0;
+        monitor->next_dirty = selector->dirty;
+        if(selector->dirty) {
+            selector->dirty->prev_dirty = monitor;
+        }
+        selector->dirty = monitor;
+    }
+
+    return interests;
+}
+
 static VALUE NIO_Monitor_selector(VALUE self)
 {
     return rb_ivar_get(self, rb_intern("selector"));
@@ -214,4 +576,826 @@ static VALUE NIO_Monitor_is_writable(VALUE self)
     } else {
         return Qfalse;
     }
-}
\ No newline at end of file
+}
+
+#ifdef NIO_HAVE_TCP_INFO
+/* Leading part of the kernel's struct tcp_info. libc headers tend to lag
+   behind the kernel, so we declare the fields we need ourselves. The kernel
+   only ever appends to this structure, and reports how much of it it filled */
+struct NIO_tcp_info
+{
+    uint8_t  state, ca_state, retransmits, probes, backoff, options, wscale, app_limited;
+    uint32_t rto, ato, snd_mss, rcv_mss;
+    uint32_t unacked, sacked, lost, retrans, fackets;
+    uint32_t last_data_sent, last_ack_sent, last_data_recv, last_ack_recv;
+    uint32_t pmtu, rcv_ssthresh, rtt, rttvar, snd_ssthresh, snd_cwnd, advmss, reordering;
+    uint32_t rcv_rtt, rcv_space, total_retrans;
+    uint64_t pacing_rate, max_pacing_rate, bytes_acked, bytes_received;
+    uint32_t segs_out, segs_in, notsent_bytes, min_rtt, data_segs_in, data_segs_out;
+    uint64_t delivery_rate;
+};
+
+#define NIO_TCP_INFO_HAS(len, field) \
+    ((len) >= offsetof(struct NIO_tcp_info, field) + sizeof(((struct NIO_tcp_info *)0)->field))
+
+/* Fetch TCP_INFO for the monitor's socket, returning the length filled in */
+static socklen_t NIO_Monitor_fetch_tcp_info(struct NIO_Monitor *monitor, struct NIO_tcp_info *info)
+{
+    socklen_t len = sizeof(struct NIO_tcp_info);
+
+    memset(info, 0, sizeof(struct NIO_tcp_info));
+    if(getsockopt(monitor->ev_io.fd, IPPROTO_TCP, TCP_INFO, (void *)info, &len) < 0) {
+        return 0;
+    }
+
+    return len;
+}
+#endif /* NIO_HAVE_TCP_INFO */
+
+/* Sample the socket's TCP statistics without allocating any Ruby objects.
+   If an NIO::TCPInfo is passed in it's filled in place and returned */
+static VALUE NIO_Monitor_tcp_info(int argc, VALUE *argv, VALUE self)
+{
+#ifdef NIO_HAVE_TCP_INFO
+    VALUE info;
+    socklen_t len;
+    struct NIO_tcp_info tcp_info;
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    rb_scan_args(argc, argv, "01", &info);
+
+    if(info == Qnil) {
+        info = rb_class_new_instance(0, 0, rb_const_get(mNIO, rb_intern("TCPInfo")));
+    }
+
+    len = NIO_Monitor_fetch_tcp_info(monitor, &tcp_info);
+    if(!len) {
+        rb_sys_fail("getsockopt(TCP_INFO)");
+    }
+
+    rb_struct_aset(info, INT2FIX(0), UINT2NUM(tcp_info.rtt));
+    rb_struct_aset(info, INT2FIX(1), UINT2NUM(tcp_info.unacked));
+
+    if(NIO_TCP_INFO_HAS(len, notsent_bytes)) {
+        rb_struct_aset(info, INT2FIX(2), UINT2NUM(tcp_info.notsent_bytes));
+    } else {
+        rb_struct_aset(info, INT2FIX(2), Qnil);
+    }
+
+    if(NIO_TCP_INFO_HAS(len, delivery_rate)) {
+        rb_struct_aset(info, INT2FIX(3), ULL2NUM(tcp_info.delivery_rate));
+    } else {
+        rb_struct_aset(info, INT2FIX(3), Qnil);
+    }
+
+    return info;
+#else
+    rb_raise(rb_eNotImpError, "TCP_INFO is not supported on this platform");
+#endif
+}
+
+/* Has the slow client policy flagged this monitor? */
+static VALUE NIO_Monitor_is_slow(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    return monitor->slow_samples >= NIO_SLOW_CLIENT_SAMPLES ? Qtrue : Qfalse;
+}
+
+/* Call a method on the monitored IO object, passing keyword arguments
+   (e.g. exception: false) through where the Ruby version has them */
+static VALUE NIO_Monitor_io_call(VALUE self, const char *method, int argc, VALUE *argv)
+{
+    VALUE io = rb_ivar_get(self, rb_intern("io"));
+
+#ifdef RB_PASS_CALLED_KEYWORDS
+    return rb_funcallv_kw(io, rb_intern(method), argc, argv, RB_PASS_CALLED_KEYWORDS);
+#else
+    return rb_funcall2(io, rb_intern(method), argc, argv);
+#endif
+}
+
+/* IO#read_nonblock, counting the bytes read if accounting is on */
+static VALUE NIO_Monitor_read_nonblock(int argc, VALUE *argv, VALUE self)
+{
+    VALUE result;
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    result = Qundef;
+    if(monitor->receive_timestamps && monitor->selector) {
+        result = NIO_Monitor_recvmsg(self, monitor, argc, argv);
+    }
+
+    if(result == Qundef) {
+        result = NIO_Monitor_io_call(self, "read_nonblock", argc, argv);
+    }
+
+    if(!monitor->selector || TYPE(result) != T_STRING) {
+        return result;
+    }
+
+    if(monitor->selector->accounting) {
+        monitor->accounting.bytes_read += RSTRING_LEN(result);
+    }
+
+    if(monitor->rate > 0) {
+        NIO_Monitor_refill(monitor);
+        monitor->tokens -= RSTRING_LEN(result);
+
+        /* Out of tokens: stop reading until the bucket has refilled. The
+           kernel's receive window pushes back on the client meanwhile */
+        if(monitor->tokens < 1 && !monitor->throttled) {
+            NIO_Monitor_pause_reads(monitor, (1 - monitor->tokens) / monitor->rate);
+        }
+    }
+
+    return result;
+}
+
+/* IO#write_nonblock, counting the bytes written if accounting is on */
+static VALUE NIO_Monitor_write_nonblock(int argc, VALUE *argv, VALUE self)
+{
+    VALUE result;
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    result = NIO_Monitor_io_call(self, "write_nonblock", argc, argv);
+
+    if(monitor->selector && monitor->selector->accounting && FIXNUM_P(result)) {
+        monitor->accounting.bytes_written += FIX2LONG(result);
+    }
+
+    return result;
+}
+
+static VALUE NIO_Monitor_bytes_read(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    return ULL2NUM(monitor->accounting.bytes_read);
+}
+
+static VALUE NIO_Monitor_bytes_written(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    return ULL2NUM(monitor->accounting.bytes_written);
+}
+
+static VALUE NIO_Monitor_events(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    return ULONG2NUM(monitor->accounting.events);
+}
+
+static VALUE NIO_Monitor_handler_time(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    return rb_float_new(monitor->accounting.handler_time);
+}
+
+static VALUE NIO_Monitor_last_activity(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    if(!monitor->accounting.events) {
+        return Qnil;
+    }
+
+    return rb_float_new(monitor->accounting.last_activity);
+}
+
+/* Limit how fast data is read through #read_nonblock to rate bytes per
+   second, allowing bursts of up to burst bytes (one second's worth by
+   default). Once the bucket runs dry the monitor stops selecting for reads
+   until it refills. Passing nil removes the limit */
+static VALUE NIO_Monitor_rate_limit(int argc, VALUE *argv, VALUE self)
+{
+    VALUE rate, burst;
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    rb_scan_args(argc, argv, "11", &rate, &burst);
+
+    if(!monitor->selector) {
+        rb_raise(rb_eIOError, "monitor is closed");
+    }
+
+    if(rate == Qnil) {
+        monitor->rate = 0;
+
+        if(monitor->throttled) {
+            ev_timer_stop(monitor->selector->ev_loop, &monitor->rate_timer);
+            monitor->throttled = 0;
+            NIO_Monitor_update_events(monitor);
+        }
+
+        return Qnil;
+    }
+
+    if(NUM2DBL(rate) <= 0) {
+        rb_raise(rb_eArgError, "rate must be positive");
+    }
+
+    /* The poller thread has no way to pause reads for the bucket */
+    if(monitor->selector->pipeline) {
+        rb_raise(rb_eNotImpError, "rate limiting isn't supported on pipelined selectors");
+    }
+
+    if(burst != Qnil && NUM2DBL(burst) < 1) {
+        rb_raise(rb_eArgError, "burst must be at least one byte");
+    }
+
+    monitor->rate = NUM2DBL(rate);
+    monitor->burst = burst == Qnil ? monitor->rate : NUM2DBL(burst);
+
+    if(monitor->burst < 1) {
+        monitor->burst = 1;
+    }
+
+    monitor->tokens = monitor->burst;
+    monitor->refilled_at = ev_now(monitor->selector->ev_loop);
+
+    return Qnil;
+}
+
+/* Has the rate limiter or slow client policy stopped this monitor from
+   reading? */
+static VALUE NIO_Monitor_is_throttled(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    return monitor->throttled ? Qtrue : Qfalse;
+}
+
+/* The monitor's interests, leaving out reads while it's throttled or
+   waiting for enough bytes to arrive */
+int NIO_Monitor_watched_events(struct NIO_Monitor *monitor)
+{
+    int events = monitor->interests;
+
+    if(monitor->throttled || monitor->awaiting_bytes) {
+        events &= ~EV_READ;
+    }
+
+    return events;
+}
+
+/* Point the monitor's watcher at the events it should wait for */
+static void NIO_Monitor_update_events(struct NIO_Monitor *monitor)
+{
+    struct ev_loop *ev_loop = monitor->selector->ev_loop;
+    int events = NIO_Monitor_watched_events(monitor);
+
+    ev_io_stop(ev_loop, &monitor->ev_io);
+    ev_io_set(&monitor->ev_io, monitor->ev_io.fd, events);
+
+    if(events) {
+        ev_io_start(ev_loop, &monitor->ev_io);
+    }
+}
+
+/* Apply the interest changes made since the last select: one watcher
+   update per monitor, however many times its interests changed, and none
+   at all if they changed back */
+void NIO_Monitor_flush_interests(struct NIO_Selector *selector)
+{
+    struct NIO_Monitor *monitor;
+    int events;
+
+    while((monitor = selector->dirty)) {
+        selector->dirty = monitor->next_dirty;
+        if(selector->dirty) {
+            selector->dirty->prev_dirty = 0;
+        }
+        monitor->next_dirty = 0;
+        monitor->dirty = 0;
+
+        /* The watcher's events are what was last applied, pipelined or not */
+        events = NIO_Monitor_watched_events(monitor);
+        if(events == (monitor->ev_io.events & (EV_READ | EV_WRITE))) {
+            continue;
+        }
+
+        if(selector->pipeline) {
+            ev_io_set(&monitor->ev_io, monitor->ev_io.fd, events);
+            NIO_Pipeline_modify(selector->pipeline, monitor);
+        } else {
+            NIO_Monitor_update_events(monitor);
+        }
+
+        selector->interest_updates++;
+    }
+}
+
+void NIO_Monitor_undirty(struct NIO_Monitor *monitor)
+{
+    if(!monitor->dirty) {
+        return;
+    }
+
+    if(monitor->prev_dirty) {
+        monitor->prev_dirty->next_dirty = monitor->next_dirty;
+    } else {
+        monitor->selector->dirty = monitor->next_dirty;
+    }
+    if(monitor->next_dirty) {
+        monitor->next_dirty->prev_dirty = monitor->prev_dirty;
+    }
+
+    monitor->prev_dirty = monitor->next_dirty = 0;
+    monitor->dirty = 0;
+}
+
+/* Add the tokens earned since the bucket was last refilled */
+static void NIO_Monitor_refill(struct NIO_Monitor *monitor)
+{
+    ev_tstamp now = ev_now(monitor->selector->ev_loop);
+
+    monitor->tokens += monitor->rate * (now - monitor->refilled_at);
+    if(monitor->tokens > monitor->burst) {
+        monitor->tokens = monitor->burst;
+    }
+
+    monitor->refilled_at = now;
+}
+
+/* Stop selecting the monitor for reads until the rate timer fires. Used
+   by the rate limiter and the slow client policy's :throttle action */
+void NIO_Monitor_pause_reads(struct NIO_Monitor *monitor, ev_tstamp seconds)
+{
+    monitor->throttled = 1;
+    NIO_Monitor_update_events(monitor);
+
+    ev_timer_set(&monitor->rate_timer, seconds, 0.);
+    ev_timer_start(monitor->selector->ev_loop, &monitor->rate_timer);
+}
+
+/* The bucket has refilled, so start reading again */
+static void NIO_Monitor_rate_callback(struct ev_loop *ev_loop, struct ev_timer *timer, int revents)
+{
+    struct NIO_Monitor *monitor = (struct NIO_Monitor *)timer->data;
+
+    NIO_Monitor_refill(monitor);
+    monitor->throttled = 0;
+    NIO_Monitor_update_events(monitor);
+}
+
+/* Only report the monitor readable once at least bytes are buffered. TCP
+   sockets on Linux use SO_RCVLOWAT. Elsewhere this is emulated: if fewer
+   bytes have arrived, reads are paused and FIONREAD polled until they
+   have. Cheap enough to change for every frame */
+static VALUE NIO_Monitor_set_min_readable_bytes(VALUE self, VALUE bytes)
+{
+    struct NIO_Monitor *monitor;
+    int min_readable = bytes == Qnil ? 1 : NUM2INT(bytes);
+#ifdef NIO_HAVE_KERNEL_RCVLOWAT
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int type;
+#endif
+
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    if(!monitor->selector) {
+        rb_raise(rb_eIOError, "monitor is closed");
+    }
+
+    if(min_readable < 1) {
+        rb_raise(rb_eArgError, "minimum must be at least one byte");
+    }
+
+    if(min_readable == monitor->min_readable) {
+        return bytes;
+    }
+
+    /* Work out whether the kernel can do this for us the first time round */
+    if(monitor->min_readable_emulated < 0) {
+        monitor->min_readable_emulated = 1;
+
+#ifdef NIO_HAVE_KERNEL_RCVLOWAT
+        len = sizeof(type);
+        if(getsockopt(monitor->ev_io.fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM) {
+            len = sizeof(addr);
+            if(getsockname(monitor->ev_io.fd, (struct sockaddr *)&addr, &len) == 0 &&
+               (addr.ss_family == AF_INET || addr.ss_family == AF_INET6)) {
+                monitor->min_readable_emulated = 0;
+            }
+        }
+#endif
+    }
+
+#ifdef NIO_HAVE_KERNEL_RCVLOWAT
+    if(!monitor->min_readable_emulated &&
+       setsockopt(monitor->ev_io.fd, SOL_SOCKET, SO_RCVLOWAT, &min_readable, sizeof(min_readable)) < 0) {
+        monitor->min_readable_emulated = 1;
+    }
+#endif
+
+    /* Emulation pauses reads with the event loop, which the poller thread
+       doesn't go through */
+    if(monitor->min_readable_emulated && min_readable > 1 && monitor->selector->pipeline) {
+        rb_raise(rb_eNotImpError, "min_readable_bytes needs SO_RCVLOWAT on pipelined selectors");
+    }
+
+#ifndef FIONREAD
+    if(monitor->min_readable_emulated && min_readable > 1) {
+        rb_raise(rb_eNotImpError, "min_readable_bytes isn't supported for this IO on this platform");
+    }
+#endif
+
+    monitor->min_readable = min_readable;
+
+    /* Let the next select check against the new minimum */
+    if(monitor->awaiting_bytes) {
+        ev_timer_stop(monitor->selector->ev_loop, &monitor->min_readable_timer);
+        monitor->awaiting_bytes = 0;
+        NIO_Monitor_update_events(monitor);
+    }
+
+    return bytes;
+}
+
+/* SO_RCVLOWAT belongs to the socket, so it would outlive the monitor on an
+   IO that's still in use */
+void NIO_Monitor_reset_min_readable(struct NIO_Monitor *monitor)
+{
+#ifdef NIO_HAVE_KERNEL_RCVLOWAT
+    int one = 1;
+    VALUE io;
+
+    if(monitor->min_readable > 1 && !monitor->min_readable_emulated) {
+        io = rb_convert_type(rb_ivar_get(monitor->self, rb_intern("io")), T_FILE, "IO", "to_io");
+
+        if(!RTEST(rb_funcall(io, rb_intern("closed?"), 0))) {
+            setsockopt(monitor->ev_io.fd, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+        }
+    }
+#endif
+
+    monitor->min_readable = 1;
+}
+
+static VALUE NIO_Monitor_min_readable_bytes(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    return INT2NUM(monitor->min_readable);
+}
+
+/* Are some, but fewer than the minimum, bytes waiting to be read? If the
+   other end has hung up, what's there is all we're getting */
+static int NIO_Monitor_short_of_bytes(struct NIO_Monitor *monitor)
+{
+#ifdef FIONREAD
+    int bytes;
+#ifdef HAVE_POLL_H
+    struct pollfd pfd;
+#endif
+
+    if(ioctl(monitor->ev_io.fd, FIONREAD, &bytes) < 0 || bytes <= 0 || bytes >= monitor->min_readable) {
+        return 0;
+    }
+
+#ifdef HAVE_POLL_H
+    pfd.fd = monitor->ev_io.fd;
+    pfd.events = POLLIN;
+#ifdef POLLRDHUP
+    pfd.events |= POLLRDHUP;
+#endif
+
+    if(poll(&pfd, 1, 0) > 0 && (pfd.revents & ~POLLIN)) {
+        return 0;
+    }
+#endif
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* Called from the selector when the monitor's IO is readable. If we're
+   emulating SO_RCVLOWAT and not enough has arrived yet, pause reads until
+   it has and return true. Errors and EOF (nothing to read) always count
+   as readable */
+int NIO_Monitor_short_read(struct NIO_Monitor *monitor)
+{
+    if(monitor->min_readable <= 1 || !monitor->min_readable_emulated || !NIO_Monitor_short_of_bytes(monitor)) {
+        return 0;
+    }
+
+    monitor->awaiting_bytes = 1;
+    NIO_Monitor_update_events(monitor);
+
+    ev_timer_set(&monitor->min_readable_timer, MIN_READABLE_POLL_INTERVAL, 0.);
+    ev_timer_start(monitor->selector->ev_loop, &monitor->min_readable_timer);
+
+    return 1;
+}
+
+/* Check whether enough bytes have arrived to start reading again */
+static void NIO_Monitor_min_readable_callback(struct ev_loop *ev_loop, struct ev_timer *timer, int revents)
+{
+    struct NIO_Monitor *monitor = (struct NIO_Monitor *)timer->data;
+
+    if(NIO_Monitor_short_of_bytes(monitor)) {
+        ev_timer_set(timer, MIN_READABLE_POLL_INTERVAL, 0.);
+        ev_timer_start(ev_loop, timer);
+        return;
+    }
+
+    monitor->awaiting_bytes = 0;
+    NIO_Monitor_update_events(monitor);
+}
+
+/* Ask the kernel to timestamp data as it arrives on the monitor's socket.
+   Monitor#read_nonblock then records the timestamp of what it read (the
+   datagram, or on TCP the latest segment it read from), and how long that
+   waited to be dispatched */
+static VALUE NIO_Monitor_set_receive_timestamps(VALUE self, VALUE enabled)
+{
+    struct NIO_Monitor *monitor;
+    int on = RTEST(enabled);
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    if(!monitor->selector) {
+        rb_raise(rb_eIOError, "monitor is closed");
+    }
+
+#ifdef NIO_HAVE_RECEIVE_TIMESTAMPS
+    if(setsockopt(monitor->ev_io.fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        rb_sys_fail("setsockopt");
+    }
+#else
+    if(on) {
+        rb_raise(rb_eNotImpError, "receive timestamps aren't supported on this platform");
+    }
+#endif
+
+    monitor->receive_timestamps = on;
+    monitor->dispatched_at = 0;
+
+    return enabled;
+}
+
+static VALUE NIO_Monitor_is_receive_timestamps(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    return monitor->receive_timestamps ? Qtrue : Qfalse;
+}
+
+/* The kernel's receive timestamp for the last timestamped read_nonblock,
+   or nil. On TCP that's the latest segment the read took data from */
+static VALUE NIO_Monitor_received_at(VALUE self)
+{
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    if(monitor->received_at == 0) {
+        return Qnil;
+    }
+
+    return rb_float_new(monitor->received_at);
+}
+
+/* read_nonblock(maxlen, buffer = nil) with recvmsg, picking up the kernel's
+   receive timestamp. Returns Qundef to leave buffered data, EOF, errors and
+   EAGAIN to IO#read_nonblock, so they behave just like they usually do */
+static VALUE NIO_Monitor_recvmsg(VALUE self, struct NIO_Monitor *monitor, int argc, VALUE *argv)
+{
+#ifdef NIO_HAVE_RECEIVE_TIMESTAMPS
+    VALUE io, buffer;
+    long maxlen, original = -1;
+    ssize_t length;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct timespec timestamp;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+
+    #if HAVE_RB_IO_T
+        rb_io_t *fptr;
+    #else
+        OpenFile *fptr;
+    #endif
+
+    if(argc < 1 || argc > 3) {
+        return Qundef;
+    }
+
+    maxlen = NUM2LONG(argv[0]);
+    if(maxlen <= 0) {
+        return Qundef;
+    }
+
+    /* Wrappers like SSL sockets have to do their own reading */
+    io = rb_ivar_get(self, rb_intern("io"));
+    if(TYPE(io) != T_FILE) {
+        return Qundef;
+    }
+    GetOpenFile(io, fptr);
+
+#ifdef HAVE_RB_IO_READ_PENDING
+    if(rb_io_read_pending(fptr)) {
+        return Qundef;
+    }
+#endif
+
+    if(argc > 1 && TYPE(argv[1]) == T_STRING) {
+        buffer = argv[1];
+        rb_str_modify(buffer);
+
+        /* Grown only as far as needed, and put back if nothing's read */
+        if(RSTRING_LEN(buffer) < maxlen) {
+            original = RSTRING_LEN(buffer);
+            rb_str_resize(buffer, maxlen);
+        }
+    } else {
+        buffer = rb_str_new(0, maxlen);
+    }
+
+    iov.iov_base = RSTRING_PTR(buffer);
+    iov.iov_len = maxlen;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    length = recvmsg(monitor->ev_io.fd, &msg, MSG_DONTWAIT);
+    if(length <= 0) {
+        if(original >= 0) {
+            rb_str_resize(buffer, original);
+        }
+        return Qundef;
+    }
+
+    rb_str_resize(buffer, length);
+
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&timestamp, CMSG_DATA(cmsg), sizeof(timestamp));
+            monitor->received_at = timestamp.tv_sec + timestamp.tv_nsec / 1e9;
+            NIO_Monitor_record_latency(monitor);
+        }
+    }
+
+    return buffer;
+#else
+    return Qundef;
+#endif
+}
+
+/* Only report a listener readable once a new connection has sent some
+   data, waiting up to the given number of seconds for it. 0 or false
+   turns it off */
+static VALUE NIO_Monitor_set_defer_accept(VALUE self, VALUE seconds)
+{
+    struct NIO_Monitor *monitor;
+    int value = RTEST(seconds) ? NUM2INT(seconds) : 0;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    if(!monitor->selector) {
+        rb_raise(rb_eIOError, "monitor is closed");
+    }
+
+#ifdef NIO_HAVE_DEFER_ACCEPT
+    if(setsockopt(monitor->ev_io.fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &value, sizeof(value)) < 0) {
+        rb_sys_fail("setsockopt");
+    }
+#else
+    if(value) {
+        rb_raise(rb_eNotImpError, "TCP_DEFER_ACCEPT isn't supported on this platform");
+    }
+#endif
+
+    return seconds;
+}
+
+/* Accept a connection and read whatever the client has sent in the same
+   call, so a deferred listener's one wakeup covers both. Returns [socket,
+   data]: data is empty if nothing has arrived yet and nil if the client
+   has already hung up */
+static VALUE NIO_Monitor_accept_nonblock(int argc, VALUE *argv, VALUE self)
+{
+#ifdef NIO_HAVE_RECV_DONTWAIT
+#if HAVE_RB_IO_T
+    rb_io_t *fptr;
+#else
+    OpenFile *fptr;
+#endif
+#endif
+    VALUE maxlen, socket, buffer;
+    long length;
+    struct NIO_Monitor *monitor;
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+
+    rb_scan_args(argc, argv, "01", &maxlen);
+
+    length = maxlen == Qnil ? ACCEPT_READ_SIZE : NUM2LONG(maxlen);
+    if(length <= 0) {
+        rb_raise(rb_eArgError, "maxlen must be positive");
+    }
+
+    /* The listener's own accept_nonblock makes the right kind of socket,
+       and raises IO::WaitReadable as usual if there's nothing to accept */
+    socket = NIO_Monitor_io_call(self, "accept_nonblock", 0, 0);
+
+    /* Whether or not the listener defers accepts, a client that sends
+       right away has usually done so by now */
+#ifdef NIO_HAVE_RECV_DONTWAIT
+    GetOpenFile(rb_convert_type(socket, T_FILE, "IO", "to_io"), fptr);
+    buffer = rb_str_new(0, length);
+    length = recv(FPTR_TO_FD(fptr), RSTRING_PTR(buffer), length, MSG_DONTWAIT);
+
+    if(length == 0) {
+        buffer = Qnil;
+    } else {
+        /* Errors other than EAGAIN turn up on the next read */
+        rb_str_resize(buffer, length > 0 ? length : 0);
+    }
+#else
+    buffer = rb_rescue2(NIO_Monitor_read_first, rb_ary_new3(2, socket, LONG2NUM(length)),
+        NIO_Monitor_read_first_failed, Qnil, rb_eEOFError, rb_eSystemCallError, (VALUE)0);
+#endif
+
+    if(buffer != Qnil && monitor->selector && monitor->selector->accounting) {
+        monitor->accounting.bytes_read += RSTRING_LEN(buffer);
+    }
+
+    return rb_ary_new3(2, socket, buffer);
+}
+
+#ifndef NIO_HAVE_RECV_DONTWAIT
+/* accept_nonblock's first read without recv(MSG_DONTWAIT) */
+static VALUE NIO_Monitor_read_first(VALUE args)
+{
+    return rb_funcall(rb_ary_entry(args, 0), rb_intern("read_nonblock"), 1, rb_ary_entry(args, 1));
+}
+
+/* Nothing yet (EAGAIN) or an error the next read will report, unless the
+   client has already hung up */
+static VALUE NIO_Monitor_read_first_failed(VALUE data, VALUE exception)
+{
+    return rb_obj_is_kind_of(exception, rb_eEOFError) ? Qnil : rb_str_new(0, 0);
+}
+#endif
+
+#ifdef NIO_HAVE_RECEIVE_TIMESTAMPS
+/* Add the time between the kernel timestamping what we just read and the
+   selector dispatching the monitor to the selector's histogram. Only the
+   first read after each dispatch counts */
+static void NIO_Monitor_record_latency(struct NIO_Monitor *monitor)
+{
+    double microseconds;
+    int bucket = 0;
+
+    if(monitor->dispatched_at == 0) {
+        return;
+    }
+
+    microseconds = (monitor->dispatched_at - monitor->received_at) * 1e6;
+    monitor->dispatched_at = 0;
+
+    while(bucket < NIO_LATENCY_BUCKETS - 1 && microseconds >= (double)(1UL << bucket)) {
+        bucket++;
+    }
+
+    monitor->selector->receive_latency[bucket]++;
+}
+#endif
+
+/* Used by the selector's slow client policy. Called from libev callbacks so
+   this must not allocate */
+int NIO_Monitor_send_queue(struct NIO_Monitor *monitor)
+{
+#ifdef NIO_HAVE_TCP_INFO
+    socklen_t len;
+    struct NIO_tcp_info tcp_info;
+
+    len = NIO_Monitor_fetch_tcp_info(monitor, &tcp_info);
+    if(!NIO_TCP_INFO_HAS(len, notsent_bytes)) {
+        return -1;
+    }
+
+    return (int)tcp_info.notsent_bytes;
+#else
+    return -1;
+#endif
+}
@@ -10,6 +10,21 @@
 #include "rubyio.h"
 #include "libev.h"
 
+/* Buckets in the receive latency histogram. The last one catches
+   everything over 2^30 microseconds */
+#define NIO_LATENCY_BUCKETS 32
+
+/* Pipelined polling needs epoll and a native thread that can wait for
+   events without holding the GVL */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_PTHREAD_H) && defined(HAVE_RB_THREAD_BLOCKING_REGION)
+#define NIO_HAVE_PIPELINE
+#endif
+
+/* Background closes need a native thread to do the closing on */
+#if defined(HAVE_PTHREAD_H)
+#define NIO_HAVE_CLOSER
+#endif
+
 struct NIO_Selector
 {
     struct ev_loop *ev_loop;
@@ -20,7 +35,80 @@ struct NIO_Selector
     int closed, selecting;
     int ready_count;
 
-    VALUE ready_array;
+    /* Set when a monitor's watcher fired during the last ev_loop. Other
+       wakeups are internal timers, which don't end a select */
+    int monitor_woke;
+
+    /* Slow client policy (see NIO::Selector#slow_client_policy) */
+    int slow_threshold, slow_interval, slow_action;
+
+    VALUE ready_array, deferred_array;
+
+    /* Registered monitors, so close can invalidate all of them in one pass */
+    struct NIO_Monitor *monitors;
+
+    /* Per-monitor accounting (see NIO::Selector#accounting=) */
+    int accounting;
+
+    /* Recycled monitors (see NIO::Monitor#recycle) */
+    struct NIO_Monitor *free_monitors;
+    int free_count;
+    unsigned long pool_hits, pool_misses;
+
+    /* Most events dispatched per select, shared fairly between groups of
+       monitors (see NIO::Selector#event_budget=). Zero means unlimited */
+    int event_budget;
+    struct NIO_Group *default_group, *active_groups, *next_group;
+
+    /* The groups ivar, which keeps the groups alive, by key */
+    VALUE groups;
+
+    /* Kernel arrival to dispatch latency of timestamped reads, in buckets
+       of powers of two microseconds (see NIO::Selector#receive_latency) */
+    unsigned long receive_latency[NIO_LATENCY_BUCKETS];
+
+    /* Native poller thread (see NIO::Selector.new :pipelined => true) */
+    int pipelined;
+
+    /* libev backend asked for with :backend, or 0 for libev's choice */
+    unsigned int backend;
+    struct NIO_Pipeline *pipeline;
+
+    /* Collections run while the selector would otherwise sleep (see
+       NIO::Selector#gc_when_idle=) */
+    int gc_when_idle;
+    unsigned long idle_gc_minor, idle_gc_major;
+
+    /* Kernel polls made by loops the selector has since torn down */
+    unsigned long polls;
+
+    /* Load, for deciding where monitors should live (see NIO::Rebalancer).
+       Lag is a moving average of the time between a select's wait ending
+       and the next select starting. Event rate is measured over windows of
+       about a second */
+    double lag, event_rate;
+    ev_tstamp waited_at, window_started_at;
+    unsigned long window_events;
+
+    /* Monitors whose interests changed since the last select (see
+       NIO::Monitor#interests=), and how many changes were asked for
+       against how many watcher updates they came to */
+    struct NIO_Monitor *dirty;
+    unsigned long interest_changes, interest_updates;
+};
+
+/* Monitors registered with the same :group share a weighted slice of the
+   selector's event budget, handed out by deficit round robin */
+struct NIO_Group
+{
+    VALUE key;
+    int weight, active;
+    long deficit;
+    unsigned long monitors, events;
+
+    /* Ready monitors waiting for their group's turn */
+    VALUE pending;
+    struct NIO_Group *next_active;
 };
 
 struct NIO_callback_data
@@ -29,12 +117,48 @@ struct NIO_callback_data
     struct NIO_Selector *selector;
 };
 
+/* Per-connection counters, only kept up to date if the selector has
+   accounting turned on */
+struct NIO_Accounting
+{
+    unsigned long long bytes_read, bytes_written;
+    unsigned long events;
+    double handler_time, last_activity;
+};
+
 struct NIO_Monitor
 {
     VALUE self;
     int interests, revents;
+    int sample_countdown, slow_samples;
+    struct NIO_Accounting accounting;
+
+    /* Token bucket (see NIO::Monitor#rate_limit) */
+    double rate, burst, tokens;
+    ev_tstamp refilled_at;
+    int throttled;
+    struct ev_timer rate_timer;
+
+    /* Readiness threshold (see NIO::Monitor#min_readable_bytes=) */
+    int min_readable, min_readable_emulated, awaiting_bytes;
+    struct ev_timer min_readable_timer;
+
+    /* Kernel receive timestamps (see NIO::Monitor#receive_timestamps=) */
+    int receive_timestamps;
+    double received_at, dispatched_at;
+
+    /* Tells this registration's events apart from stale ones for the same
+       fd in a pipelined selector's ring */
+    unsigned int pipeline_generation;
     struct ev_io ev_io;
     struct NIO_Selector *selector;
+    struct NIO_Group *group;
+    struct NIO_Monitor *prev, *next;
+
+    /* On the selector's dirty list, waiting for the next select to apply
+       a change of interests. Doubly linked so closing is O(1) */
+    int dirty;
+    struct NIO_Monitor *prev_dirty, *next_dirty;
 };
 
 #ifdef GetReadFile
@@ -49,7 +173,75 @@ struct NIO_Monitor
 
 #endif /* GetReadFile */
 
+/* Actions taken on monitors whose send queue stays above the threshold */
+#define NIO_SLOW_CLIENT_DEMOTE   1
+#define NIO_SLOW_CLIENT_THROTTLE 2
+#define NIO_SLOW_CLIENT_TIMEOUT  3
+
+/* Consecutive samples over the threshold before a client counts as slow */
+#define NIO_SLOW_CLIENT_SAMPLES  2
+
+/* How long a throttled slow client stops reading after an event it isn't
+   sampled on */
+#define NIO_SLOW_CLIENT_PAUSE    0.01
+
+/* Most recycled monitors a selector holds onto */
+#define NIO_MONITOR_POOL_SIZE 1024
+
+/* Bytes queued in the kernel but not yet sent for the monitor's socket,
+   or -1 if this can't be determined */
+int NIO_Monitor_send_queue(struct NIO_Monitor *monitor);
+
+/* True if the monitor is readable, but fewer than its minimum readable
+   bytes have arrived. Reads are paused until enough have */
+int NIO_Monitor_short_read(struct NIO_Monitor *monitor);
+
+/* Put back the default SO_RCVLOWAT on a closing monitor's socket */
+void NIO_Monitor_reset_min_readable(struct NIO_Monitor *monitor);
+
+/* Stop selecting the monitor for reads for the given number of seconds */
+void NIO_Monitor_pause_reads(struct NIO_Monitor *monitor, ev_tstamp seconds);
+
+/* Leave the monitor's group, if it's in one */
+void NIO_Monitor_leave_group(struct NIO_Monitor *monitor);
+
+/* Events the monitor's watcher should be waiting for right now */
+int NIO_Monitor_watched_events(struct NIO_Monitor *monitor);
+
+/* Apply the interest changes made since the last select */
+void NIO_Monitor_flush_interests(struct NIO_Selector *selector);
+
+/* Take the monitor off its selector's dirty list without applying it */
+void NIO_Monitor_undirty(struct NIO_Monitor *monitor);
+
 /* Thunk between libev callbacks in NIO::Monitors and NIO::Selectors */
 void NIO_Selector_monitor_callback(struct ev_loop *ev_loop, struct ev_io *io, int revents);
 
+/* Hand an event on a monitor to its selector */
+void NIO_Selector_handle_event(struct NIO_Monitor *monitor, int revents);
+
+/* Forget a group once its last monitor has left and none are waiting for
+   its turn */
+void NIO_Selector_release_group(struct NIO_Selector *selector, struct NIO_Group *group);
+
+/* Move a monitor from selector to other (see NIO::Monitor#migrate_to) */
+VALUE NIO_Selector_migrate(VALUE selector, VALUE monitors, VALUE other);
+
+/* Nothing is ready and the selector is about to sleep. Runs a collection
+   if the GC is close to needing one anyway, returning true if it did */
+int NIO_Selector_idle_gc(struct NIO_Selector *selector);
+
+/* Pipelined polling (see pipeline.c) */
+int NIO_Pipeline_available();
+struct NIO_Pipeline *NIO_Pipeline_new();
+void NIO_Pipeline_free(struct NIO_Pipeline *pipeline);
+void NIO_Pipeline_add(struct NIO_Pipeline *pipeline, struct NIO_Monitor *monitor);
+void NIO_Pipeline_remove(struct NIO_Pipeline *pipeline, struct NIO_Monitor *monitor);
+void NIO_Pipeline_modify(struct NIO_Pipeline *pipeline, struct NIO_Monitor *monitor);
+int NIO_Pipeline_run(struct NIO_Selector *selector, VALUE timeout);
+unsigned long NIO_Pipeline_polls(struct NIO_Pipeline *pipeline);
+
+/* Background closes (see closer.c) */
+void NIO_Closer_close(int fd);
+
 #endif /* NIO4R_H */
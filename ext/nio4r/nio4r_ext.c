@@ -8,9 +8,13 @@
 
 void Init_NIO_Selector();
 void Init_NIO_Monitor();
+void Init_NIO_Wait();
+void Init_NIO_Process();
 
 void Init_nio4r_ext()
 {
     Init_NIO_Selector();
     Init_NIO_Monitor();
+    Init_NIO_Wait();
+    Init_NIO_Process();
 }
@@ -1,8 +1,15 @@
 package org.nio4r;
 
+import java.util.ArrayDeque;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Collections;
+import java.util.Comparator;
 import java.util.Iterator;
 import java.util.Map;
 import java.util.HashMap;
+import java.util.concurrent.locks.LockSupport;
+import java.util.function.Consumer;
 import java.io.IOException;
 import java.nio.channels.Channel;
 import java.nio.channels.SocketChannel;
@@ -15,6 +22,11 @@ import org.jruby.RubyObject;
 import org.jruby.RubyIO;
 import org.jruby.RubyNumeric;
 import org.jruby.RubyArray;
+import org.jruby.RubyFixnum;
+import org.jruby.RubyHash;
+import org.jruby.RubyString;
+import org.jruby.RubySymbol;
+import org.jruby.RubyThread;
 import org.jruby.anno.JRubyMethod;
 import org.jruby.runtime.ObjectAllocator;
 import org.jruby.runtime.ThreadContext;
@@ -25,8 +37,23 @@ import org.jruby.runtime.Block;
 public class Nio4r implements Library {
     private Ruby ruby;
 
+    /* Interest and readiness symbols, looked up once rather than per query */
+    private RubySymbol readSymbol, writeSymbol, readWriteSymbol;
+
+    /* Selector.select(Consumer) is only available on Java 11+ */
+    private static volatile boolean consumerSelectAvailable = true;
+
+    /* Most recycled monitors a selector holds onto */
+    static final int MONITOR_POOL_SIZE = 1024;
+
+    /* Metrics NIO::Selector#top can sort by */
+    static final String[] METRICS = {"handler_time", "events", "bytes_read", "bytes_written", "bytes", "last_activity"};
+
     public void load(final Ruby ruby, boolean bln) {
         this.ruby = ruby;
+        this.readSymbol      = ruby.newSymbol("r");
+        this.writeSymbol     = ruby.newSymbol("w");
+        this.readWriteSymbol = ruby.newSymbol("rw");
 
         RubyModule nio = ruby.defineModule("NIO");
 
@@ -45,31 +72,33 @@ public class Nio4r implements Library {
         }, nio);
 
         monitor.defineAnnotatedMethods(Monitor.class);
+
+        nio.defineAnnotatedMethods(Wait.class);
     }
 
-    public static int symbolToInterestOps(Ruby ruby, SelectableChannel channel, IRubyObject interest) {
-        if(interest == ruby.newSymbol("r")) {
+    public int symbolToInterestOps(Ruby ruby, SelectableChannel channel, IRubyObject interest) {
+        if(interest == readSymbol) {
             if((channel.validOps() & SelectionKey.OP_ACCEPT) != 0) {
               return SelectionKey.OP_ACCEPT;
             } else {
               return SelectionKey.OP_READ;
             }
-        } else if(interest == ruby.newSymbol("w")) {
+        } else if(interest == writeSymbol) {
             if(channel instanceof SocketChannel && !((SocketChannel)channel).isConnected()) {
                 return SelectionKey.OP_CONNECT;
             } else {
                 return SelectionKey.OP_WRITE;
             }
-        } else if(interest == ruby.newSymbol("rw")) {
+        } else if(interest == readWriteSymbol) {
             int interestOps = 0;
 
             /* nio4r emulates the POSIX behavior, which is sloppy about allowed modes */
             if((channel.validOps() & (SelectionKey.OP_READ | SelectionKey.OP_ACCEPT)) != 0) {
-                interestOps |= symbolToInterestOps(ruby, channel, ruby.newSymbol("r"));
+                interestOps |= symbolToInterestOps(ruby, channel, readSymbol);
             }
 
             if((channel.validOps() & (SelectionKey.OP_WRITE | SelectionKey.OP_CONNECT)) != 0) {
-                interestOps |= symbolToInterestOps(ruby, channel, ruby.newSymbol("w"));
+                interestOps |= symbolToInterestOps(ruby, channel, writeSymbol);
             }
 
             return interestOps;
@@ -78,19 +107,20 @@ public class Nio4r implements Library {
         }
     }
 
-    public static IRubyObject interestOpsToSymbol(Ruby ruby, int interestOps) {
-        switch(interestOps) {
-            case SelectionKey.OP_READ:
-            case SelectionKey.OP_ACCEPT:
-                return ruby.newSymbol("r");
-            case SelectionKey.OP_WRITE:
-            case SelectionKey.OP_CONNECT:
-                return ruby.newSymbol("w");
-            case SelectionKey.OP_READ | SelectionKey.OP_CONNECT:
-            case SelectionKey.OP_READ | SelectionKey.OP_WRITE:
-                return ruby.newSymbol("rw");
-            default:
-                throw ruby.newArgumentError("unknown interest op combination");
+    /* Accepting counts as reading and connecting as writing, in any
+       combination the key reports. nil if there's nothing at all */
+    public IRubyObject interestOpsToSymbol(Ruby ruby, int interestOps) {
+        boolean readable = (interestOps & (SelectionKey.OP_READ | SelectionKey.OP_ACCEPT)) != 0;
+        boolean writable = (interestOps & (SelectionKey.OP_WRITE | SelectionKey.OP_CONNECT)) != 0;
+
+        if(readable && writable) {
+            return readWriteSymbol;
+        } else if(readable) {
+            return readSymbol;
+        } else if(writable) {
+            return writeSymbol;
+        } else {
+            return ruby.getNil();
         }
     }
 
@@ -98,10 +128,49 @@ public class Nio4r implements Library {
         private java.nio.channels.Selector selector;
         private HashMap<SelectableChannel,SelectionKey> cancelledKeys;
 
+        /* Recycled monitors (see NIO::Monitor#recycle) */
+        private final ArrayDeque<Monitor> freeMonitors = new ArrayDeque<Monitor>();
+        private long poolHits, poolMisses;
+
+        /* Calls into the underlying java.nio selector */
+        private long polls;
+
+        /* Monitors whose interests changed since the last select (see
+           Monitor#interests=), and changes asked for against key updates */
+        private final ArrayList<Monitor> dirtyMonitors = new ArrayList<Monitor>();
+        private long interestChanges, interestUpdates;
+
+        /* Per-monitor accounting (see #accounting=) */
+        private volatile boolean accounting = false;
+
+        /* Keys selected by the last select, reused between calls */
+        private final ArrayList<SelectionKey> readyKeys = new ArrayList<SelectionKey>();
+        private final Consumer<SelectionKey> readyKeyCollector = new Consumer<SelectionKey>() {
+            public void accept(SelectionKey key) {
+                readyKeys.add(key);
+            }
+        };
+
         public Selector(final Ruby ruby, RubyClass rubyClass) {
             super(ruby, rubyClass);
         }
 
+        @JRubyMethod
+        public IRubyObject initialize(ThreadContext context, IRubyObject options) {
+            Ruby runtime = context.getRuntime();
+
+            if(!options.isNil() && options.convertToHash().op_aref(context, runtime.newSymbol("pipelined")).isTrue()) {
+                throw runtime.newNotImplementedError("the java engine has no pipelined polling");
+            }
+
+            IRubyObject backend = options.isNil() ? runtime.getNil() : options.convertToHash().op_aref(context, runtime.newSymbol("backend"));
+            if(!backend.isNil() && !backend.equals(runtime.newSymbol("nio"))) {
+                throw runtime.newNotImplementedError("the java engine only polls with nio");
+            }
+
+            return initialize(context);
+        }
+
         @JRubyMethod
         public IRubyObject initialize(ThreadContext context) {
             this.cancelledKeys = new HashMap<SelectableChannel,SelectionKey>();
@@ -116,12 +185,40 @@ public class Nio4r implements Library {
 
         @JRubyMethod
         public IRubyObject close(ThreadContext context) {
+            return close(context, context.nil);
+        }
+
+        /* Closing the selector cancels every key at once, so monitors only
+           need to be marked closed */
+        @JRubyMethod
+        public IRubyObject close(ThreadContext context, IRubyObject closeIOs) {
+            Ruby runtime = context.getRuntime();
+
+            if(!this.selector.isOpen())
+                return context.nil;
+
+            ArrayList<Monitor> monitors = new ArrayList<Monitor>();
+            for(SelectionKey key : this.selector.keys()) {
+                Monitor monitor = (Monitor)key.attachment();
+                if(monitor != null && monitor.isClosed(context) != runtime.getTrue()) {
+                    monitors.add(monitor);
+                }
+            }
+
             try {
                 this.selector.close();
             } catch(IOException ie) {
                 throw context.runtime.newIOError(ie.getLocalizedMessage());
             }
 
+            this.cancelledKeys.clear();
+            for(Monitor monitor : monitors) {
+                monitor.close(context, runtime.getFalse());
+                if(closeIOs.isTrue()) {
+                    monitor.closeIO(context);
+                }
+            }
+
             return context.nil;
         }
 
@@ -133,6 +230,11 @@ public class Nio4r implements Library {
 
         @JRubyMethod
         public IRubyObject register(ThreadContext context, IRubyObject io, IRubyObject interests) {
+            return register(context, io, interests, context.nil);
+        }
+
+        @JRubyMethod
+        public IRubyObject register(ThreadContext context, IRubyObject io, IRubyObject interests, IRubyObject options) {
             Ruby runtime = context.getRuntime();
             Channel rawChannel = RubyIO.convertToIO(context, io).getChannel();
 
@@ -148,7 +250,7 @@ public class Nio4r implements Library {
                 throw runtime.newIOError(ie.getLocalizedMessage());
             }
 
-            int interestOps = Nio4r.symbolToInterestOps(runtime, channel, interests);
+            int interestOps = symbolToInterestOps(runtime, channel, interests);
             SelectionKey key;
 
             key = this.cancelledKeys.remove(channel);
@@ -165,8 +267,7 @@ public class Nio4r implements Library {
                 }
             }
 
-            RubyClass monitorClass = runtime.getModule("NIO").getClass("Monitor");
-            Monitor monitor = (Monitor)monitorClass.newInstance(context, io, interests, this, null);
+            Monitor monitor = newMonitor(context, io, interests, options);
             monitor.setSelectionKey(key);
 
             return monitor;
@@ -217,6 +318,20 @@ public class Nio4r implements Library {
             }
         }
 
+        @JRubyMethod
+        public IRubyObject monitors(ThreadContext context) {
+            RubyArray array = context.getRuntime().newArray();
+
+            for(SelectionKey key : this.selector.keys()) {
+                Monitor monitor = (Monitor)key.attachment();
+                if(monitor != null && monitor.isClosed(context) != context.getRuntime().getTrue()) {
+                    array.add(monitor);
+                }
+            }
+
+            return array;
+        }
+
         @JRubyMethod
         public synchronized IRubyObject select(ThreadContext context, Block block) {
             return select(context, context.nil, block);
@@ -233,50 +348,158 @@ public class Nio4r implements Library {
 
             RubyArray array = null;
             if(!block.isGiven()) {
-                array = runtime.newArray(this.selector.selectedKeys().size());
+                array = runtime.newArray(this.readyKeys.size());
             }
 
-            Iterator selectedKeys = this.selector.selectedKeys().iterator();
-            while(selectedKeys.hasNext()) {
-                SelectionKey key = (SelectionKey)selectedKeys.next();
+            double now = System.currentTimeMillis() / 1000.0;
+            int count = 0;
+            for(int i = 0; i < this.readyKeys.size(); i++) {
+                SelectionKey key = this.readyKeys.get(i);
                 processKey(key);
-                selectedKeys.remove();
+
+                /* Monitors with a thread parked in #await go to that thread instead */
+                if(((Monitor)key.attachment()).wakeWaiter(key))
+                    continue;
+
+                count++;
+                if(this.accounting) {
+                    ((Monitor)key.attachment()).accountEvent(now);
+                }
 
                 if(block.isGiven()) {
-                    block.call(context, (IRubyObject)key.attachment());
+                    dispatch(context, (Monitor)key.attachment(), block);
                 } else {
                     array.add(key.attachment());
                 }
             }
 
+            this.readyKeys.clear();
+
+            /* Everything that was ready went to parked threads */
+            if(count == 0)
+                return context.nil;
+
             if(block.isGiven()) {
-                return RubyNumeric.int2fix(runtime, ready);
+                return RubyNumeric.int2fix(runtime, count);
             } else {
                 return array;
             }
         }
 
-        /* Run the selector */
+        /* Call the select block, timing the handler if accounting is on */
+        private void dispatch(ThreadContext context, Monitor monitor, Block block) {
+            if(!this.accounting) {
+                block.call(context, monitor);
+                return;
+            }
+
+            long startedAt = System.nanoTime();
+            try {
+                block.call(context, monitor);
+            } finally {
+                monitor.accountHandlerTime((System.nanoTime() - startedAt) / 1e9);
+            }
+        }
+
+        /* Run the selector, leaving the keys that are ready in readyKeys */
         private int doSelect(Ruby runtime, IRubyObject timeout) {
+            long millis = -1;
+
+            if(!timeout.isNil()) {
+                double t = RubyNumeric.num2dbl(timeout);
+                if(t < 0) {
+                    throw runtime.newArgumentError("time interval must be positive");
+                }
+
+                /* Timeouts under a millisecond shouldn't turn into an infinite wait */
+                millis = t == 0 ? 0 : Math.max(1, (long)(t * 1000));
+            }
+
             cancelKeys();
+            flushInterests(runtime);
+            this.readyKeys.clear();
+
             try {
-                if(timeout.isNil()) {
-                    return this.selector.select();
-                } else {
-                    double t = RubyNumeric.num2dbl(timeout);
-                    if(t == 0) {
-                        return this.selector.selectNow();
-                    } else if(t < 0) {
-                        throw runtime.newArgumentError("time interval must be positive");
-                    } else {
-                        return this.selector.select((long)(t * 1000));
+                this.polls++;
+                if(consumerSelectAvailable) {
+                    try {
+                        return doConsumerSelect(millis);
+                    } catch(NoSuchMethodError nsme) {
+                        consumerSelectAvailable = false;
                     }
                 }
+
+                int ready = doLegacySelect(millis);
+
+                Iterator<SelectionKey> selectedKeys = this.selector.selectedKeys().iterator();
+                while(selectedKeys.hasNext()) {
+                    this.readyKeys.add(selectedKeys.next());
+                    selectedKeys.remove();
+                }
+
+                return ready;
             } catch(IOException ie) {
                 throw runtime.newIOError(ie.getLocalizedMessage());
             }
         }
 
+        /* Java 11+: ready keys are handed to us directly, bypassing the selected-key set */
+        private int doConsumerSelect(long millis) throws IOException {
+            if(millis < 0) {
+                return this.selector.select(this.readyKeyCollector);
+            } else if(millis == 0) {
+                return this.selector.selectNow(this.readyKeyCollector);
+            } else {
+                return this.selector.select(this.readyKeyCollector, millis);
+            }
+        }
+
+        private int doLegacySelect(long millis) throws IOException {
+            if(millis < 0) {
+                return this.selector.select();
+            } else if(millis == 0) {
+                return this.selector.selectNow();
+            } else {
+                return this.selector.select(millis);
+            }
+        }
+
+        /* Called by Monitor#interests=, possibly from another thread */
+        void interestsChanged(Monitor monitor) {
+            synchronized(this.dirtyMonitors) {
+                this.interestChanges++;
+                if(!monitor.dirty) {
+                    monitor.dirty = true;
+                    this.dirtyMonitors.add(monitor);
+                }
+            }
+        }
+
+        /* Apply the interest changes made since the last select: at most one
+           interestOps() call per key, however many changes there were */
+        private void flushInterests(Ruby runtime) {
+            synchronized(this.dirtyMonitors) {
+                for(Monitor monitor : this.dirtyMonitors) {
+                    monitor.dirty = false;
+
+                    /* A thread parked in #await has the key until it returns,
+                       and puts the monitor's own interests back then */
+                    SelectionKey key = monitor.key;
+                    if(key == null || !key.isValid() || monitor.closed == runtime.getTrue() || monitor.waiter != null) {
+                        continue;
+                    }
+
+                    int interestOps = symbolToInterestOps(runtime, key.channel(), monitor.interests);
+                    if(key.interestOps() != interestOps) {
+                        key.interestOps(interestOps);
+                        this.interestUpdates++;
+                    }
+                }
+
+                this.dirtyMonitors.clear();
+            }
+        }
+
         /* Flush our internal buffer of cancelled keys */
         private void cancelKeys() {
             Iterator cancelledKeys = this.cancelledKeys.entrySet().iterator();
@@ -301,6 +524,207 @@ public class Nio4r implements Library {
             }
         }
 
+        /* Reuse a recycled monitor if asked to and one is available */
+        private Monitor newMonitor(ThreadContext context, IRubyObject io, IRubyObject interests, IRubyObject options) {
+            Ruby runtime = context.getRuntime();
+
+            if(!options.isNil() && (!options.convertToHash().op_aref(context, runtime.newSymbol("group")).isNil() ||
+                                    !options.convertToHash().op_aref(context, runtime.newSymbol("weight")).isNil())) {
+                throw runtime.newNotImplementedError("the java engine has no monitor groups");
+            }
+
+            if(!options.isNil() && (options.convertToHash().op_aref(context, runtime.newSymbol("edge_triggered")).isTrue() ||
+                                    options.convertToHash().op_aref(context, runtime.newSymbol("oneshot")).isTrue() ||
+                                    options.convertToHash().op_aref(context, runtime.newSymbol("exclusive")).isTrue())) {
+                throw runtime.newNotImplementedError("only the epoll engine registers edge-triggered, oneshot or exclusive monitors");
+            }
+
+            if(!options.isNil() && options.convertToHash().op_aref(context, runtime.newSymbol("reuse")).isTrue()) {
+                Monitor monitor;
+                synchronized(this.freeMonitors) {
+                    monitor = this.freeMonitors.poll();
+                }
+
+                if(monitor != null) {
+                    this.poolHits++;
+                    monitor.initialize(context, io, interests, this);
+                    return monitor;
+                }
+
+                this.poolMisses++;
+            }
+
+            RubyClass monitorClass = runtime.getModule("NIO").getClass("Monitor");
+            return (Monitor)monitorClass.newInstance(context, io, interests, this, null);
+        }
+
+        /* Take back a closed monitor for reuse */
+        public void recycle(Monitor monitor) {
+            synchronized(this.freeMonitors) {
+                if(this.freeMonitors.size() < MONITOR_POOL_SIZE) {
+                    this.freeMonitors.offer(monitor);
+                }
+            }
+        }
+
+        @JRubyMethod
+        public IRubyObject stats(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+            RubyHash stats = RubyHash.newHash(runtime);
+            long requests = this.poolHits + this.poolMisses;
+
+            stats.op_aset(context, runtime.newSymbol("monitor_pool_size"), runtime.newFixnum(this.freeMonitors.size()));
+            stats.op_aset(context, runtime.newSymbol("monitor_pool_hits"), runtime.newFixnum(this.poolHits));
+            stats.op_aset(context, runtime.newSymbol("monitor_pool_misses"), runtime.newFixnum(this.poolMisses));
+            stats.op_aset(context, runtime.newSymbol("monitor_pool_hit_ratio"),
+                runtime.newFloat(requests > 0 ? (double)this.poolHits / requests : 0.0));
+            stats.op_aset(context, runtime.newSymbol("idle_gc_minor"), runtime.newFixnum(0));
+            stats.op_aset(context, runtime.newSymbol("idle_gc_major"), runtime.newFixnum(0));
+            stats.op_aset(context, runtime.newSymbol("lag"), runtime.newFloat(0.0));
+            stats.op_aset(context, runtime.newSymbol("event_rate"), runtime.newFloat(0.0));
+            stats.op_aset(context, runtime.newSymbol("polls"), runtime.newFixnum(this.polls));
+            stats.op_aset(context, runtime.newSymbol("interest_changes"), runtime.newFixnum(this.interestChanges));
+            stats.op_aset(context, runtime.newSymbol("interest_updates"), runtime.newFixnum(this.interestUpdates));
+
+            return stats;
+        }
+
+        @JRubyMethod(name = "accounting=")
+        public IRubyObject setAccounting(ThreadContext context, IRubyObject enabled) {
+            this.accounting = enabled.isTrue();
+            return enabled;
+        }
+
+        @JRubyMethod(name = "event_budget=")
+        public IRubyObject setEventBudget(ThreadContext context, IRubyObject budget) {
+            if(budget.isNil())
+                return budget;
+
+            throw context.getRuntime().newNotImplementedError("the java engine has no event budget");
+        }
+
+        @JRubyMethod
+        public IRubyObject event_budget(ThreadContext context) {
+            return context.nil;
+        }
+
+        @JRubyMethod
+        public IRubyObject group_stats(ThreadContext context) {
+            return RubyHash.newHash(context.getRuntime());
+        }
+
+        @JRubyMethod(name = "pipelined?")
+        public IRubyObject isPipelined(ThreadContext context) {
+            return context.getRuntime().getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject backend(ThreadContext context) {
+            return context.getRuntime().newSymbol("nio");
+        }
+
+        /* Watch for process pid to exit. The JVM has no pidfds, so a thread
+           waits for it instead (see NIO::ProcessWaiter) */
+        @JRubyMethod(name = "watch_process")
+        public IRubyObject watchProcess(ThreadContext context, IRubyObject pid) {
+            Ruby runtime = context.getRuntime();
+            IRubyObject waiter = runtime.getModule("NIO").getClass("ProcessWaiter").callMethod(context, "new", pid);
+
+            Monitor monitor = (Monitor)register(context, waiter.callMethod(context, "reader"), readSymbol);
+            monitor.processWaiter = waiter;
+
+            return monitor;
+        }
+
+        @JRubyMethod(name = "gc_when_idle=")
+        public IRubyObject setGcWhenIdle(ThreadContext context, IRubyObject enabled) {
+            if(enabled.isTrue()) {
+                throw context.getRuntime().newNotImplementedError("the java engine leaves GC scheduling to the JVM");
+            }
+
+            return enabled;
+        }
+
+        @JRubyMethod(name = "gc_when_idle?")
+        public IRubyObject isGcWhenIdle(ThreadContext context) {
+            return context.getRuntime().getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject receive_latency(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+            RubyHash latency = RubyHash.newHash(runtime);
+
+            latency.op_aset(context, runtime.newSymbol("samples"), runtime.newFixnum(0));
+            latency.op_aset(context, runtime.newSymbol("p50"), context.nil);
+            latency.op_aset(context, runtime.newSymbol("p99"), context.nil);
+            latency.op_aset(context, runtime.newSymbol("histogram"), RubyHash.newHash(runtime));
+
+            return latency;
+        }
+
+        @JRubyMethod(name = "accounting?")
+        public IRubyObject isAccounting(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+            return this.accounting ? runtime.getTrue() : runtime.getFalse();
+        }
+
+        public boolean accounting() {
+            return this.accounting;
+        }
+
+        /* The n heaviest monitors by the given accounting metric */
+        @JRubyMethod(required = 1, optional = 1)
+        public IRubyObject top(ThreadContext context, IRubyObject[] args) {
+            Ruby runtime = context.getRuntime();
+            long n = RubyNumeric.num2long(args[0]);
+            String by = "handler_time";
+
+            if(n < 0) {
+                throw runtime.newArgumentError("negative count");
+            }
+
+            if(args.length > 1 && !args[1].isNil()) {
+                IRubyObject metric = args[1].convertToHash().op_aref(context, runtime.newSymbol("by"));
+                if(!metric.isNil()) {
+                    by = metric.asJavaString();
+                }
+            }
+
+            if(!Arrays.asList(METRICS).contains(by)) {
+                throw runtime.newArgumentError("invalid metric " + by);
+            }
+
+            final String metric = by;
+            ArrayList<Monitor> monitors = new ArrayList<Monitor>();
+            for(IRubyObject monitor : ((RubyArray)monitors(context)).toJavaArray()) {
+                monitors.add((Monitor)monitor);
+            }
+
+            Collections.sort(monitors, new Comparator<Monitor>() {
+                public int compare(Monitor a, Monitor b) {
+                    return Double.compare(b.metric(metric), a.metric(metric));
+                }
+            });
+
+            RubyArray result = runtime.newArray();
+            for(int i = 0; i < n && i < monitors.size(); i++) {
+                result.add(monitors.get(i));
+            }
+
+            return result;
+        }
+
+        @JRubyMethod(required = 1, optional = 2)
+        public IRubyObject slow_client_policy(ThreadContext context, IRubyObject[] args) {
+            throw context.getRuntime().newNotImplementedError("TCP_INFO is not available on the JVM");
+        }
+
+        @JRubyMethod
+        public IRubyObject migrate(ThreadContext context, IRubyObject monitors, IRubyObject other) {
+            throw context.getRuntime().newNotImplementedError("the java engine can't migrate monitors");
+        }
+
         @JRubyMethod
         public IRubyObject wakeup(ThreadContext context) {
             if(!this.selector.isOpen()) {
@@ -310,6 +734,34 @@ public class Nio4r implements Library {
             this.selector.wakeup();
             return context.nil;
         }
+
+        /* Deregister everything but keep the underlying selector open */
+        @JRubyMethod
+        public synchronized IRubyObject reset(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+
+            if(!this.selector.isOpen()) {
+                throw runtime.newIOError("selector is closed");
+            }
+
+            for(SelectionKey key : this.selector.keys()) {
+                Monitor monitor = (Monitor)key.attachment();
+                if(monitor != null) {
+                    monitor.close(context, runtime.getFalse());
+                }
+                key.cancel();
+            }
+            this.cancelledKeys.clear();
+
+            /* Flush the cancelled keys and any pending wakeup */
+            try {
+                this.selector.selectNow();
+            } catch(IOException ie) {
+                throw runtime.newIOError(ie.getLocalizedMessage());
+            }
+
+            return this;
+        }
     }
 
     public class Monitor extends RubyObject {
@@ -317,6 +769,20 @@ public class Nio4r implements Library {
         private RubyIO io;
         private IRubyObject interests, selector, value, closed;
 
+        /* Accounting counters, kept up to date if the selector has accounting on */
+        private long bytesRead, bytesWritten, eventCount;
+        private double handlerTime, lastActivity;
+
+        /* Thread parked in #await, if any, and the readiness it was woken for */
+        private volatile Thread waiter;
+        private volatile int awaitedReadyOps;
+
+        /* On the selector's dirty list, waiting for the next select */
+        private boolean dirty;
+
+        /* Set by Selector#watch_process */
+        private IRubyObject processWaiter;
+
         public Monitor(final Ruby ruby, RubyClass rubyClass) {
             super(ruby, rubyClass);
         }
@@ -330,6 +796,10 @@ public class Nio4r implements Library {
             this.value  = context.nil;
             this.closed = context.getRuntime().getFalse();
 
+            this.bytesRead = this.bytesWritten = this.eventCount = 0;
+            this.handlerTime = this.lastActivity = 0;
+            this.processWaiter = null;
+
             return context.nil;
         }
 
@@ -340,7 +810,7 @@ public class Nio4r implements Library {
 
         @JRubyMethod
         public IRubyObject io(ThreadContext context) {
-            return io;
+            return io == null ? context.nil : io;
         }
 
         @JRubyMethod
@@ -353,9 +823,126 @@ public class Nio4r implements Library {
             return interests;
         }
 
+        /* Takes effect at the next select, so only the last of several
+           changes in a row costs anything */
+        @JRubyMethod(name = "interests=")
+        public IRubyObject setInterests(ThreadContext context, IRubyObject interests) {
+            Ruby runtime = context.getRuntime();
+
+            if(this.closed == runtime.getTrue()) {
+                throw runtime.newIOError("monitor is closed");
+            }
+
+            if(interests != readSymbol && interests != writeSymbol && interests != readWriteSymbol) {
+                throw runtime.newArgumentError("invalid event type " + interests.inspect() + " (must be :r, :w, or :rw)");
+            }
+
+            if(interests != this.interests) {
+                this.interests = interests;
+                ((Selector)this.selector).interestsChanged(this);
+            }
+
+            return interests;
+        }
+
         @JRubyMethod
         public IRubyObject readiness(ThreadContext context) {
-            return Nio4r.interestOpsToSymbol(context.getRuntime(), key.readyOps());
+            return interestOpsToSymbol(context.getRuntime(), key.readyOps());
+        }
+
+        /* Park the calling thread (typically a virtual thread) until the IO is
+           ready for the given interest, or the timeout elapses. Another thread
+           needs to be selecting on the selector, and unparks us when the key
+           fires. Returns the readiness, or nil on timeout.
+
+           While a thread is parked the selector hands it the monitor's events
+           instead of returning them from select. However await returns, the
+           monitor goes back to its own interests */
+        @JRubyMethod(optional = 2)
+        public IRubyObject await(ThreadContext context, IRubyObject[] args) {
+            Ruby runtime = context.getRuntime();
+            IRubyObject interest = (args.length > 0 && !args[0].isNil()) ? args[0] : this.interests;
+            long deadline = 0;
+            boolean timed = args.length > 1 && !args[1].isNil();
+
+            if(timed) {
+                double t = RubyNumeric.num2dbl(args[1]);
+                if(t < 0) {
+                    throw runtime.newArgumentError("time interval must be positive");
+                }
+
+                deadline = System.nanoTime() + (long)(t * 1000000000L);
+            }
+
+            if(this.closed == runtime.getTrue()) {
+                throw runtime.newIOError("monitor is closed");
+            }
+
+            if(this.waiter != null) {
+                throw runtime.newArgumentError("another thread is already awaiting this monitor");
+            }
+
+            int interestOps = symbolToInterestOps(runtime, this.key.channel(), interest);
+
+            synchronized(this) {
+                this.awaitedReadyOps = 0;
+                this.waiter = Thread.currentThread();
+            }
+
+            try {
+                this.key.interestOps(interestOps);
+
+                /* A select already in progress won't pick up new interests by itself */
+                ((Selector)this.selector).selector.wakeup();
+
+                while(this.awaitedReadyOps == 0 && this.closed != runtime.getTrue()) {
+                    if(timed) {
+                        long remaining = deadline - System.nanoTime();
+                        if(remaining <= 0)
+                            break;
+
+                        LockSupport.parkNanos(this, remaining);
+                    } else {
+                        LockSupport.park(this);
+                    }
+
+                    /* Let Thread#raise and Thread#kill through */
+                    context.pollThreadEvents();
+                }
+            } finally {
+                /* Even if we were interrupted, so the monitor doesn't drop out
+                   of select for good. Synchronized with wakeWaiter, which would
+                   otherwise clear the interests again after we've restored them */
+                synchronized(this) {
+                    this.waiter = null;
+
+                    if(this.key.isValid() && this.closed != runtime.getTrue()) {
+                        this.key.interestOps(symbolToInterestOps(runtime, this.key.channel(), this.interests));
+                    }
+                }
+            }
+
+            if(this.awaitedReadyOps == 0) {
+                return context.nil;
+            }
+
+            return interestOpsToSymbol(runtime, this.awaitedReadyOps);
+        }
+
+        /* Called by the selector with a key that fired. Returns true if a thread
+           parked in #await took the event */
+        public synchronized boolean wakeWaiter(SelectionKey key) {
+            Thread thread = this.waiter;
+            if(thread == null)
+                return false;
+
+            /* Stop selecting until the parked thread has run, lest we spin on a
+               level-triggered key. #await restores the interests */
+            this.awaitedReadyOps = key.readyOps();
+            key.interestOps(0);
+            LockSupport.unpark(thread);
+
+            return true;
         }
 
         @JRubyMethod(name = "readable?")
@@ -382,6 +969,161 @@ public class Nio4r implements Library {
             }
         }
 
+        public void accountEvent(double now) {
+            this.eventCount++;
+            this.lastActivity = now;
+        }
+
+        public void accountHandlerTime(double elapsed) {
+            this.handlerTime += elapsed;
+        }
+
+        public double metric(String by) {
+            if(by.equals("handler_time")) {
+                return this.handlerTime;
+            } else if(by.equals("events")) {
+                return this.eventCount;
+            } else if(by.equals("bytes_read")) {
+                return this.bytesRead;
+            } else if(by.equals("bytes_written")) {
+                return this.bytesWritten;
+            } else if(by.equals("bytes")) {
+                return this.bytesRead + this.bytesWritten;
+            } else {
+                return this.lastActivity;
+            }
+        }
+
+        private boolean isAccounting(ThreadContext context) {
+            return !this.isClosed(context).isTrue() && ((Selector)this.selector).accounting();
+        }
+
+        /* IO#read_nonblock, counting the bytes read if accounting is on */
+        @JRubyMethod(rest = true)
+        public IRubyObject read_nonblock(ThreadContext context, IRubyObject[] args) {
+            IRubyObject result = this.io.callMethod(context, "read_nonblock", args);
+
+            if(result instanceof RubyString && isAccounting(context)) {
+                this.bytesRead += ((RubyString)result).getByteList().length();
+            }
+
+            return result;
+        }
+
+        /* IO#write_nonblock, counting the bytes written if accounting is on */
+        @JRubyMethod(rest = true)
+        public IRubyObject write_nonblock(ThreadContext context, IRubyObject[] args) {
+            IRubyObject result = this.io.callMethod(context, "write_nonblock", args);
+
+            if(result instanceof RubyFixnum && isAccounting(context)) {
+                this.bytesWritten += ((RubyFixnum)result).getLongValue();
+            }
+
+            return result;
+        }
+
+        @JRubyMethod
+        public IRubyObject bytes_read(ThreadContext context) {
+            return context.getRuntime().newFixnum(this.bytesRead);
+        }
+
+        @JRubyMethod
+        public IRubyObject bytes_written(ThreadContext context) {
+            return context.getRuntime().newFixnum(this.bytesWritten);
+        }
+
+        @JRubyMethod
+        public IRubyObject events(ThreadContext context) {
+            return context.getRuntime().newFixnum(this.eventCount);
+        }
+
+        @JRubyMethod
+        public IRubyObject handler_time(ThreadContext context) {
+            return context.getRuntime().newFloat(this.handlerTime);
+        }
+
+        @JRubyMethod
+        public IRubyObject last_activity(ThreadContext context) {
+            if(this.eventCount == 0)
+                return context.nil;
+
+            return context.getRuntime().newFloat(this.lastActivity);
+        }
+
+        @JRubyMethod(required = 1, optional = 1)
+        public IRubyObject rate_limit(ThreadContext context, IRubyObject[] args) {
+            throw context.getRuntime().newNotImplementedError("the java engine has no rate limiting");
+        }
+
+        @JRubyMethod(name = "throttled?")
+        public IRubyObject isThrottled(ThreadContext context) {
+            return context.getRuntime().getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject group(ThreadContext context) {
+            return context.nil;
+        }
+
+        @JRubyMethod(name = "migrate_to")
+        public IRubyObject migrateTo(ThreadContext context, IRubyObject selector) {
+            throw context.getRuntime().newNotImplementedError("the java engine can't migrate monitors");
+        }
+
+        @JRubyMethod(name = "defer_accept=")
+        public IRubyObject setDeferAccept(ThreadContext context, IRubyObject seconds) {
+            if(seconds.isTrue() && !seconds.equals(RubyFixnum.zero(context.getRuntime()))) {
+                throw context.getRuntime().newNotImplementedError("the java engine has no TCP_DEFER_ACCEPT");
+            }
+            return seconds;
+        }
+
+        @JRubyMethod(name = "accept_nonblock", optional = 1)
+        public IRubyObject acceptNonblock(ThreadContext context, IRubyObject[] args) {
+            throw context.getRuntime().newNotImplementedError("the java engine can't accept and read in one call");
+        }
+
+        @JRubyMethod(name = "min_readable_bytes=")
+        public IRubyObject setMinReadableBytes(ThreadContext context, IRubyObject bytes) {
+            if(bytes.isNil() || RubyNumeric.num2int(bytes) == 1)
+                return bytes;
+
+            throw context.getRuntime().newNotImplementedError("the java engine has no min_readable_bytes");
+        }
+
+        @JRubyMethod
+        public IRubyObject min_readable_bytes(ThreadContext context) {
+            return context.getRuntime().newFixnum(1);
+        }
+
+        @JRubyMethod(name = "receive_timestamps=")
+        public IRubyObject setReceiveTimestamps(ThreadContext context, IRubyObject enabled) {
+            if(!enabled.isTrue())
+                return enabled;
+
+            throw context.getRuntime().newNotImplementedError("the java engine has no receive timestamps");
+        }
+
+        @JRubyMethod(name = "receive_timestamps?")
+        public IRubyObject isReceiveTimestamps(ThreadContext context) {
+            return context.getRuntime().getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject received_at(ThreadContext context) {
+            return context.nil;
+        }
+
+        @JRubyMethod(optional = 1)
+        public IRubyObject tcp_info(ThreadContext context, IRubyObject[] args) {
+            throw context.getRuntime().newNotImplementedError("TCP_INFO is not available on the JVM");
+        }
+
+        @JRubyMethod(name = "slow?")
+        public IRubyObject isSlow(ThreadContext context) {
+            return context.getRuntime().getFalse();
+        }
+
         @JRubyMethod(name = "value")
         public IRubyObject getValue(ThreadContext context) {
             return this.value;
@@ -401,18 +1143,206 @@ public class Nio4r implements Library {
         @JRubyMethod
         public IRubyObject close(ThreadContext context, IRubyObject deregister) {
             Ruby runtime = context.getRuntime();
+            IRubyObject closeIO = context.nil;
+
+            /* close(:deregister => true, :close_io => true) */
+            if(deregister instanceof RubyHash) {
+                RubyHash options = (RubyHash)deregister;
+                closeIO = options.op_aref(context, runtime.newSymbol("close_io"));
+                deregister = options.op_aref(context, runtime.newSymbol("deregister")).isNil() ?
+                    runtime.getTrue() : options.op_aref(context, runtime.newSymbol("deregister"));
+
+                if(closeIO == runtime.newSymbol("async")) {
+                    throw runtime.newNotImplementedError("the java engine can't close IOs in the background");
+                } else if(closeIO.isTrue() && closeIO != runtime.getTrue()) {
+                    throw runtime.newArgumentError("close_io must be true, false or :async");
+                }
+            }
+
+            /* Don't leave a thread waiting for a process nobody will reap */
+            if(this.processWaiter != null && this.closed != runtime.getTrue()) {
+                this.processWaiter.callMethod(context, "close");
+            }
+
             this.closed = runtime.getTrue();
 
+            /* Don't leave a thread parked on a monitor that will never fire */
+            Thread thread = this.waiter;
+            if(thread != null) {
+                LockSupport.unpark(thread);
+            }
+
             if(deregister == runtime.getTrue()) {
                 selector.callMethod(context, "deregister", io);
             }
 
+            if(closeIO.isTrue() && io != null && !io.callMethod(context, "closed?").isTrue()) {
+                io.callMethod(context, "close");
+            }
+
+            return context.nil;
+        }
+
+        /* Close this monitor and hand it back to its selector, which reuses
+           it for the next register(io, interests, :reuse => true) */
+        @JRubyMethod
+        public IRubyObject recycle(ThreadContext context) {
+            if(this.isClosed(context).isTrue())
+                return context.nil;
+
+            close(context, context.getRuntime().getTrue());
+            this.io = null;
+            this.value = context.nil;
+            this.processWaiter = null;
+            ((Selector)this.selector).recycle(this);
+
             return context.nil;
         }
 
+        /* The watched process's Process::Status once it has exited, which
+           also closes the monitor and its IO. nil while it's still running.
+           Once the monitor is closed, the status if it already has one */
+        @JRubyMethod
+        public IRubyObject reap(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+
+            if(this.processWaiter == null) {
+                throw runtime.newArgumentError("monitor isn't watching a process");
+            }
+
+            IRubyObject status = this.processWaiter.callMethod(context, "reap");
+            if(!status.isNil() && this.closed != runtime.getTrue()) {
+                RubyHash options = RubyHash.newHash(runtime);
+                options.op_aset(context, runtime.newSymbol("close_io"), runtime.getTrue());
+                close(context, options);
+            }
+
+            return status;
+        }
+
         @JRubyMethod(name = "closed?")
         public IRubyObject isClosed(ThreadContext context) {
             return this.closed;
         }
+
+        /* Close the monitored IO object, if it isn't already */
+        public void closeIO(ThreadContext context) {
+            if(!this.io.callMethod(context, "closed?").isTrue()) {
+                this.io.callMethod(context, "close");
+            }
+        }
+    }
+
+    /* NIO.wait: each thread waits on a selector of its own which only ever
+       holds the channel being waited for, so there's no monitor to create
+       and no lock to share with other selectors */
+    public static class Wait {
+        private static final ThreadLocal<java.nio.channels.Selector> selectors = new ThreadLocal<java.nio.channels.Selector>();
+
+        /* Blocking select that Thread#raise and Thread#kill can interrupt */
+        private static final RubyThread.Task<java.nio.channels.Selector,Integer> waitTask = new RubyThread.Task<java.nio.channels.Selector,Integer>() {
+            public Integer run(ThreadContext context, java.nio.channels.Selector selector) throws InterruptedException {
+                try {
+                    return selector.select(pendingTimeout.get());
+                } catch(IOException ie) {
+                    throw context.getRuntime().newIOError(ie.getLocalizedMessage());
+                }
+            }
+
+            public void wakeup(RubyThread thread, java.nio.channels.Selector selector) {
+                selector.wakeup();
+            }
+        };
+
+        /* The timeout for waitTask, zero meaning forever as for select() */
+        private static final ThreadLocal<Long> pendingTimeout = new ThreadLocal<Long>();
+
+        @JRubyMethod(name = "wait", meta = true, required = 2, optional = 1)
+        public static IRubyObject wait(ThreadContext context, IRubyObject self, IRubyObject[] args) {
+            Ruby runtime = context.getRuntime();
+            Channel rawChannel = RubyIO.convertToIO(context, args[0]).getChannel();
+            String interests = args[1].toString();
+            long millis = -1;
+
+            if(!(rawChannel instanceof SelectableChannel)) {
+                throw runtime.newArgumentError("not a selectable IO object");
+            }
+
+            SelectableChannel channel = (SelectableChannel)rawChannel;
+            int readOps = (channel.validOps() & SelectionKey.OP_ACCEPT) != 0 ? SelectionKey.OP_ACCEPT : SelectionKey.OP_READ;
+            int writeOps = channel instanceof SocketChannel && !((SocketChannel)channel).isConnected() ?
+                SelectionKey.OP_CONNECT : SelectionKey.OP_WRITE;
+            int interestOps;
+
+            if(interests.equals("r")) {
+                interestOps = readOps;
+            } else if(interests.equals("w")) {
+                interestOps = writeOps;
+            } else if(interests.equals("rw")) {
+                interestOps = (readOps | writeOps) & channel.validOps();
+            } else {
+                throw runtime.newArgumentError("invalid event type " + args[1].inspect() + " (must be :r, :w, or :rw)");
+            }
+
+            if(args.length > 2 && !args[2].isNil()) {
+                double t = RubyNumeric.num2dbl(args[2]);
+                if(t < 0) {
+                    throw runtime.newArgumentError("time interval must be positive");
+                }
+
+                /* Timeouts under a millisecond shouldn't turn into an infinite wait */
+                millis = t == 0 ? 0 : Math.max(1, (long)(t * 1000));
+            }
+
+            try {
+                java.nio.channels.Selector selector = selectors.get();
+                if(selector == null) {
+                    selector = java.nio.channels.Selector.open();
+                    selectors.set(selector);
+                }
+
+                channel.configureBlocking(false);
+                SelectionKey key = channel.register(selector, interestOps);
+                int readyOps = 0;
+
+                try {
+                    int ready;
+                    if(millis == 0) {
+                        ready = selector.selectNow();
+                    } else {
+                        pendingTimeout.set(millis < 0 ? 0 : millis);
+                        ready = context.getThread().executeTask(context, selector, waitTask);
+                    }
+
+                    if(ready > 0) {
+                        readyOps = key.readyOps();
+                    }
+                } catch(InterruptedException ie) {
+                    readyOps = 0;
+                } finally {
+                    /* Flush the cancellation so the channel can be registered again */
+                    key.cancel();
+                    selector.selectNow();
+                    selector.selectedKeys().clear();
+                }
+
+                boolean readable = (readyOps & (SelectionKey.OP_READ | SelectionKey.OP_ACCEPT)) != 0;
+                boolean writable = (readyOps & (SelectionKey.OP_WRITE | SelectionKey.OP_CONNECT)) != 0;
+
+                if(readable && writable) {
+                    return runtime.newSymbol("rw");
+                } else if(readable) {
+                    return runtime.newSymbol("r");
+                } else if(writable) {
+                    return runtime.newSymbol("w");
+                } else {
+                    return context.nil;
+                }
+            } catch(java.nio.channels.ClosedChannelException cce) {
+                throw runtime.newIOError(cce.getLocalizedMessage());
+            } catch(IOException ie) {
+                throw runtime.newIOError(ie.getLocalizedMessage());
+            }
+        }
     }
 }
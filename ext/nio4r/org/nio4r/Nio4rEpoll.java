@@ -0,0 +1,1319 @@
+package org.nio4r;
+
+import java.util.ArrayDeque;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Collections;
+import java.util.Comparator;
+import java.util.concurrent.ConcurrentHashMap;
+import jnr.ffi.LibraryLoader;
+import jnr.ffi.Memory;
+import jnr.ffi.Platform;
+import jnr.ffi.Pointer;
+import org.jruby.Ruby;
+import org.jruby.RubyModule;
+import org.jruby.RubyClass;
+import org.jruby.RubyObject;
+import org.jruby.RubyIO;
+import org.jruby.RubyNumeric;
+import org.jruby.RubyArray;
+import org.jruby.RubyFixnum;
+import org.jruby.RubyHash;
+import org.jruby.RubyString;
+import org.jruby.RubySymbol;
+import org.jruby.RubyThread;
+import org.jruby.anno.JRubyMethod;
+import org.jruby.exceptions.RaiseException;
+import org.jruby.runtime.ObjectAllocator;
+import org.jruby.runtime.ThreadContext;
+import org.jruby.runtime.load.Library;
+import org.jruby.runtime.builtin.IRubyObject;
+import org.jruby.runtime.Block;
+
+/* Alternative engine for JRuby on Linux which calls epoll directly through
+   JNR rather than going through java.nio.channels.Selector. Registering an IO
+   is a single epoll_ctl() which doesn't contend with a pending select, and
+   there's no selected-key set or SelectionKey per IO to maintain.
+
+   Enable it by setting NIO4R_EPOLL in the environment before requiring nio */
+public class Nio4rEpoll implements Library {
+    public interface LibC {
+        int epoll_create1(int flags);
+        int epoll_ctl(int epfd, int op, int fd, Pointer event);
+        int epoll_wait(int epfd, Pointer events, int maxevents, int timeout);
+        int eventfd(int initval, int flags);
+        int poll(Pointer fds, long nfds, int timeout);
+        long read(int fd, Pointer buf, long count);
+        long write(int fd, Pointer buf, long count);
+        int close(int fd);
+    }
+
+    static final int EPOLL_CTL_ADD = 1;
+    static final int EPOLL_CTL_DEL = 2;
+    static final int EPOLL_CTL_MOD = 3;
+
+    static final int EPOLLIN  = 0x001;
+    static final int EPOLLOUT = 0x004;
+    static final int EPOLLERR = 0x008;
+    static final int EPOLLHUP = 0x010;
+
+    /* Registration flags (see :edge_triggered, :oneshot and :exclusive) */
+    static final int EPOLLEXCLUSIVE = 1 << 28;
+    static final int EPOLLONESHOT   = 1 << 30;
+    static final int EPOLLET        = 1 << 31;
+
+    static final int POLLIN   = 0x001;
+    static final int POLLOUT  = 0x004;
+    static final int POLLERR  = 0x008;
+    static final int POLLHUP  = 0x010;
+    static final int POLLNVAL = 0x020;
+
+    static final int EPOLL_CLOEXEC = 02000000;
+    static final int EFD_CLOEXEC   = 02000000;
+    static final int EFD_NONBLOCK  = 04000;
+
+    /* Most events we'll pick up from a single epoll_wait() */
+    static final int MAX_EVENTS = 256;
+
+    /* Most recycled monitors a selector holds onto */
+    static final int MONITOR_POOL_SIZE = 1024;
+
+    /* Metrics NIO::Selector#top can sort by */
+    static final String[] METRICS = {"handler_time", "events", "bytes_read", "bytes_written", "bytes", "last_activity"};
+
+    private Ruby ruby;
+    private LibC libc;
+    private jnr.ffi.Runtime ffi;
+    private RubySymbol readSymbol, writeSymbol, readWriteSymbol;
+
+    /* struct epoll_event is packed on x86_64 only */
+    private int eventSize, eventDataOffset;
+
+    public void load(final Ruby ruby, boolean bln) {
+        this.ruby = ruby;
+
+        if(Platform.getNativePlatform().getOS() != Platform.OS.LINUX) {
+            throw ruby.newNotImplementedError("the epoll engine requires Linux");
+        }
+
+        this.libc = LibraryLoader.create(LibC.class).load("c");
+        this.ffi  = jnr.ffi.Runtime.getRuntime(this.libc);
+
+        if(Platform.getNativePlatform().getCPU() == Platform.CPU.X86_64) {
+            this.eventSize = 12;
+            this.eventDataOffset = 4;
+        } else {
+            this.eventSize = 16;
+            this.eventDataOffset = 8;
+        }
+
+        this.readSymbol      = ruby.newSymbol("r");
+        this.writeSymbol     = ruby.newSymbol("w");
+        this.readWriteSymbol = ruby.newSymbol("rw");
+
+        RubyModule nio = ruby.defineModule("NIO");
+
+        RubyClass selector = ruby.defineClassUnder("Selector", ruby.getObject(), new ObjectAllocator() {
+            public IRubyObject allocate(Ruby ruby, RubyClass rc) {
+                return new Selector(ruby, rc);
+            }
+        }, nio);
+
+        selector.defineAnnotatedMethods(Selector.class);
+
+        RubyClass monitor = ruby.defineClassUnder("Monitor", ruby.getObject(), new ObjectAllocator() {
+            public IRubyObject allocate(Ruby ruby, RubyClass rc) {
+                return new Monitor(ruby, rc);
+            }
+        }, nio);
+
+        monitor.defineAnnotatedMethods(Monitor.class);
+
+        Wait.engine = this;
+        nio.defineAnnotatedMethods(Wait.class);
+    }
+
+    private RaiseException errno(Ruby runtime, String call) {
+        return runtime.newErrnoFromInt(this.ffi.getLastError(), call);
+    }
+
+    /* Raw file descriptor behind a Ruby IO object */
+    private int fileno(ThreadContext context, IRubyObject io) {
+        int fd = RubyIO.convertToIO(context, io).getOpenFileChecked().fd().realFileno;
+
+        if(fd < 0) {
+            throw context.getRuntime().newArgumentError("not a native file descriptor");
+        }
+
+        return fd;
+    }
+
+    public class Selector extends RubyObject {
+        private int epfd = -1, wakeupfd = -1;
+        private volatile boolean closed = false;
+        private final ConcurrentHashMap<Integer,Monitor> monitors = new ConcurrentHashMap<Integer,Monitor>();
+
+        /* Recycled monitors (see NIO::Monitor#recycle) */
+        private final ArrayDeque<Monitor> freeMonitors = new ArrayDeque<Monitor>();
+        private long poolHits, poolMisses;
+
+        /* epoll_wait() calls */
+        private long polls;
+
+        /* Monitors whose interests changed since the last select (see
+           Monitor#interests=), and changes asked for against epoll_ctl()s */
+        private final ArrayList<Monitor> dirtyMonitors = new ArrayList<Monitor>();
+        private long interestChanges, interestUpdates;
+
+        /* Per-monitor accounting (see #accounting=) */
+        private volatile boolean accounting = false;
+
+        /* Native buffers: events from epoll_wait, and eventfd counters */
+        private Pointer events, wakeupWriteBuffer, wakeupReadBuffer;
+
+        /* Blocking epoll_wait() that Thread#raise and Thread#kill can interrupt */
+        private int pendingTimeout;
+        private final RubyThread.Task<Selector,Integer> waitTask = new RubyThread.Task<Selector,Integer>() {
+            public Integer run(ThreadContext context, Selector selector) {
+                return libc.epoll_wait(selector.epfd, selector.events, MAX_EVENTS, selector.pendingTimeout);
+            }
+
+            public void wakeup(RubyThread thread, Selector selector) {
+                selector.signal();
+            }
+        };
+
+        public Selector(final Ruby ruby, RubyClass rubyClass) {
+            super(ruby, rubyClass);
+        }
+
+        @JRubyMethod
+        public IRubyObject initialize(ThreadContext context, IRubyObject options) {
+            Ruby runtime = context.getRuntime();
+
+            if(!options.isNil() && options.convertToHash().op_aref(context, runtime.newSymbol("pipelined")).isTrue()) {
+                throw runtime.newNotImplementedError("the epoll engine has no pipelined polling");
+            }
+
+            IRubyObject backend = options.isNil() ? runtime.getNil() : options.convertToHash().op_aref(context, runtime.newSymbol("backend"));
+            if(!backend.isNil() && !backend.equals(runtime.newSymbol("epoll"))) {
+                throw runtime.newNotImplementedError("the epoll engine only polls with epoll");
+            }
+
+            return initialize(context);
+        }
+
+        @JRubyMethod
+        public IRubyObject initialize(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+
+            this.epfd = libc.epoll_create1(EPOLL_CLOEXEC);
+            if(this.epfd < 0) {
+                throw errno(runtime, "epoll_create1");
+            }
+
+            this.wakeupfd = libc.eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if(this.wakeupfd < 0) {
+                throw errno(runtime, "eventfd");
+            }
+
+            this.events = Memory.allocateDirect(ffi, MAX_EVENTS * eventSize);
+            this.wakeupReadBuffer = Memory.allocateDirect(ffi, 8);
+            this.wakeupWriteBuffer = Memory.allocateDirect(ffi, 8);
+            this.wakeupWriteBuffer.putLong(0, 1);
+
+            ctl(runtime, EPOLL_CTL_ADD, this.wakeupfd, EPOLLIN);
+            return context.nil;
+        }
+
+        private void ctl(Ruby runtime, int op, int fd, int interests) {
+            Pointer event = Memory.allocate(ffi, eventSize);
+            event.putInt(0, interests);
+            event.putInt(eventDataOffset, fd);
+
+            if(libc.epoll_ctl(this.epfd, op, fd, event) < 0) {
+                throw errno(runtime, "epoll_ctl");
+            }
+        }
+
+        @JRubyMethod
+        public IRubyObject close(ThreadContext context) {
+            return close(context, context.nil);
+        }
+
+        /* The epoll fd takes every registration with it, so monitors only
+           need to be marked closed rather than removed with EPOLL_CTL_DEL */
+        @JRubyMethod
+        public IRubyObject close(ThreadContext context, IRubyObject closeIOs) {
+            Ruby runtime = context.getRuntime();
+
+            if(this.closed)
+                return context.nil;
+
+            this.closed = true;
+            libc.close(this.epfd);
+            libc.close(this.wakeupfd);
+
+            for(Monitor monitor : this.monitors.values()) {
+                monitor.close(context, runtime.getFalse());
+                if(closeIOs.isTrue()) {
+                    monitor.closeIO(context);
+                }
+            }
+            this.monitors.clear();
+
+            return context.nil;
+        }
+
+        @JRubyMethod(name = "closed?")
+        public IRubyObject isClosed(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+            return this.closed ? runtime.getTrue() : runtime.getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject register(ThreadContext context, IRubyObject io, IRubyObject interests) {
+            return register(context, io, interests, context.nil);
+        }
+
+        /* Besides the options every engine takes, this one registers with
+           epoll's own flags:
+
+           :edge_triggered - only report readiness when it changes (EPOLLET)
+           :oneshot - disable the monitor after each event until it's rearmed
+                      with Monitor#rearm (EPOLLONESHOT)
+           :exclusive - when several selectors register the same fd, only
+                        wake one of them per event (EPOLLEXCLUSIVE) */
+        @JRubyMethod
+        public IRubyObject register(ThreadContext context, IRubyObject io, IRubyObject interests, IRubyObject options) {
+            Ruby runtime = context.getRuntime();
+
+            if(RubyIO.convertToIO(context, io).callMethod(context, "closed?").isTrue()) {
+                throw runtime.newIOError("closed stream");
+            }
+
+            int fd = fileno(context, io);
+            int flags = registerFlags(context, options);
+
+            if(this.monitors.containsKey(fd)) {
+                throw runtime.newArgumentError("this IO is already registered with selector");
+            }
+
+            Monitor monitor = newMonitor(context, io, interests, options);
+            monitor.setFileno(fd);
+            monitor.setFlags(flags);
+
+            ctl(runtime, EPOLL_CTL_ADD, fd, monitor.getEvents() | flags);
+            this.monitors.put(fd, monitor);
+
+            return monitor;
+        }
+
+        private int registerFlags(ThreadContext context, IRubyObject options) {
+            Ruby runtime = context.getRuntime();
+            int flags = 0;
+
+            if(options.isNil())
+                return flags;
+
+            RubyHash hash = options.convertToHash();
+            if(hash.op_aref(context, runtime.newSymbol("edge_triggered")).isTrue()) {
+                flags |= EPOLLET;
+            }
+            if(hash.op_aref(context, runtime.newSymbol("oneshot")).isTrue()) {
+                flags |= EPOLLONESHOT;
+            }
+            if(hash.op_aref(context, runtime.newSymbol("exclusive")).isTrue()) {
+                flags |= EPOLLEXCLUSIVE;
+            }
+
+            if((flags & EPOLLONESHOT) != 0 && (flags & EPOLLEXCLUSIVE) != 0) {
+                throw runtime.newArgumentError("oneshot monitors can't be exclusive");
+            }
+
+            return flags;
+        }
+
+        @JRubyMethod
+        public IRubyObject deregister(ThreadContext context, IRubyObject io) {
+            RubyIO rubyIO = RubyIO.convertToIO(context, io);
+
+            /* A closed IO has no fd left to look up, so find its monitor */
+            if(rubyIO.callMethod(context, "closed?").isTrue()) {
+                for(Monitor monitor : this.monitors.values()) {
+                    if(monitor.io == rubyIO) {
+                        return deregister(context, monitor);
+                    }
+                }
+
+                return context.nil;
+            }
+
+            Monitor monitor = this.monitors.get(fileno(context, io));
+            return monitor == null ? context.nil : deregister(context, monitor);
+        }
+
+        /* Deregister by the fd the monitor was registered with, which still
+           works once its IO has been closed */
+        IRubyObject deregister(ThreadContext context, Monitor monitor) {
+            if(!this.monitors.remove(monitor.fd, monitor))
+                return context.nil;
+
+            /* The kernel drops closed descriptors by itself, so ignore failures */
+            if(!this.closed) {
+                libc.epoll_ctl(this.epfd, EPOLL_CTL_DEL, monitor.fd, null);
+            }
+
+            monitor.close(context, context.getRuntime().getFalse());
+            return monitor;
+        }
+
+        /* Reenable a oneshot monitor. epoll_ctl() is safe to call while
+           another thread waits, so this takes effect right away */
+        void rearm(Ruby runtime, Monitor monitor) {
+            synchronized(this.dirtyMonitors) {
+                ctl(runtime, EPOLL_CTL_MOD, monitor.fd, monitor.registeredEvents | monitor.flags);
+            }
+        }
+
+        @JRubyMethod(name = "registered?")
+        public IRubyObject isRegistered(ThreadContext context, IRubyObject io) {
+            Ruby runtime = context.getRuntime();
+            return this.monitors.containsKey(fileno(context, io)) ? runtime.getTrue() : runtime.getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject monitors(ThreadContext context) {
+            RubyArray array = context.getRuntime().newArray();
+
+            for(Monitor monitor : this.monitors.values()) {
+                array.add(monitor);
+            }
+
+            return array;
+        }
+
+        @JRubyMethod
+        public synchronized IRubyObject select(ThreadContext context, Block block) {
+            return select(context, context.nil, block);
+        }
+
+        @JRubyMethod
+        public synchronized IRubyObject select(ThreadContext context, IRubyObject timeout, Block block) {
+            Ruby runtime = context.getRuntime();
+            int ready = doSelect(context, timeout);
+
+            /* Timeout */
+            if(ready <= 0)
+                return context.nil;
+
+            RubyArray array = null;
+            if(!block.isGiven()) {
+                array = runtime.newArray(ready);
+            }
+
+            double now = System.currentTimeMillis() / 1000.0;
+            int count = 0;
+            for(int i = 0; i < ready; i++) {
+                int revents = this.events.getInt(i * eventSize);
+                int fd = this.events.getInt(i * eventSize + eventDataOffset);
+
+                if(fd == this.wakeupfd) {
+                    /* Reading an eventfd resets it, giving us level-triggered wakeups */
+                    libc.read(this.wakeupfd, this.wakeupReadBuffer, 8);
+                    continue;
+                }
+
+                Monitor monitor = this.monitors.get(fd);
+                if(monitor == null)
+                    continue;
+
+                monitor.setReadyEvents(revents);
+                count++;
+                if(this.accounting) {
+                    monitor.accountEvent(now);
+                }
+
+                if(block.isGiven()) {
+                    dispatch(context, monitor, block);
+                } else {
+                    array.add(monitor);
+                }
+            }
+
+            /* Only woken up */
+            if(count == 0)
+                return context.nil;
+
+            if(block.isGiven()) {
+                return RubyNumeric.int2fix(runtime, count);
+            } else {
+                return array;
+            }
+        }
+
+        /* Call the select block, timing the handler if accounting is on */
+        private void dispatch(ThreadContext context, Monitor monitor, Block block) {
+            if(!this.accounting) {
+                block.call(context, monitor);
+                return;
+            }
+
+            long startedAt = System.nanoTime();
+            try {
+                block.call(context, monitor);
+            } finally {
+                monitor.accountHandlerTime((System.nanoTime() - startedAt) / 1e9);
+            }
+        }
+
+        /* Run epoll_wait(), releasing the thread to Thread#raise/kill if we block */
+        private int doSelect(ThreadContext context, IRubyObject timeout) {
+            Ruby runtime = context.getRuntime();
+            int millis = -1;
+
+            if(this.closed) {
+                throw runtime.newIOError("selector is closed");
+            }
+
+            flushInterests(runtime);
+
+            if(!timeout.isNil()) {
+                double t = RubyNumeric.num2dbl(timeout);
+                if(t < 0) {
+                    throw runtime.newArgumentError("time interval must be positive");
+                }
+
+                /* Timeouts under a millisecond shouldn't turn into an infinite wait */
+                millis = t == 0 ? 0 : (int)Math.max(1, Math.ceil(t * 1000));
+            }
+
+            int ready;
+            this.polls++;
+            if(millis == 0) {
+                ready = libc.epoll_wait(this.epfd, this.events, MAX_EVENTS, 0);
+            } else {
+                this.pendingTimeout = millis;
+                try {
+                    ready = context.getThread().executeTask(context, this, this.waitTask);
+                } catch(InterruptedException ie) {
+                    ready = 0;
+                }
+            }
+
+            /* EINTR: treat like a timeout */
+            return ready < 0 ? 0 : ready;
+        }
+
+        /* Called by Monitor#interests=, possibly from another thread */
+        void interestsChanged(Monitor monitor) {
+            synchronized(this.dirtyMonitors) {
+                this.interestChanges++;
+                if(!monitor.dirty) {
+                    monitor.dirty = true;
+                    this.dirtyMonitors.add(monitor);
+                }
+            }
+        }
+
+        /* Apply the interest changes made since the last select: at most one
+           epoll_ctl() per fd, however many changes there were */
+        private void flushInterests(Ruby runtime) {
+            synchronized(this.dirtyMonitors) {
+                for(Monitor monitor : this.dirtyMonitors) {
+                    monitor.dirty = false;
+
+                    if(monitor.closed || monitor.events == monitor.registeredEvents) {
+                        continue;
+                    }
+
+                    if((monitor.flags & EPOLLEXCLUSIVE) != 0) {
+                        /* The kernel won't modify exclusive registrations */
+                        libc.epoll_ctl(this.epfd, EPOLL_CTL_DEL, monitor.fd, null);
+                        ctl(runtime, EPOLL_CTL_ADD, monitor.fd, monitor.events | monitor.flags);
+                    } else {
+                        ctl(runtime, EPOLL_CTL_MOD, monitor.fd, monitor.events | monitor.flags);
+                    }
+                    monitor.registeredEvents = monitor.events;
+                    this.interestUpdates++;
+                }
+
+                this.dirtyMonitors.clear();
+            }
+        }
+
+        private void signal() {
+            libc.write(this.wakeupfd, this.wakeupWriteBuffer, 8);
+        }
+
+        @JRubyMethod
+        public IRubyObject wakeup(ThreadContext context) {
+            if(this.closed) {
+                throw context.getRuntime().newIOError("selector is closed");
+            }
+
+            signal();
+            return context.nil;
+        }
+
+        /* Deregister everything but keep the epoll fd and eventfd open */
+        @JRubyMethod
+        public synchronized IRubyObject reset(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+
+            if(this.closed) {
+                throw runtime.newIOError("selector is closed");
+            }
+
+            for(Integer fd : this.monitors.keySet()) {
+                Monitor monitor = this.monitors.remove(fd);
+                if(monitor == null)
+                    continue;
+
+                libc.epoll_ctl(this.epfd, EPOLL_CTL_DEL, fd, null);
+                monitor.close(context, runtime.getFalse());
+            }
+
+            /* Swallow any wakeups nobody selected for */
+            libc.read(this.wakeupfd, this.wakeupReadBuffer, 8);
+            return this;
+        }
+
+        /* Reuse a recycled monitor if asked to and one is available */
+        private Monitor newMonitor(ThreadContext context, IRubyObject io, IRubyObject interests, IRubyObject options) {
+            Ruby runtime = context.getRuntime();
+
+            if(!options.isNil() && (!options.convertToHash().op_aref(context, runtime.newSymbol("group")).isNil() ||
+                                    !options.convertToHash().op_aref(context, runtime.newSymbol("weight")).isNil())) {
+                throw runtime.newNotImplementedError("the epoll engine has no monitor groups");
+            }
+
+            if(!options.isNil() && options.convertToHash().op_aref(context, runtime.newSymbol("reuse")).isTrue()) {
+                Monitor monitor;
+                synchronized(this.freeMonitors) {
+                    monitor = this.freeMonitors.poll();
+                }
+
+                if(monitor != null) {
+                    this.poolHits++;
+                    monitor.initialize(context, io, interests, this);
+                    return monitor;
+                }
+
+                this.poolMisses++;
+            }
+
+            RubyClass monitorClass = runtime.getModule("NIO").getClass("Monitor");
+            return (Monitor)monitorClass.newInstance(context, io, interests, this, null);
+        }
+
+        /* Take back a closed monitor for reuse */
+        public void recycle(Monitor monitor) {
+            synchronized(this.freeMonitors) {
+                if(this.freeMonitors.size() < MONITOR_POOL_SIZE) {
+                    this.freeMonitors.offer(monitor);
+                }
+            }
+        }
+
+        @JRubyMethod
+        public IRubyObject stats(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+            RubyHash stats = RubyHash.newHash(runtime);
+            long requests = this.poolHits + this.poolMisses;
+
+            stats.op_aset(context, runtime.newSymbol("monitor_pool_size"), runtime.newFixnum(this.freeMonitors.size()));
+            stats.op_aset(context, runtime.newSymbol("monitor_pool_hits"), runtime.newFixnum(this.poolHits));
+            stats.op_aset(context, runtime.newSymbol("monitor_pool_misses"), runtime.newFixnum(this.poolMisses));
+            stats.op_aset(context, runtime.newSymbol("monitor_pool_hit_ratio"),
+                runtime.newFloat(requests > 0 ? (double)this.poolHits / requests : 0.0));
+            stats.op_aset(context, runtime.newSymbol("idle_gc_minor"), runtime.newFixnum(0));
+            stats.op_aset(context, runtime.newSymbol("idle_gc_major"), runtime.newFixnum(0));
+            stats.op_aset(context, runtime.newSymbol("lag"), runtime.newFloat(0.0));
+            stats.op_aset(context, runtime.newSymbol("event_rate"), runtime.newFloat(0.0));
+            stats.op_aset(context, runtime.newSymbol("polls"), runtime.newFixnum(this.polls));
+            stats.op_aset(context, runtime.newSymbol("interest_changes"), runtime.newFixnum(this.interestChanges));
+            stats.op_aset(context, runtime.newSymbol("interest_updates"), runtime.newFixnum(this.interestUpdates));
+
+            return stats;
+        }
+
+        @JRubyMethod(name = "accounting=")
+        public IRubyObject setAccounting(ThreadContext context, IRubyObject enabled) {
+            this.accounting = enabled.isTrue();
+            return enabled;
+        }
+
+        @JRubyMethod(name = "event_budget=")
+        public IRubyObject setEventBudget(ThreadContext context, IRubyObject budget) {
+            if(budget.isNil())
+                return budget;
+
+            throw context.getRuntime().newNotImplementedError("the epoll engine has no event budget");
+        }
+
+        @JRubyMethod
+        public IRubyObject event_budget(ThreadContext context) {
+            return context.nil;
+        }
+
+        @JRubyMethod
+        public IRubyObject group_stats(ThreadContext context) {
+            return RubyHash.newHash(context.getRuntime());
+        }
+
+        @JRubyMethod(name = "pipelined?")
+        public IRubyObject isPipelined(ThreadContext context) {
+            return context.getRuntime().getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject backend(ThreadContext context) {
+            return context.getRuntime().newSymbol("epoll");
+        }
+
+        /* Watch for process pid to exit. The JVM has no pidfds, so a thread
+           waits for it instead (see NIO::ProcessWaiter) */
+        @JRubyMethod(name = "watch_process")
+        public IRubyObject watchProcess(ThreadContext context, IRubyObject pid) {
+            Ruby runtime = context.getRuntime();
+            IRubyObject waiter = runtime.getModule("NIO").getClass("ProcessWaiter").callMethod(context, "new", pid);
+
+            Monitor monitor = (Monitor)register(context, waiter.callMethod(context, "reader"), readSymbol);
+            monitor.processWaiter = waiter;
+
+            return monitor;
+        }
+
+        @JRubyMethod(name = "gc_when_idle=")
+        public IRubyObject setGcWhenIdle(ThreadContext context, IRubyObject enabled) {
+            if(enabled.isTrue()) {
+                throw context.getRuntime().newNotImplementedError("the epoll engine leaves GC scheduling to the JVM");
+            }
+
+            return enabled;
+        }
+
+        @JRubyMethod(name = "gc_when_idle?")
+        public IRubyObject isGcWhenIdle(ThreadContext context) {
+            return context.getRuntime().getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject receive_latency(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+            RubyHash latency = RubyHash.newHash(runtime);
+
+            latency.op_aset(context, runtime.newSymbol("samples"), runtime.newFixnum(0));
+            latency.op_aset(context, runtime.newSymbol("p50"), context.nil);
+            latency.op_aset(context, runtime.newSymbol("p99"), context.nil);
+            latency.op_aset(context, runtime.newSymbol("histogram"), RubyHash.newHash(runtime));
+
+            return latency;
+        }
+
+        @JRubyMethod(name = "accounting?")
+        public IRubyObject isAccounting(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+            return this.accounting ? runtime.getTrue() : runtime.getFalse();
+        }
+
+        public boolean accounting() {
+            return this.accounting;
+        }
+
+        /* The n heaviest monitors by the given accounting metric */
+        @JRubyMethod(required = 1, optional = 1)
+        public IRubyObject top(ThreadContext context, IRubyObject[] args) {
+            Ruby runtime = context.getRuntime();
+            long n = RubyNumeric.num2long(args[0]);
+            String by = "handler_time";
+
+            if(n < 0) {
+                throw runtime.newArgumentError("negative count");
+            }
+
+            if(args.length > 1 && !args[1].isNil()) {
+                IRubyObject metric = args[1].convertToHash().op_aref(context, runtime.newSymbol("by"));
+                if(!metric.isNil()) {
+                    by = metric.asJavaString();
+                }
+            }
+
+            if(!Arrays.asList(METRICS).contains(by)) {
+                throw runtime.newArgumentError("invalid metric " + by);
+            }
+
+            final String metric = by;
+            ArrayList<Monitor> monitors = new ArrayList<Monitor>();
+            for(IRubyObject monitor : ((RubyArray)monitors(context)).toJavaArray()) {
+                monitors.add((Monitor)monitor);
+            }
+
+            Collections.sort(monitors, new Comparator<Monitor>() {
+                public int compare(Monitor a, Monitor b) {
+                    return Double.compare(b.metric(metric), a.metric(metric));
+                }
+            });
+
+            RubyArray result = runtime.newArray();
+            for(int i = 0; i < n && i < monitors.size(); i++) {
+                result.add(monitors.get(i));
+            }
+
+            return result;
+        }
+
+        @JRubyMethod(required = 1, optional = 2)
+        public IRubyObject slow_client_policy(ThreadContext context, IRubyObject[] args) {
+            throw context.getRuntime().newNotImplementedError("the epoll engine has no slow client policy");
+        }
+
+        @JRubyMethod
+        public IRubyObject migrate(ThreadContext context, IRubyObject monitors, IRubyObject other) {
+            throw context.getRuntime().newNotImplementedError("the java engine can't migrate monitors");
+        }
+    }
+
+    public class Monitor extends RubyObject {
+        private RubyIO io;
+        private IRubyObject interests, selector, value;
+        private int fd, events, readyEvents;
+        private boolean closed = false;
+
+        /* EPOLLET, EPOLLONESHOT and EPOLLEXCLUSIVE, from register's options */
+        private int flags;
+
+        /* Events the kernel is waiting for, which lag behind events until
+           the next select applies a change (see #interests=) */
+        private int registeredEvents;
+        private boolean dirty;
+
+        /* Accounting counters, kept up to date if the selector has accounting on */
+        private long bytesRead, bytesWritten, eventCount;
+        private double handlerTime, lastActivity;
+
+        /* Set by Selector#watch_process */
+        private IRubyObject processWaiter;
+
+        public Monitor(final Ruby ruby, RubyClass rubyClass) {
+            super(ruby, rubyClass);
+        }
+
+        @JRubyMethod
+        public IRubyObject initialize(ThreadContext context, IRubyObject selectable, IRubyObject interests, IRubyObject selector) {
+            this.io        = RubyIO.convertToIO(context, selectable);
+            this.interests = interests;
+            this.selector  = selector;
+            this.value     = context.nil;
+            this.closed    = false;
+
+            this.bytesRead = this.bytesWritten = this.eventCount = 0;
+            this.handlerTime = this.lastActivity = 0;
+            this.processWaiter = null;
+            this.flags = 0;
+
+            if(interests == readSymbol) {
+                this.events = EPOLLIN;
+            } else if(interests == writeSymbol) {
+                this.events = EPOLLOUT;
+            } else if(interests == readWriteSymbol) {
+                this.events = EPOLLIN | EPOLLOUT;
+            } else {
+                throw context.getRuntime().newArgumentError("invalid interest type: " + interests);
+            }
+
+            this.registeredEvents = this.events;
+            this.dirty = false;
+            return context.nil;
+        }
+
+        public void setFileno(int fd) {
+            this.fd = fd;
+        }
+
+        public void setFlags(int flags) {
+            this.flags = flags;
+        }
+
+        public int getEvents() {
+            return this.events;
+        }
+
+        /* Errors and hangups count as ready for whatever we're interested in */
+        public void setReadyEvents(int revents) {
+            int ready = 0;
+
+            if((revents & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0) {
+                ready |= EPOLLIN;
+            }
+
+            if((revents & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0) {
+                ready |= EPOLLOUT;
+            }
+
+            this.readyEvents = ready & this.events;
+        }
+
+        @JRubyMethod
+        public IRubyObject io(ThreadContext context) {
+            return io == null ? context.nil : io;
+        }
+
+        @JRubyMethod
+        public IRubyObject selector(ThreadContext context) {
+            return selector;
+        }
+
+        @JRubyMethod
+        public IRubyObject interests(ThreadContext context) {
+            return interests;
+        }
+
+        /* Takes effect at the next select, so only the last of several
+           changes in a row costs an epoll_ctl() */
+        @JRubyMethod(name = "interests=")
+        public IRubyObject setInterests(ThreadContext context, IRubyObject interests) {
+            Ruby runtime = context.getRuntime();
+            int events;
+
+            if(this.closed) {
+                throw runtime.newIOError("monitor is closed");
+            }
+
+            if(interests == readSymbol) {
+                events = EPOLLIN;
+            } else if(interests == writeSymbol) {
+                events = EPOLLOUT;
+            } else if(interests == readWriteSymbol) {
+                events = EPOLLIN | EPOLLOUT;
+            } else {
+                throw runtime.newArgumentError("invalid event type " + interests.inspect() + " (must be :r, :w, or :rw)");
+            }
+
+            if(events != this.events) {
+                this.interests = interests;
+                this.events = events;
+                ((Selector)this.selector).interestsChanged(this);
+            }
+
+            return interests;
+        }
+
+        @JRubyMethod
+        public IRubyObject readiness(ThreadContext context) {
+            switch(this.readyEvents) {
+                case EPOLLIN:
+                    return readSymbol;
+                case EPOLLOUT:
+                    return writeSymbol;
+                case EPOLLIN | EPOLLOUT:
+                    return readWriteSymbol;
+                default:
+                    return context.nil;
+            }
+        }
+
+        @JRubyMethod(name = "readable?")
+        public IRubyObject isReadable(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+            return (this.readyEvents & EPOLLIN) != 0 ? runtime.getTrue() : runtime.getFalse();
+        }
+
+        @JRubyMethod(name = {"writable?", "writeable?"})
+        public IRubyObject writable(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+            return (this.readyEvents & EPOLLOUT) != 0 ? runtime.getTrue() : runtime.getFalse();
+        }
+
+        @JRubyMethod(name = "value")
+        public IRubyObject getValue(ThreadContext context) {
+            return this.value;
+        }
+
+        @JRubyMethod(name = "value=")
+        public IRubyObject setValue(ThreadContext context, IRubyObject obj) {
+            this.value = obj;
+            return context.nil;
+        }
+
+        public void accountEvent(double now) {
+            this.eventCount++;
+            this.lastActivity = now;
+        }
+
+        public void accountHandlerTime(double elapsed) {
+            this.handlerTime += elapsed;
+        }
+
+        public double metric(String by) {
+            if(by.equals("handler_time")) {
+                return this.handlerTime;
+            } else if(by.equals("events")) {
+                return this.eventCount;
+            } else if(by.equals("bytes_read")) {
+                return this.bytesRead;
+            } else if(by.equals("bytes_written")) {
+                return this.bytesWritten;
+            } else if(by.equals("bytes")) {
+                return this.bytesRead + this.bytesWritten;
+            } else {
+                return this.lastActivity;
+            }
+        }
+
+        private boolean isAccounting(ThreadContext context) {
+            return !this.isClosed(context).isTrue() && ((Selector)this.selector).accounting();
+        }
+
+        /* IO#read_nonblock, counting the bytes read if accounting is on */
+        @JRubyMethod(rest = true)
+        public IRubyObject read_nonblock(ThreadContext context, IRubyObject[] args) {
+            IRubyObject result = this.io.callMethod(context, "read_nonblock", args);
+
+            if(result instanceof RubyString && isAccounting(context)) {
+                this.bytesRead += ((RubyString)result).getByteList().length();
+            }
+
+            return result;
+        }
+
+        /* IO#write_nonblock, counting the bytes written if accounting is on */
+        @JRubyMethod(rest = true)
+        public IRubyObject write_nonblock(ThreadContext context, IRubyObject[] args) {
+            IRubyObject result = this.io.callMethod(context, "write_nonblock", args);
+
+            if(result instanceof RubyFixnum && isAccounting(context)) {
+                this.bytesWritten += ((RubyFixnum)result).getLongValue();
+            }
+
+            return result;
+        }
+
+        @JRubyMethod
+        public IRubyObject bytes_read(ThreadContext context) {
+            return context.getRuntime().newFixnum(this.bytesRead);
+        }
+
+        @JRubyMethod
+        public IRubyObject bytes_written(ThreadContext context) {
+            return context.getRuntime().newFixnum(this.bytesWritten);
+        }
+
+        @JRubyMethod
+        public IRubyObject events(ThreadContext context) {
+            return context.getRuntime().newFixnum(this.eventCount);
+        }
+
+        @JRubyMethod
+        public IRubyObject handler_time(ThreadContext context) {
+            return context.getRuntime().newFloat(this.handlerTime);
+        }
+
+        @JRubyMethod
+        public IRubyObject last_activity(ThreadContext context) {
+            if(this.eventCount == 0)
+                return context.nil;
+
+            return context.getRuntime().newFloat(this.lastActivity);
+        }
+
+        @JRubyMethod(required = 1, optional = 1)
+        public IRubyObject rate_limit(ThreadContext context, IRubyObject[] args) {
+            throw context.getRuntime().newNotImplementedError("the epoll engine has no rate limiting");
+        }
+
+        @JRubyMethod(name = "throttled?")
+        public IRubyObject isThrottled(ThreadContext context) {
+            return context.getRuntime().getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject group(ThreadContext context) {
+            return context.nil;
+        }
+
+        @JRubyMethod(name = "migrate_to")
+        public IRubyObject migrateTo(ThreadContext context, IRubyObject selector) {
+            throw context.getRuntime().newNotImplementedError("the java engine can't migrate monitors");
+        }
+
+        @JRubyMethod(name = "defer_accept=")
+        public IRubyObject setDeferAccept(ThreadContext context, IRubyObject seconds) {
+            if(seconds.isTrue() && !seconds.equals(RubyFixnum.zero(context.getRuntime()))) {
+                throw context.getRuntime().newNotImplementedError("the java engine has no TCP_DEFER_ACCEPT");
+            }
+            return seconds;
+        }
+
+        @JRubyMethod(name = "accept_nonblock", optional = 1)
+        public IRubyObject acceptNonblock(ThreadContext context, IRubyObject[] args) {
+            throw context.getRuntime().newNotImplementedError("the java engine can't accept and read in one call");
+        }
+
+        @JRubyMethod(name = "min_readable_bytes=")
+        public IRubyObject setMinReadableBytes(ThreadContext context, IRubyObject bytes) {
+            if(bytes.isNil() || RubyNumeric.num2int(bytes) == 1)
+                return bytes;
+
+            throw context.getRuntime().newNotImplementedError("the epoll engine has no min_readable_bytes");
+        }
+
+        @JRubyMethod
+        public IRubyObject min_readable_bytes(ThreadContext context) {
+            return context.getRuntime().newFixnum(1);
+        }
+
+        @JRubyMethod(name = "receive_timestamps=")
+        public IRubyObject setReceiveTimestamps(ThreadContext context, IRubyObject enabled) {
+            if(!enabled.isTrue())
+                return enabled;
+
+            throw context.getRuntime().newNotImplementedError("the epoll engine has no receive timestamps");
+        }
+
+        @JRubyMethod(name = "receive_timestamps?")
+        public IRubyObject isReceiveTimestamps(ThreadContext context) {
+            return context.getRuntime().getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject received_at(ThreadContext context) {
+            return context.nil;
+        }
+
+        @JRubyMethod(optional = 1)
+        public IRubyObject tcp_info(ThreadContext context, IRubyObject[] args) {
+            throw context.getRuntime().newNotImplementedError("TCP_INFO is not available on the JVM");
+        }
+
+        @JRubyMethod(name = "slow?")
+        public IRubyObject isSlow(ThreadContext context) {
+            return context.getRuntime().getFalse();
+        }
+
+        @JRubyMethod
+        public IRubyObject close(ThreadContext context) {
+            return close(context, context.getRuntime().getTrue());
+        }
+
+        @JRubyMethod
+        public IRubyObject close(ThreadContext context, IRubyObject deregister) {
+            Ruby runtime = context.getRuntime();
+            IRubyObject closeIO = context.nil;
+
+            /* close(:deregister => true, :close_io => true) */
+            if(deregister instanceof RubyHash) {
+                RubyHash options = (RubyHash)deregister;
+                closeIO = options.op_aref(context, runtime.newSymbol("close_io"));
+                deregister = options.op_aref(context, runtime.newSymbol("deregister")).isNil() ?
+                    runtime.getTrue() : options.op_aref(context, runtime.newSymbol("deregister"));
+
+                if(closeIO == runtime.newSymbol("async")) {
+                    throw runtime.newNotImplementedError("the java engine can't close IOs in the background");
+                } else if(closeIO.isTrue() && closeIO != runtime.getTrue()) {
+                    throw runtime.newArgumentError("close_io must be true, false or :async");
+                }
+            }
+
+            /* Don't leave a thread waiting for a process nobody will reap */
+            if(this.processWaiter != null && !this.closed) {
+                this.processWaiter.callMethod(context, "close");
+            }
+
+            this.closed = true;
+
+            if(deregister == runtime.getTrue()) {
+                ((Selector)selector).deregister(context, this);
+            }
+
+            if(closeIO.isTrue() && io != null && !io.callMethod(context, "closed?").isTrue()) {
+                io.callMethod(context, "close");
+            }
+
+            return context.nil;
+        }
+
+        /* Close this monitor and hand it back to its selector, which reuses
+           it for the next register(io, interests, :reuse => true) */
+        @JRubyMethod
+        public IRubyObject recycle(ThreadContext context) {
+            if(this.isClosed(context).isTrue())
+                return context.nil;
+
+            close(context, context.getRuntime().getTrue());
+            this.io = null;
+            this.value = context.nil;
+            this.processWaiter = null;
+            ((Selector)this.selector).recycle(this);
+
+            return context.nil;
+        }
+
+        /* Reenable a :oneshot monitor after an event disabled it */
+        @JRubyMethod
+        public IRubyObject rearm(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+
+            if(this.closed) {
+                throw runtime.newIOError("monitor is closed");
+            }
+
+            if((this.flags & EPOLLONESHOT) == 0) {
+                throw runtime.newArgumentError("monitor isn't oneshot");
+            }
+
+            ((Selector)this.selector).rearm(runtime, this);
+            return context.nil;
+        }
+
+        /* The watched process's Process::Status once it has exited, which
+           also closes the monitor and its IO. nil while it's still running.
+           Once the monitor is closed, the status if it already has one */
+        @JRubyMethod
+        public IRubyObject reap(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+
+            if(this.processWaiter == null) {
+                throw runtime.newArgumentError("monitor isn't watching a process");
+            }
+
+            IRubyObject status = this.processWaiter.callMethod(context, "reap");
+            if(!status.isNil() && !this.closed) {
+                RubyHash options = RubyHash.newHash(runtime);
+                options.op_aset(context, runtime.newSymbol("close_io"), runtime.getTrue());
+                close(context, options);
+            }
+
+            return status;
+        }
+
+        @JRubyMethod(name = "closed?")
+        public IRubyObject isClosed(ThreadContext context) {
+            Ruby runtime = context.getRuntime();
+            return this.closed ? runtime.getTrue() : runtime.getFalse();
+        }
+
+        /* Close the monitored IO object, if it isn't already */
+        public void closeIO(ThreadContext context) {
+            if(!this.io.callMethod(context, "closed?").isTrue()) {
+                this.io.callMethod(context, "close");
+            }
+        }
+    }
+
+    /* NIO.wait: a poll() on the one fd, alongside an eventfd per thread so
+       Thread#raise and Thread#kill can cut the wait short */
+    public static class Wait {
+        static Nio4rEpoll engine;
+
+        private static final ThreadLocal<Waiter> waiters = new ThreadLocal<Waiter>();
+
+        /* A thread's pollfds (the IO's, then the eventfd's) and timeout */
+        private static class Waiter {
+            int wakeupfd, timeout;
+            Pointer fds, counter;
+        }
+
+        private static final RubyThread.Task<Waiter,Integer> waitTask = new RubyThread.Task<Waiter,Integer>() {
+            public Integer run(ThreadContext context, Waiter waiter) {
+                return engine.libc.poll(waiter.fds, 2, waiter.timeout);
+            }
+
+            public void wakeup(RubyThread thread, Waiter waiter) {
+                Pointer one = Memory.allocateDirect(engine.ffi, 8);
+                one.putLong(0, 1);
+                engine.libc.write(waiter.wakeupfd, one, 8);
+            }
+        };
+
+        @JRubyMethod(name = "wait", meta = true, required = 2, optional = 1)
+        public static IRubyObject wait(ThreadContext context, IRubyObject self, IRubyObject[] args) {
+            Ruby runtime = context.getRuntime();
+            int fd = engine.fileno(context, args[0]);
+            String interests = args[1].toString();
+            int events, millis = -1;
+
+            if(interests.equals("r")) {
+                events = POLLIN;
+            } else if(interests.equals("w")) {
+                events = POLLOUT;
+            } else if(interests.equals("rw")) {
+                events = POLLIN | POLLOUT;
+            } else {
+                throw runtime.newArgumentError("invalid event type " + args[1].inspect() + " (must be :r, :w, or :rw)");
+            }
+
+            if(args.length > 2 && !args[2].isNil()) {
+                double t = RubyNumeric.num2dbl(args[2]);
+                if(t < 0) {
+                    throw runtime.newArgumentError("time interval must be positive");
+                }
+
+                /* Timeouts under a millisecond shouldn't turn into an infinite wait */
+                millis = t == 0 ? 0 : (int)Math.max(1, Math.ceil(t * 1000));
+            }
+
+            Waiter waiter = waiters.get();
+            if(waiter == null) {
+                waiter = new Waiter();
+                waiter.wakeupfd = engine.libc.eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                if(waiter.wakeupfd < 0) {
+                    throw engine.errno(runtime, "eventfd");
+                }
+
+                waiter.fds = Memory.allocateDirect(engine.ffi, 16);
+                waiter.counter = Memory.allocateDirect(engine.ffi, 8);
+                waiters.set(waiter);
+            }
+
+            /* struct pollfd { int fd; short events; short revents; } */
+            waiter.fds.putInt(0, fd);
+            waiter.fds.putShort(4, (short)events);
+            waiter.fds.putShort(6, (short)0);
+            waiter.fds.putInt(8, waiter.wakeupfd);
+            waiter.fds.putShort(12, (short)POLLIN);
+            waiter.fds.putShort(14, (short)0);
+            waiter.timeout = millis;
+
+            int ready;
+            if(millis == 0) {
+                ready = engine.libc.poll(waiter.fds, 1, 0);
+            } else {
+                try {
+                    ready = context.getThread().executeTask(context, waiter, waitTask);
+                } catch(InterruptedException ie) {
+                    ready = 0;
+                }
+            }
+
+            if(waiter.fds.getShort(14) != 0) {
+                engine.libc.read(waiter.wakeupfd, waiter.counter, 8);
+            }
+
+            /* EINTR: treat like a timeout */
+            if(ready <= 0) {
+                return context.nil;
+            }
+
+            int revents = waiter.fds.getShort(6);
+            if((revents & POLLNVAL) != 0) {
+                throw runtime.newIOError("closed stream");
+            }
+
+            /* Errors and hangups are ready for whatever was asked */
+            boolean readable = (events & POLLIN) != 0 && (revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+            boolean writable = (events & POLLOUT) != 0 && (revents & (POLLOUT | POLLHUP | POLLERR)) != 0;
+
+            if(readable && writable) {
+                return runtime.newSymbol("rw");
+            } else if(readable) {
+                return runtime.newSymbol("r");
+            } else if(writable) {
+                return runtime.newSymbol("w");
+            } else {
+                return context.nil;
+            }
+        }
+    }
+}
@@ -0,0 +1,640 @@
+/*
+ * Copyright (c) 2011 Tony Arcieri. Distributed under the MIT License. See
+ * LICENSE.txt for further details.
+ */
+
+/* Pipelined polling (see NIO::Selector.new :pipelined => true)
+
+   A native poller thread sits in epoll_wait without the GVL and hands the
+   events it collects to select through a single producer, single consumer
+   ring. While Ruby is busy running select's block, the next batch of events
+   is already being gathered, so select only makes a system call of its own
+   when the ring is empty.
+
+   libev isn't thread safe, so the poller has an epoll set of its own. Each
+   fd is registered EPOLLONESHOT: once it has been reported it stays quiet
+   until select has dispatched it and rearms it at the start of the next
+   select, which gives the same level-triggered behavior as libev without
+   the poller flooding the ring with an fd nobody has read from yet */
+
+#include "nio4r.h"
+
+#ifdef NIO_HAVE_PIPELINE
+
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+/* Slots in the ring. Must be a power of two */
+#define NIO_PIPELINE_RING_SIZE 4096
+
+/* Most events the poller collects per epoll_wait */
+#define NIO_PIPELINE_BATCH 256
+
+/* How long the poller backs off when select has fallen a ring behind */
+#define NIO_PIPELINE_FULL_SLEEP 1000
+
+/* epoll data for the pipe that tells the poller to exit */
+#define NIO_PIPELINE_STOP ((uint64_t)-1)
+
+struct NIO_Pipeline_event
+{
+    uint64_t token;
+    uint32_t events;
+};
+
+struct NIO_Pipeline
+{
+    int epoll_fd;
+    int notify_reader, notify_writer;
+    int stop_reader, stop_writer;
+    pthread_t thread;
+    int stopping;
+
+    /* errno of the epoll_wait that stopped the poller, if one did */
+    int error;
+
+    /* Written by the poller (tail) and select (head) only */
+    unsigned int head, tail;
+
+    /* Set once the poller has written to the notify pipe, until select
+       next looks at the ring */
+    int notified;
+
+    struct NIO_Pipeline_event ring[NIO_PIPELINE_RING_SIZE];
+
+    /* Everything below is only touched with the GVL held. Tokens carry the
+       fd and the generation it was registered in, so stale events for a
+       closed (and possibly reused) fd can be told apart */
+    struct NIO_Monitor **monitors;
+    int capacity;
+    uint32_t generation;
+
+    /* Tokens dispatched by the last select, waiting to be rearmed */
+    uint64_t *rearm;
+    int rearm_count, rearm_capacity;
+
+    /* epoll_waits by the poller and by select, bumped atomically */
+    unsigned long polls;
+};
+
+struct NIO_Pipeline_wait_args
+{
+    struct pollfd fds[2];
+    int timeout;
+};
+
+static void *NIO_Pipeline_poll(void *data);
+static void NIO_Pipeline_rearm(struct NIO_Pipeline *pipeline);
+static void NIO_Pipeline_drain(struct NIO_Selector *selector);
+static void NIO_Pipeline_collect(struct NIO_Selector *selector);
+static void NIO_Pipeline_dispatch(struct NIO_Selector *selector, uint64_t token, uint32_t events);
+static void NIO_Pipeline_wait(struct NIO_Selector *selector, double timeout);
+static VALUE NIO_Pipeline_wait_blocking(void *data);
+static uint32_t NIO_Pipeline_epoll_events(struct NIO_Monitor *monitor);
+static int NIO_Pipeline_pipe(int fds[2]);
+static void NIO_Pipeline_close_fds(struct NIO_Pipeline *pipeline);
+
+int NIO_Pipeline_available()
+{
+    return 1;
+}
+
+/* Create the poller's epoll set and pipes and start its thread */
+struct NIO_Pipeline *NIO_Pipeline_new()
+{
+    struct NIO_Pipeline *pipeline;
+    struct epoll_event event;
+    sigset_t all, old;
+    int fds[2], err;
+
+    pipeline = (struct NIO_Pipeline *)xmalloc(sizeof(struct NIO_Pipeline));
+    memset(pipeline, 0, sizeof(struct NIO_Pipeline));
+    pipeline->notify_reader = pipeline->notify_writer = -1;
+    pipeline->stop_reader = pipeline->stop_writer = -1;
+
+    pipeline->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(pipeline->epoll_fd < 0) {
+        xfree(pipeline);
+        rb_sys_fail("epoll_create1");
+    }
+
+    if(NIO_Pipeline_pipe(fds) < 0) {
+        NIO_Pipeline_close_fds(pipeline);
+        xfree(pipeline);
+        rb_sys_fail("pipe");
+    }
+    pipeline->notify_reader = fds[0];
+    pipeline->notify_writer = fds[1];
+
+    if(NIO_Pipeline_pipe(fds) < 0) {
+        NIO_Pipeline_close_fds(pipeline);
+        xfree(pipeline);
+        rb_sys_fail("pipe");
+    }
+    pipeline->stop_reader = fds[0];
+    pipeline->stop_writer = fds[1];
+
+    event.events = EPOLLIN;
+    event.data.u64 = NIO_PIPELINE_STOP;
+    if(epoll_ctl(pipeline->epoll_fd, EPOLL_CTL_ADD, pipeline->stop_reader, &event) < 0) {
+        NIO_Pipeline_close_fds(pipeline);
+        xfree(pipeline);
+        rb_sys_fail("epoll_ctl");
+    }
+
+    /* Signals are Ruby's business, so keep them off the poller thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&pipeline->thread, 0, NIO_Pipeline_poll, (void *)pipeline);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+
+    if(err) {
+        NIO_Pipeline_close_fds(pipeline);
+        xfree(pipeline);
+        errno = err;
+        rb_sys_fail("pthread_create");
+    }
+
+    return pipeline;
+}
+
+/* Stop the poller thread and free everything. Monitors still in the
+   table belong to a selector that's being shut down */
+void NIO_Pipeline_free(struct NIO_Pipeline *pipeline)
+{
+    __atomic_store_n(&pipeline->stopping, 1, __ATOMIC_SEQ_CST);
+    write(pipeline->stop_writer, "\0", 1);
+    pthread_join(pipeline->thread, 0);
+
+    NIO_Pipeline_close_fds(pipeline);
+
+    if(pipeline->monitors) {
+        xfree(pipeline->monitors);
+    }
+
+    if(pipeline->rearm) {
+        xfree(pipeline->rearm);
+    }
+
+    xfree(pipeline);
+}
+
+/* Start watching a monitor's IO for its interests */
+void NIO_Pipeline_add(struct NIO_Pipeline *pipeline, struct NIO_Monitor *monitor)
+{
+    struct epoll_event event;
+    int fd = monitor->ev_io.fd, capacity;
+
+    if(fd >= pipeline->capacity) {
+        capacity = pipeline->capacity ? pipeline->capacity : 64;
+        while(capacity <= fd) {
+            capacity *= 2;
+        }
+
+        REALLOC_N(pipeline->monitors, struct NIO_Monitor *, capacity);
+        memset(pipeline->monitors + pipeline->capacity, 0,
+            (capacity - pipeline->capacity) * sizeof(struct NIO_Monitor *));
+        pipeline->capacity = capacity;
+    }
+
+    monitor->pipeline_generation = ++pipeline->generation;
+
+    event.events = NIO_Pipeline_epoll_events(monitor);
+    event.data.u64 = ((uint64_t)monitor->pipeline_generation << 32) | (uint32_t)fd;
+
+    /* The fd may still be in the set if it was closed and reopened behind
+       the last monitor's back */
+    if(epoll_ctl(pipeline->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0 &&
+       (errno != EEXIST || epoll_ctl(pipeline->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0)) {
+        rb_sys_fail("epoll_ctl");
+    }
+
+    pipeline->monitors[fd] = monitor;
+}
+
+/* Stop watching a monitor's IO. Its events still in the ring are dropped
+   when select finds the generation doesn't match */
+void NIO_Pipeline_remove(struct NIO_Pipeline *pipeline, struct NIO_Monitor *monitor)
+{
+    struct epoll_event event;
+    uint64_t token;
+    int fd = monitor->ev_io.fd, i, kept;
+
+    if(fd >= pipeline->capacity || pipeline->monitors[fd] != monitor) {
+        return;
+    }
+
+    pipeline->monitors[fd] = 0;
+
+    /* Nor rearm it when the next select starts */
+    token = ((uint64_t)monitor->pipeline_generation << 32) | (uint32_t)fd;
+    for(i = kept = 0; i < pipeline->rearm_count; i++) {
+        if(pipeline->rearm[i] != token) {
+            pipeline->rearm[kept++] = pipeline->rearm[i];
+        }
+    }
+    pipeline->rearm_count = kept;
+
+    /* Fails harmlessly if the IO was closed first, which already took it
+       out of the set */
+    epoll_ctl(pipeline->epoll_fd, EPOLL_CTL_DEL, fd, &event);
+}
+
+/* Point the poller at a monitor's new interests. Its events already in
+   the ring still count, since the generation stays the same */
+void NIO_Pipeline_modify(struct NIO_Pipeline *pipeline, struct NIO_Monitor *monitor)
+{
+    struct epoll_event event;
+    int fd = monitor->ev_io.fd;
+
+    if(fd >= pipeline->capacity || pipeline->monitors[fd] != monitor) {
+        return;
+    }
+
+    event.events = NIO_Pipeline_epoll_events(monitor);
+    event.data.u64 = ((uint64_t)monitor->pipeline_generation << 32) | (uint32_t)fd;
+    epoll_ctl(pipeline->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+/* Pipelined counterpart of NIO_Selector_run: dispatch whatever the poller
+   has collected, blocking only when there's nothing there yet */
+int NIO_Pipeline_run(struct NIO_Selector *selector, VALUE timeout)
+{
+    ev_tstamp deadline = 0, remaining = -1;
+    int result, error, idle_gc = selector->gc_when_idle && (timeout == Qnil || NUM2DBL(timeout) > 0);
+
+    if(timeout != Qnil) {
+        deadline = ev_time() + NUM2DBL(timeout);
+    }
+
+    selector->selecting = 1;
+    NIO_Pipeline_rearm(selector->pipeline);
+
+    for(;;) {
+        NIO_Pipeline_drain(selector);
+
+        /* A block passed to select may have closed the selector */
+        if(!selector->pipeline || selector->ready_count || !selector->selecting) {
+            break;
+        }
+
+        NIO_Pipeline_collect(selector);
+
+        if(!selector->pipeline || selector->ready_count) {
+            break;
+        }
+
+        /* The poller has given up, so nothing more is coming */
+        error = __atomic_load_n(&selector->pipeline->error, __ATOMIC_SEQ_CST);
+        if(error) {
+            selector->selecting = 0;
+            errno = error;
+            rb_sys_fail("epoll_wait");
+        }
+
+        /* Nothing's ready, so give the GC a turn before sleeping, then go
+           back for whatever arrived meanwhile */
+        if(idle_gc) {
+            idle_gc = 0;
+            if(NIO_Selector_idle_gc(selector)) {
+                continue;
+            }
+        }
+
+        if(timeout != Qnil) {
+            remaining = deadline - ev_time();
+            if(remaining <= 0) {
+                break;
+            }
+        }
+
+        NIO_Pipeline_wait(selector, remaining);
+    }
+
+    result = selector->ready_count;
+    selector->selecting = selector->ready_count = 0;
+
+    return result;
+}
+
+/* epoll_waits so far, by either thread */
+unsigned long NIO_Pipeline_polls(struct NIO_Pipeline *pipeline)
+{
+    return __atomic_load_n(&pipeline->polls, __ATOMIC_RELAXED);
+}
+
+/* Poller thread: wait for events without the GVL and publish them */
+static void *NIO_Pipeline_poll(void *data)
+{
+    struct NIO_Pipeline *pipeline = (struct NIO_Pipeline *)data;
+    struct epoll_event events[NIO_PIPELINE_BATCH];
+    struct NIO_Pipeline_event *slot;
+    unsigned int head, tail, space;
+    int i, count;
+
+    tail = pipeline->tail;
+
+    while(!__atomic_load_n(&pipeline->stopping, __ATOMIC_SEQ_CST)) {
+        head = __atomic_load_n(&pipeline->head, __ATOMIC_ACQUIRE);
+        space = NIO_PIPELINE_RING_SIZE - (tail - head);
+
+        if(!space) {
+            usleep(NIO_PIPELINE_FULL_SLEEP);
+            continue;
+        }
+
+        count = epoll_wait(pipeline->epoll_fd, events,
+            space < NIO_PIPELINE_BATCH ? space : NIO_PIPELINE_BATCH, -1);
+        __atomic_add_fetch(&pipeline->polls, 1, __ATOMIC_RELAXED);
+
+        if(count < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            /* Hand the error to select rather than dying quietly */
+            __atomic_store_n(&pipeline->error, errno, __ATOMIC_SEQ_CST);
+            write(pipeline->notify_writer, "\0", 1);
+            break;
+        }
+
+        for(i = 0; i < count; i++) {
+            if(events[i].data.u64 == NIO_PIPELINE_STOP) {
+                continue;
+            }
+
+            slot = &pipeline->ring[tail & (NIO_PIPELINE_RING_SIZE - 1)];
+            slot->token = events[i].data.u64;
+            slot->events = events[i].events;
+            tail++;
+        }
+
+        if(tail == pipeline->tail) {
+            continue;
+        }
+
+        __atomic_store_n(&pipeline->tail, tail, __ATOMIC_SEQ_CST);
+
+        /* Only wake select if it hasn't been woken since it last looked */
+        if(!__atomic_exchange_n(&pipeline->notified, 1, __ATOMIC_SEQ_CST)) {
+            write(pipeline->notify_writer, "\0", 1);
+        }
+    }
+
+    return 0;
+}
+
+/* Let the poller report the IOs dispatched by the last select again */
+static void NIO_Pipeline_rearm(struct NIO_Pipeline *pipeline)
+{
+    struct epoll_event event;
+    struct NIO_Monitor *monitor;
+    uint64_t token;
+    int i, fd;
+
+    for(i = 0; i < pipeline->rearm_count; i++) {
+        token = pipeline->rearm[i];
+        fd = (int)(token & 0xffffffff);
+        monitor = pipeline->monitors[fd];
+
+        if(!monitor || monitor->pipeline_generation != (uint32_t)(token >> 32)) {
+            continue;
+        }
+
+        event.events = NIO_Pipeline_epoll_events(monitor);
+        event.data.u64 = token;
+        epoll_ctl(pipeline->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    }
+
+    pipeline->rearm_count = 0;
+}
+
+/* Dispatch everything in the ring */
+static void NIO_Pipeline_drain(struct NIO_Selector *selector)
+{
+    struct NIO_Pipeline *pipeline = selector->pipeline;
+    struct NIO_Pipeline_event *slot;
+    unsigned int head, tail;
+    uint64_t token;
+    uint32_t events;
+
+    /* Clear this before looking, so anything published after we've looked
+       writes to the notify pipe */
+    __atomic_store_n(&pipeline->notified, 0, __ATOMIC_SEQ_CST);
+    tail = __atomic_load_n(&pipeline->tail, __ATOMIC_SEQ_CST);
+    head = pipeline->head;
+
+    if(head == tail) {
+        return;
+    }
+
+    ev_now_update(selector->ev_loop);
+
+    while(head != tail) {
+        slot = &pipeline->ring[head & (NIO_PIPELINE_RING_SIZE - 1)];
+        token = slot->token;
+        events = slot->events;
+
+        /* Move past the event before dispatching, so it isn't seen twice
+           if the block raises */
+        head++;
+        __atomic_store_n(&pipeline->head, head, __ATOMIC_RELEASE);
+
+        NIO_Pipeline_dispatch(selector, token, events);
+
+        if(selector->pipeline != pipeline) {
+            return;
+        }
+    }
+}
+
+/* The ring is empty, but the poller may not have caught up with events
+   that are already there (e.g. for select(0) right after a write). The
+   kernel hands each oneshot event to only one epoll_wait, so look for
+   them ourselves without blocking */
+static void NIO_Pipeline_collect(struct NIO_Selector *selector)
+{
+    struct NIO_Pipeline *pipeline = selector->pipeline;
+    struct epoll_event events[NIO_PIPELINE_BATCH];
+    int i, count;
+
+    count = epoll_wait(pipeline->epoll_fd, events, NIO_PIPELINE_BATCH, 0);
+    __atomic_add_fetch(&pipeline->polls, 1, __ATOMIC_RELAXED);
+
+    if(count <= 0) {
+        return;
+    }
+
+    ev_now_update(selector->ev_loop);
+
+    for(i = 0; i < count; i++) {
+        if(events[i].data.u64 == NIO_PIPELINE_STOP) {
+            continue;
+        }
+
+        /* Anything we don't get to if the block closes the selector goes
+           with the epoll set */
+        NIO_Pipeline_dispatch(selector, events[i].data.u64, events[i].events);
+
+        if(selector->pipeline != pipeline) {
+            return;
+        }
+    }
+}
+
+/* Hand an event to its monitor, if it's still registered, and remember
+   to rearm it */
+static void NIO_Pipeline_dispatch(struct NIO_Selector *selector, uint64_t token, uint32_t events)
+{
+    struct NIO_Pipeline *pipeline = selector->pipeline;
+    struct NIO_Monitor *monitor;
+    int fd, revents;
+
+    fd = (int)(token & 0xffffffff);
+    monitor = fd < pipeline->capacity ? pipeline->monitors[fd] : 0;
+
+    if(!monitor || monitor->pipeline_generation != (uint32_t)(token >> 32)) {
+        return;
+    }
+
+    if(pipeline->rearm_count == pipeline->rearm_capacity) {
+        pipeline->rearm_capacity = pipeline->rearm_capacity ? pipeline->rearm_capacity * 2 : 64;
+        REALLOC_N(pipeline->rearm, uint64_t, pipeline->rearm_capacity);
+    }
+    pipeline->rearm[pipeline->rearm_count++] = token;
+
+    revents = 0;
+    if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        revents |= EV_READ;
+    }
+    if(events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        revents |= EV_WRITE;
+    }
+
+    revents &= monitor->interests;
+    if(revents) {
+        NIO_Selector_handle_event(monitor, revents);
+    }
+}
+
+/* Block without the GVL until the poller has something for us, we're
+   woken up, or the timeout runs out. A negative timeout waits forever */
+static void NIO_Pipeline_wait(struct NIO_Selector *selector, double timeout)
+{
+    struct NIO_Pipeline_wait_args args;
+    char buffer[128];
+
+    args.fds[0].fd = selector->pipeline->notify_reader;
+    args.fds[0].events = POLLIN;
+    args.fds[1].fd = selector->wakeup_reader;
+    args.fds[1].events = POLLIN;
+    args.fds[0].revents = args.fds[1].revents = 0;
+    args.timeout = timeout < 0 ? -1 : (int)(timeout * 1000) + 1;
+
+    rb_thread_blocking_region(NIO_Pipeline_wait_blocking, (void *)&args, RUBY_UBF_IO, 0);
+
+    if(args.fds[0].revents) {
+        while(read(selector->pipeline->notify_reader, buffer, 128) > 0);
+    }
+
+    if(args.fds[1].revents) {
+        selector->selecting = 0;
+        while(read(selector->wakeup_reader, buffer, 128) > 0);
+    }
+}
+
+static VALUE NIO_Pipeline_wait_blocking(void *data)
+{
+    struct NIO_Pipeline_wait_args *args = (struct NIO_Pipeline_wait_args *)data;
+
+    poll(args->fds, 2, args->timeout);
+    return Qnil;
+}
+
+static uint32_t NIO_Pipeline_epoll_events(struct NIO_Monitor *monitor)
+{
+    uint32_t events = EPOLLONESHOT;
+
+    if(monitor->interests & EV_READ) {
+        events |= EPOLLIN;
+    }
+    if(monitor->interests & EV_WRITE) {
+        events |= EPOLLOUT;
+    }
+
+    return events;
+}
+
+static int NIO_Pipeline_pipe(int fds[2])
+{
+    if(pipe(fds) < 0) {
+        return -1;
+    }
+
+    if(fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0 ||
+       fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0 || fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void NIO_Pipeline_close_fds(struct NIO_Pipeline *pipeline)
+{
+    int *fds[5], i;
+
+    fds[0] = &pipeline->epoll_fd;
+    fds[1] = &pipeline->notify_reader;
+    fds[2] = &pipeline->notify_writer;
+    fds[3] = &pipeline->stop_reader;
+    fds[4] = &pipeline->stop_writer;
+
+    for(i = 0; i < 5; i++) {
+        if(*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+#else
+
+/* Without epoll and native threads that can run outside the GVL, there's
+   nothing for the poller to run on */
+
+int NIO_Pipeline_available()
+{
+    return 0;
+}
+
+struct NIO_Pipeline *NIO_Pipeline_new()
+{
+    rb_raise(rb_eNotImpError, "pipelined selectors aren't supported on this platform");
+    return 0;
+}
+
+void NIO_Pipeline_free(struct NIO_Pipeline *pipeline) {}
+void NIO_Pipeline_add(struct NIO_Pipeline *pipeline, struct NIO_Monitor *monitor) {}
+void NIO_Pipeline_remove(struct NIO_Pipeline *pipeline, struct NIO_Monitor *monitor) {}
+void NIO_Pipeline_modify(struct NIO_Pipeline *pipeline, struct NIO_Monitor *monitor) {}
+
+int NIO_Pipeline_run(struct NIO_Selector *selector, VALUE timeout)
+{
+    return 0;
+}
+
+unsigned long NIO_Pipeline_polls(struct NIO_Pipeline *pipeline)
+{
+    return 0;
+}
+
+#endif /* NIO_HAVE_PIPELINE */
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2011 Tony Arcieri. Distributed under the MIT License. See
+ * LICENSE.txt for further details.
+ */
+
+/* Process exit monitors (see NIO::Selector#watch_process)
+
+   On Linux 5.3+ a pidfd turns readable when its process exits, so it can
+   be registered like any other fd: no SIGCHLD handler, no waitpid() scan
+   over every child, and no stepping on anyone else who waits for their
+   own children. The monitor reaps with waitid(P_PIDFD), which only ever
+   looks at that one process.
+
+   Without pidfds (other platforms, older kernels) a thread per process
+   waits for it instead (see NIO::ProcessWaiter) */
+
+#include "nio4r.h"
+#include <errno.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(HAVE_RB_LAST_STATUS_SET)
+#define NIO_HAVE_PIDFD
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+#endif /* defined(__linux__) && defined(HAVE_RB_LAST_STATUS_SET) */
+
+static VALUE NIO_Selector_watch_process(VALUE self, VALUE pid);
+static VALUE NIO_Monitor_reap(VALUE self);
+
+void Init_NIO_Process()
+{
+    VALUE mNIO = rb_define_module("NIO");
+
+    rb_define_method(rb_const_get(mNIO, rb_intern("Selector")), "watch_process", NIO_Selector_watch_process, 1);
+    rb_define_method(rb_const_get(mNIO, rb_intern("Monitor")), "reap", NIO_Monitor_reap, 0);
+}
+
+/* Watch for process pid to exit. Returns a monitor that turns readable
+   once it has, and whose #reap returns its Process::Status */
+static VALUE NIO_Selector_watch_process(VALUE self, VALUE pid)
+{
+    VALUE io, monitor, waiter;
+
+#ifdef NIO_HAVE_PIDFD
+    int fd = (int)syscall(SYS_pidfd_open, (pid_t)NUM2INT(pid), 0);
+
+    if(fd >= 0) {
+        /* pidfds are opened close-on-exec */
+        io = rb_funcall(rb_cIO, rb_intern("for_fd"), 1, INT2NUM(fd));
+        monitor = rb_funcall(self, rb_intern("register"), 2, io, ID2SYM(rb_intern("r")));
+        rb_ivar_set(monitor, rb_intern("pid"), pid);
+
+        return monitor;
+    }
+
+    if(errno != ENOSYS) {
+        rb_sys_fail("pidfd_open");
+    }
+#endif
+
+    waiter = rb_funcall(rb_const_get(rb_define_module("NIO"), rb_intern("ProcessWaiter")), rb_intern("new"), 1, pid);
+    io = rb_funcall(waiter, rb_intern("reader"), 0);
+    monitor = rb_funcall(self, rb_intern("register"), 2, io, ID2SYM(rb_intern("r")));
+    rb_ivar_set(monitor, rb_intern("pid"), pid);
+    rb_ivar_set(monitor, rb_intern("process_waiter"), waiter);
+
+    return monitor;
+}
+
+/* The watched process's Process::Status once it has exited, which also
+   closes the monitor and its IO. nil while it's still running. Once the
+   monitor is closed, the status if it already has one, else IOError */
+static VALUE NIO_Monitor_reap(VALUE self)
+{
+    VALUE status, waiter, options;
+    struct NIO_Monitor *monitor;
+
+#ifdef NIO_HAVE_PIDFD
+    siginfo_t info;
+    int wstatus;
+    #if HAVE_RB_IO_T
+        rb_io_t *fptr;
+    #else
+        OpenFile *fptr;
+    #endif
+#endif
+
+    if(!RTEST(rb_ivar_defined(self, rb_intern("pid"))) || rb_ivar_get(self, rb_intern("pid")) == Qnil) {
+        rb_raise(rb_eArgError, "monitor isn't watching a process");
+    }
+
+    Data_Get_Struct(self, struct NIO_Monitor, monitor);
+    waiter = RTEST(rb_ivar_defined(self, rb_intern("process_waiter"))) ? rb_ivar_get(self, rb_intern("process_waiter")) : Qnil;
+
+    if(waiter != Qnil) {
+        /* The waiter keeps its status, and knows when it's been closed */
+        status = rb_funcall(waiter, rb_intern("reap"), 0);
+    } else if(!monitor->selector) {
+        status = RTEST(rb_ivar_defined(self, rb_intern("status"))) ? rb_ivar_get(self, rb_intern("status")) : Qnil;
+        if(status == Qnil) {
+            rb_raise(rb_eIOError, "monitor is closed");
+        }
+
+        return status;
+    } else {
+#ifdef NIO_HAVE_PIDFD
+        GetOpenFile(rb_convert_type(rb_ivar_get(self, rb_intern("io")), T_FILE, "IO", "to_io"), fptr);
+
+        memset(&info, 0, sizeof(info));
+        if(waitid((idtype_t)P_PIDFD, (id_t)FPTR_TO_FD(fptr), &info, WEXITED | WNOHANG) < 0) {
+            rb_sys_fail("waitid");
+        }
+
+        /* Still running */
+        if(!info.si_pid) {
+            return Qnil;
+        }
+
+        /* Put the status back together the way waitpid() reports it */
+        switch(info.si_code) {
+            case CLD_EXITED: wstatus = (info.si_status & 0xff) << 8; break;
+            case CLD_DUMPED: wstatus = info.si_status | 0x80; break;
+            default:         wstatus = info.si_status; break;
+        }
+
+        rb_last_status_set(wstatus, info.si_pid);
+        status = rb_last_status_get();
+        rb_ivar_set(self, rb_intern("status"), status);
+#else
+        status = Qnil;
+#endif
+    }
+
+    if(status != Qnil && monitor->selector) {
+        options = rb_hash_new();
+        rb_hash_aset(options, ID2SYM(rb_intern("close_io")), Qtrue);
+        rb_funcall(self, rb_intern("close"), 1, options);
+    }
+
+    return status;
+}
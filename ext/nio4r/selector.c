@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <string.h>
 
 static VALUE mNIO = Qnil;
 static VALUE cNIO_Monitor  = Qnil;
@@ -20,14 +21,29 @@ static void NIO_Selector_shutdown(struct NIO_Selector *selector);
 static void NIO_Selector_free(struct NIO_Selector *loop);
 
 /* Methods */
-static VALUE NIO_Selector_initialize(VALUE self);
-static VALUE NIO_Selector_register(VALUE self, VALUE selectable, VALUE interest);
+static VALUE NIO_Selector_initialize(int argc, VALUE *argv, VALUE self);
+static VALUE NIO_Selector_register(int argc, VALUE *argv, VALUE self);
 static VALUE NIO_Selector_deregister(VALUE self, VALUE io);
 static VALUE NIO_Selector_is_registered(VALUE self, VALUE io);
+static VALUE NIO_Selector_monitors(VALUE self);
 static VALUE NIO_Selector_select(int argc, VALUE *argv, VALUE self);
 static VALUE NIO_Selector_wakeup(VALUE self);
-static VALUE NIO_Selector_close(VALUE self);
+static VALUE NIO_Selector_close(int argc, VALUE *argv, VALUE self);
 static VALUE NIO_Selector_closed(VALUE self);
+static VALUE NIO_Selector_reset(VALUE self);
+static VALUE NIO_Selector_slow_client_policy(int argc, VALUE *argv, VALUE self);
+static VALUE NIO_Selector_stats(VALUE self);
+static VALUE NIO_Selector_set_accounting(VALUE self, VALUE enabled);
+static VALUE NIO_Selector_is_accounting(VALUE self);
+static VALUE NIO_Selector_top(int argc, VALUE *argv, VALUE self);
+static VALUE NIO_Selector_set_event_budget(VALUE self, VALUE budget);
+static VALUE NIO_Selector_event_budget(VALUE self);
+static VALUE NIO_Selector_group_stats(VALUE self);
+static VALUE NIO_Selector_receive_latency(VALUE self);
+static VALUE NIO_Selector_is_pipelined(VALUE self);
+static VALUE NIO_Selector_backend(VALUE self);
+static VALUE NIO_Selector_set_gc_when_idle(VALUE self, VALUE enabled);
+static VALUE NIO_Selector_is_gc_when_idle(VALUE self);
 
 /* Internal functions */
 static VALUE NIO_Selector_synchronize(VALUE self, VALUE (*func)(VALUE *args), VALUE *args);
@@ -35,16 +51,56 @@ static VALUE NIO_Selector_unlock(VALUE lock);
 static VALUE NIO_Selector_register_synchronized(VALUE *args);
 static VALUE NIO_Selector_deregister_synchronized(VALUE *args);
 static VALUE NIO_Selector_select_synchronized(VALUE *args);
+static VALUE NIO_Selector_reset_synchronized(VALUE *args);
+static VALUE NIO_Selector_migrate_locked(VALUE *args);
+static VALUE NIO_Selector_migrate_synchronized(VALUE *args);
+static int NIO_Selector_move(VALUE self, struct NIO_Selector *selector, VALUE monitor, VALUE other, struct NIO_Selector *target);
+static void NIO_Selector_purge(struct NIO_Selector *selector, struct NIO_Monitor *monitor);
+static void NIO_Selector_sample_load(struct NIO_Selector *selector, int ready);
+static void NIO_Selector_setup(struct NIO_Selector *selector);
+static VALUE NIO_Selector_release_monitors(VALUE self, struct NIO_Selector *selector, int close_ios);
 static int NIO_Selector_run(struct NIO_Selector *selector, VALUE timeout);
+static void NIO_Selector_dispatch_deferred(struct NIO_Selector *selector);
+static void NIO_Selector_dispatch(struct NIO_Selector *selector, VALUE monitor);
+static void NIO_Selector_yield(struct NIO_Selector *selector, VALUE monitor);
+static VALUE NIO_Selector_yield_block(VALUE monitor);
+static VALUE NIO_Selector_yield_timed(VALUE data);
+static double NIO_Selector_metric(struct NIO_Monitor *monitor, ID by);
+static struct NIO_Group *NIO_Selector_group(VALUE self, struct NIO_Selector *selector, VALUE key);
+static void NIO_Selector_release_groups(VALUE self, struct NIO_Selector *selector);
+static void NIO_Selector_enqueue(struct NIO_Selector *selector, struct NIO_Monitor *monitor);
+static int NIO_Selector_dispatch_groups(struct NIO_Selector *selector);
+static int NIO_Selector_drop_pending(struct NIO_Selector *selector);
+static int NIO_Selector_gc_due();
+static unsigned long NIO_Selector_polls(struct NIO_Selector *selector);
+static unsigned int NIO_Selector_backend_flag(VALUE name);
+static void NIO_Group_mark(struct NIO_Group *group);
+static void NIO_Group_free(struct NIO_Group *group);
 static void NIO_Selector_timeout_callback(struct ev_loop *ev_loop, struct ev_timer *timer, int revents);
 static void NIO_Selector_wakeup_callback(struct ev_loop *ev_loop, struct ev_io *io, int revents);
 
 /* Default number of slots in the buffer for selected monitors */
 #define INITIAL_READY_BUFFER 32
 
+/* Default number of events between send queue samples for slow clients */
+#define DEFAULT_SLOW_CLIENT_INTERVAL 64
+
 /* Ruby 1.8 needs us to busy wait and run the green threads scheduler every 10ms */
 #define BUSYWAIT_INTERVAL 0.01
 
+/* How close to its limits the heap gets before idle time goes to the GC */
+#define IDLE_GC_RATIO 0.9
+
+/* Collections NIO_Selector_gc_due can ask for */
+#define IDLE_GC_MINOR 1
+#define IDLE_GC_MAJOR 2
+
+/* Weight of each new sample in the lag moving average */
+#define LAG_SMOOTHING 0.1
+
+/* Shortest window the event rate is measured over, in seconds */
+#define EVENT_RATE_WINDOW 1.0
+
 /* Selectors wait for events */
 void Init_NIO_Selector()
 {
@@ -52,24 +108,92 @@ void Init_NIO_Selector()
     cNIO_Selector = rb_define_class_under(mNIO, "Selector", rb_cObject);
     rb_define_alloc_func(cNIO_Selector, NIO_Selector_allocate);
 
-    rb_define_method(cNIO_Selector, "initialize", NIO_Selector_initialize, 0);
-    rb_define_method(cNIO_Selector, "register", NIO_Selector_register, 2);
+    rb_define_method(cNIO_Selector, "initialize", NIO_Selector_initialize, -1);
+    rb_define_method(cNIO_Selector, "register", NIO_Selector_register, -1);
     rb_define_method(cNIO_Selector, "deregister", NIO_Selector_deregister, 1);
     rb_define_method(cNIO_Selector, "registered?", NIO_Selector_is_registered, 1);
+    rb_define_method(cNIO_Selector, "monitors", NIO_Selector_monitors, 0);
     rb_define_method(cNIO_Selector, "select", NIO_Selector_select, -1);
     rb_define_method(cNIO_Selector, "wakeup", NIO_Selector_wakeup, 0);
-    rb_define_method(cNIO_Selector, "close", NIO_Selector_close, 0);
+    rb_define_method(cNIO_Selector, "migrate", NIO_Selector_migrate, 2);
+    rb_define_method(cNIO_Selector, "close", NIO_Selector_close, -1);
     rb_define_method(cNIO_Selector, "closed?", NIO_Selector_closed, 0);
+    rb_define_method(cNIO_Selector, "reset", NIO_Selector_reset, 0);
+    rb_define_method(cNIO_Selector, "slow_client_policy", NIO_Selector_slow_client_policy, -1);
+    rb_define_method(cNIO_Selector, "stats", NIO_Selector_stats, 0);
+    rb_define_method(cNIO_Selector, "accounting=", NIO_Selector_set_accounting, 1);
+    rb_define_method(cNIO_Selector, "accounting?", NIO_Selector_is_accounting, 0);
+    rb_define_method(cNIO_Selector, "top", NIO_Selector_top, -1);
+    rb_define_method(cNIO_Selector, "event_budget=", NIO_Selector_set_event_budget, 1);
+    rb_define_method(cNIO_Selector, "event_budget", NIO_Selector_event_budget, 0);
+    rb_define_method(cNIO_Selector, "group_stats", NIO_Selector_group_stats, 0);
+    rb_define_method(cNIO_Selector, "receive_latency", NIO_Selector_receive_latency, 0);
+    rb_define_method(cNIO_Selector, "pipelined?", NIO_Selector_is_pipelined, 0);
+    rb_define_method(cNIO_Selector, "backend", NIO_Selector_backend, 0);
+    rb_define_method(cNIO_Selector, "gc_when_idle=", NIO_Selector_set_gc_when_idle, 1);
+    rb_define_method(cNIO_Selector, "gc_when_idle?", NIO_Selector_is_gc_when_idle, 0);
 
     cNIO_Monitor = rb_define_class_under(mNIO, "Monitor",  rb_cObject);
 }
 
-/* Create the libev event loop and incoming event buffer */
+/* Allocate a selector. The event loop and wakeup pipe aren't created until
+   the selector is actually used (see NIO_Selector_setup) so short-lived
+   selectors don't pay for system calls they never need */
 static VALUE NIO_Selector_allocate(VALUE klass)
 {
     struct NIO_Selector *selector;
+
+    selector = (struct NIO_Selector *)xmalloc(sizeof(struct NIO_Selector));
+    selector->ev_loop = 0;
+    ev_init(&selector->timer, NIO_Selector_timeout_callback);
+
+    selector->wakeup_reader = selector->wakeup_writer = -1;
+
+    selector->closed = selector->selecting = selector->ready_count = 0;
+    selector->monitor_woke = 0;
+    selector->slow_threshold = selector->slow_interval = selector->slow_action = 0;
+    selector->ready_array = selector->deferred_array = Qnil;
+    selector->monitors = 0;
+    selector->accounting = 0;
+    selector->free_monitors = 0;
+    selector->free_count = 0;
+    selector->pool_hits = selector->pool_misses = 0;
+    selector->event_budget = 0;
+    selector->default_group = selector->active_groups = selector->next_group = 0;
+    selector->groups = Qnil;
+    memset(selector->receive_latency, 0, sizeof(selector->receive_latency));
+    selector->pipelined = 0;
+    selector->pipeline = 0;
+    selector->backend = 0;
+    selector->gc_when_idle = 0;
+    selector->idle_gc_minor = selector->idle_gc_major = 0;
+    selector->polls = 0;
+    selector->dirty = 0;
+    selector->interest_changes = selector->interest_updates = 0;
+    selector->lag = selector->event_rate = 0;
+    selector->waited_at = selector->window_started_at = 0;
+    selector->window_events = 0;
+
+    return Data_Wrap_Struct(klass, NIO_Selector_mark, NIO_Selector_free, selector);
+}
+
+/* Create the libev event loop and wakeup pipe on first use */
+static void NIO_Selector_setup(struct NIO_Selector *selector)
+{
     int fds[2];
 
+    if(selector->closed) {
+        rb_raise(rb_eIOError, "selector is closed");
+    }
+
+    if(selector->ev_loop) {
+        return;
+    }
+
+    if(selector->pipelined && !selector->pipeline) {
+        selector->pipeline = NIO_Pipeline_new();
+    }
+
     /* Use a pipe to implement the wakeup mechanism. I know libev provides
        async watchers that implement this same behavior, but I'm getting
        segvs trying to use that between threads, despite claims of thread
@@ -81,38 +205,59 @@ static VALUE NIO_Selector_allocate(VALUE klass)
     }
 
     if(fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0) {
+        close(fds[0]);
+        close(fds[1]);
         rb_sys_fail("fcntl");
     }
 
-    selector = (struct NIO_Selector *)xmalloc(sizeof(struct NIO_Selector));
-    selector->ev_loop = ev_loop_new(0);
-    ev_init(&selector->timer, NIO_Selector_timeout_callback);
-
     selector->wakeup_reader = fds[0];
     selector->wakeup_writer = fds[1];
 
+    selector->ev_loop = ev_loop_new(selector->backend);
+    if(!selector->ev_loop) {
+        /* Leave nothing behind for the next attempt or shutdown to trip on */
+        close(selector->wakeup_reader);
+        close(selector->wakeup_writer);
+        selector->wakeup_reader = selector->wakeup_writer = -1;
+
+        rb_raise(rb_eIOError, "error initializing event loop");
+    }
+
     ev_io_init(&selector->wakeup, NIO_Selector_wakeup_callback, selector->wakeup_reader, EV_READ);
     selector->wakeup.data = (void *)selector;
     ev_io_start(selector->ev_loop, &selector->wakeup);
-
-    selector->closed = selector->selecting = selector->ready_count = 0;
-    selector->ready_array = Qnil;
-
-    return Data_Wrap_Struct(klass, NIO_Selector_mark, NIO_Selector_free, selector);
 }
 
 /* NIO selectors store all Ruby objects in instance variables so mark is a stub */
 static void NIO_Selector_mark(struct NIO_Selector *selector)
 {
+    struct NIO_Monitor *monitor;
+
     if(selector->ready_array != Qnil) {
         rb_gc_mark(selector->ready_array);
     }
+
+    if(selector->deferred_array != Qnil) {
+        rb_gc_mark(selector->deferred_array);
+    }
+
+    /* Nothing else references recycled monitors */
+    for(monitor = selector->free_monitors; monitor; monitor = monitor->next) {
+        rb_gc_mark(monitor->self);
+    }
 }
 
 /* Free a Selector's system resources.
    Called by both NIO::Selector#close and the finalizer below */
 static void NIO_Selector_shutdown(struct NIO_Selector *selector)
 {
+    selector->polls = NIO_Selector_polls(selector);
+
+    if(selector->pipeline) {
+        NIO_Pipeline_free(selector->pipeline);
+        selector->pipeline = 0;
+    }
+
     if(selector->ev_loop) {
         ev_loop_destroy(selector->ev_loop);
         selector->ev_loop = 0;
@@ -122,8 +267,11 @@ static void NIO_Selector_shutdown(struct NIO_Selector *selector)
         return;
     }
 
-    close(selector->wakeup_reader);
-    close(selector->wakeup_writer);
+    if(selector->wakeup_reader >= 0) {
+        close(selector->wakeup_reader);
+        close(selector->wakeup_writer);
+        selector->wakeup_reader = selector->wakeup_writer = -1;
+    }
 
     selector->closed = 1;
 }
@@ -136,14 +284,50 @@ static void NIO_Selector_free(struct NIO_Selector *selector)
 }
 
 /* Create a new selector. This is more or less the pure Ruby version
-   translated into an MRI cext */
-static VALUE NIO_Selector_initialize(VALUE self)
+   translated into an MRI cext. Passing :pipelined => true waits for events
+   on a native poller thread (see pipeline.c) */
+static VALUE NIO_Selector_initialize(int argc, VALUE *argv, VALUE self)
 {
-    VALUE lock;
+    VALUE lock, options, backend;
+    struct NIO_Selector *selector;
+
+    rb_scan_args(argc, argv, "01", &options);
+
+    if(options != Qnil) {
+        Check_Type(options, T_HASH);
+
+        if(RTEST(rb_hash_aref(options, ID2SYM(rb_intern("pipelined"))))) {
+            if(!NIO_Pipeline_available()) {
+                rb_raise(rb_eNotImpError, "pipelined selectors aren't supported on this platform");
+            }
+
+            Data_Get_Struct(self, struct NIO_Selector, selector);
+            selector->pipelined = 1;
+        }
+
+        /* :backend => :epoll, :kqueue, :port, :poll or :select */
+        backend = rb_hash_aref(options, ID2SYM(rb_intern("backend")));
+        if(backend != Qnil) {
+            Data_Get_Struct(self, struct NIO_Selector, selector);
+            selector->backend = NIO_Selector_backend_flag(backend);
+
+            if(!(ev_supported_backends() & selector->backend)) {
+                rb_raise(rb_eNotImpError, "the %s backend isn't supported on this platform", rb_id2name(SYM2ID(backend)));
+            }
+        }
+    }
 
     rb_ivar_set(self, rb_intern("selectables"), rb_hash_new());
 
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+    selector->groups = rb_hash_new();
+    rb_ivar_set(self, rb_intern("groups"), selector->groups);
+
+#ifdef HAVE_RB_MUTEX_NEW
+    lock = rb_mutex_new();
+#else
     lock = rb_class_new_instance(0, 0, rb_const_get(rb_cObject, rb_intern("Mutex")));
+#endif
     rb_ivar_set(self, rb_intern("lock"), lock);
 
     return Qnil;
@@ -181,10 +365,40 @@ static VALUE NIO_Selector_unlock(VALUE self)
     rb_funcall(lock, rb_intern("unlock"), 0, 0);
 }
 
-/* Register an IO object with the selector for the given interests */
-static VALUE NIO_Selector_register(VALUE self, VALUE io, VALUE interests)
+/* Register an IO object with the selector for the given interests.
+   Passing :reuse => true takes a recycled monitor if one is available.
+   :group and :weight put the monitor in a group sharing the event budget.
+   :edge_triggered, :oneshot and :exclusive are epoll engine only */
+static VALUE NIO_Selector_register(int argc, VALUE *argv, VALUE self)
 {
-    VALUE args[3] = {self, io, interests};
+    VALUE io, interests, options;
+    VALUE args[6];
+
+    rb_scan_args(argc, argv, "21", &io, &interests, &options);
+
+    args[0] = self;
+    args[1] = io;
+    args[2] = interests;
+    args[3] = Qfalse;
+    args[4] = args[5] = Qnil;
+
+    if(options != Qnil) {
+        Check_Type(options, T_HASH);
+        args[3] = rb_hash_aref(options, ID2SYM(rb_intern("reuse")));
+        args[4] = rb_hash_aref(options, ID2SYM(rb_intern("group")));
+        args[5] = rb_hash_aref(options, ID2SYM(rb_intern("weight")));
+
+        if(args[5] != Qnil && NUM2INT(args[5]) <= 0) {
+            rb_raise(rb_eArgError, "weight must be positive");
+        }
+
+        if(RTEST(rb_hash_aref(options, ID2SYM(rb_intern("edge_triggered")))) ||
+           RTEST(rb_hash_aref(options, ID2SYM(rb_intern("oneshot")))) ||
+           RTEST(rb_hash_aref(options, ID2SYM(rb_intern("exclusive"))))) {
+            rb_raise(rb_eNotImpError, "only the epoll engine registers edge-triggered, oneshot or exclusive monitors");
+        }
+    }
+
     return NIO_Selector_synchronize(self, NIO_Selector_register_synchronized, args);
 }
 
@@ -193,6 +407,9 @@ static VALUE NIO_Selector_register_synchronized(VALUE *args)
 {
     VALUE self, io, interests, selectables, monitor;
     VALUE monitor_args[3];
+    struct NIO_Selector *selector;
+    struct NIO_Monitor *recycled, *monitor_data;
+    struct NIO_Group *group;
 
     self = args[0];
     io = args[1];
@@ -204,12 +421,42 @@ static VALUE NIO_Selector_register_synchronized(VALUE *args)
     if(monitor != Qnil)
         rb_raise(rb_eArgError, "this IO is already registered with selector");
 
-    /* Create a new NIO::Monitor */
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+    NIO_Selector_setup(selector);
+
+    /* Create a new NIO::Monitor, or reinitialize a recycled one */
     monitor_args[0] = io;
     monitor_args[1] = interests;
     monitor_args[2] = self;
 
-    monitor = rb_class_new_instance(3, monitor_args, cNIO_Monitor);
+    if(RTEST(args[3]) && selector->free_monitors) {
+        recycled = selector->free_monitors;
+        selector->free_monitors = recycled->next;
+        selector->free_count--;
+        selector->pool_hits++;
+
+        recycled->next = 0;
+        monitor = recycled->self;
+        rb_obj_call_init(monitor, 3, monitor_args);
+    } else {
+        if(RTEST(args[3])) {
+            selector->pool_misses++;
+        }
+
+        monitor = rb_class_new_instance(3, monitor_args, cNIO_Monitor);
+    }
+
+    if(args[4] != Qnil || args[5] != Qnil) {
+        group = NIO_Selector_group(self, selector, args[4]);
+        if(args[5] != Qnil) {
+            group->weight = NUM2INT(args[5]);
+        }
+
+        Data_Get_Struct(monitor, struct NIO_Monitor, monitor_data);
+        monitor_data->group = group;
+        group->monitors++;
+    }
+
     rb_hash_aset(selectables, io, monitor);
 
     return monitor;
@@ -250,6 +497,15 @@ static VALUE NIO_Selector_is_registered(VALUE self, VALUE io)
     return rb_funcall(selectables, rb_intern("has_key?"), 1, io);
 }
 
+/* Monitors for all registered IO objects */
+static VALUE NIO_Selector_monitors(VALUE self)
+{
+    VALUE selectables = rb_ivar_get(self, rb_intern("selectables"));
+
+    /* Like registered?, this doesn't hold the mutex */
+    return rb_funcall(selectables, rb_intern("values"), 0, 0);
+}
+
 /* Select from all registered IO objects */
 static VALUE NIO_Selector_select(int argc, VALUE *argv, VALUE self)
 {
@@ -276,11 +532,27 @@ static VALUE NIO_Selector_select_synchronized(VALUE *args)
     struct NIO_Selector *selector;
 
     Data_Get_Struct(args[0], struct NIO_Selector, selector);
-    if(!rb_block_given_p()) {
-        selector->ready_array = rb_ary_new();
+    NIO_Selector_setup(selector);
+
+    /* In case a block raised before every group had its turn */
+    NIO_Selector_drop_pending(selector);
+
+    if(selector->waited_at) {
+        selector->lag += LAG_SMOOTHING * (ev_time() - selector->waited_at - selector->lag);
     }
 
     ready = NIO_Selector_run(selector, args[1]);
+    NIO_Selector_sample_load(selector, ready);
+
+    if(selector->active_groups) {
+        ready -= NIO_Selector_dispatch_groups(selector);
+    }
+
+    /* Monitors held back by the slow client policy go last */
+    if(selector->deferred_array != Qnil && RARRAY_LEN(selector->deferred_array) > 0) {
+        NIO_Selector_dispatch_deferred(selector);
+    }
+
     if(ready > 0) {
         if(rb_block_given_p()) {
             return INT2NUM(ready);
@@ -298,6 +570,15 @@ static VALUE NIO_Selector_select_synchronized(VALUE *args)
 static int NIO_Selector_run(struct NIO_Selector *selector, VALUE timeout)
 {
     int result;
+
+    NIO_Monitor_flush_interests(selector);
+
+    if(selector->pipeline) {
+        return NIO_Pipeline_run(selector, timeout);
+    }
+
+    /* Store when we started the loop so we can calculate the timeout */
+    ev_tstamp started_at = ev_now(selector->ev_loop);
     selector->selecting = 1;
 
 #if defined(HAVE_RB_THREAD_BLOCKING_REGION) || defined(HAVE_RB_THREAD_ALONE)
@@ -309,14 +590,31 @@ static int NIO_Selector_run(struct NIO_Selector *selector, VALUE timeout)
     } else {
         ev_timer_stop(selector->ev_loop, &selector->timer);
     }
-#else
-    /* Store when we started the loop so we can calculate the timeout */
-    ev_tstamp started_at = ev_now(selector->ev_loop);
 #endif
 
+    /* Before giving idle time to the GC, find out without blocking whether
+       anything is ready, which means we aren't idle after all */
+    if(selector->gc_when_idle && (timeout == Qnil || NUM2DBL(timeout) > 0) && NIO_Selector_gc_due()) {
+        ev_loop(selector->ev_loop, EVLOOP_NONBLOCK);
+
+        if(selector->ready_count || !selector->selecting) {
+            goto done;
+        }
+
+        NIO_Selector_idle_gc(selector);
+    }
+
 #if defined(HAVE_RB_THREAD_BLOCKING_REGION)
-    /* libev is patched to release the GIL when it makes its system call */
-    ev_loop(selector->ev_loop, EVLOOP_ONESHOT);
+    /* libev is patched to release the GIL when it makes its system call.
+       Go around again if no monitor woke us: that was a paused monitor's
+       timer (a rate limited or throttled monitor resuming, or a min_readable
+       poll), or libev waking just before one was due. Any monitor event ends
+       the select, reported or not, so a dropped event can't spin */
+    do {
+        selector->monitor_woke = 0;
+        ev_loop(selector->ev_loop, EVLOOP_ONESHOT);
+    } while(!selector->monitor_woke && selector->selecting && !selector->ready_count &&
+            (timeout == Qnil || ev_now(selector->ev_loop) - started_at < NUM2DBL(timeout)));
 #elif defined(HAVE_RB_THREAD_ALONE)
     /* If we're the only thread we can make a blocking system call */
     if(rb_thread_alone()) {
@@ -353,79 +651,1188 @@ static int NIO_Selector_run(struct NIO_Selector *selector, VALUE timeout)
     }
 #endif /* defined(HAVE_RB_THREAD_BLOCKING_REGION) */
 
+done:
     result = selector->ready_count;
     selector->selecting = selector->ready_count = 0;
 
     return result;
 }
 
-/* Wake the selector up from another thread */
-static VALUE NIO_Selector_wakeup(VALUE self)
+/* Select's wait just ended with ready events. Lag runs from here until
+   the next select, and the events count towards the current window */
+static void NIO_Selector_sample_load(struct NIO_Selector *selector, int ready)
 {
-    struct NIO_Selector *selector;
-    Data_Get_Struct(self, struct NIO_Selector, selector);
+    ev_tstamp now = ev_time();
 
-    if(selector->closed) {
-        rb_raise(rb_eIOError, "selector is closed");
+    selector->waited_at = now;
+    selector->window_events += ready;
+
+    if(!selector->window_started_at) {
+        selector->window_started_at = now;
+    } else if(now - selector->window_started_at >= EVENT_RATE_WINDOW) {
+        selector->event_rate = selector->window_events / (now - selector->window_started_at);
+        selector->window_events = 0;
+        selector->window_started_at = now;
     }
+}
 
-    write(selector->wakeup_writer, "\0", 1);
+/* Hand monitors deferred during the last run to the caller */
+static void NIO_Selector_dispatch_deferred(struct NIO_Selector *selector)
+{
+    VALUE monitor;
+
+    /* Shift rather than iterate, so nothing is dispatched twice if a block raises */
+    while((monitor = rb_ary_shift(selector->deferred_array)) != Qnil) {
+        if(selector->slow_action == NIO_SLOW_CLIENT_TIMEOUT) {
+            rb_funcall(monitor, rb_intern("close"), 0, 0);
+        }
+
+        NIO_Selector_dispatch(selector, monitor);
+    }
+}
+
+/* Hand a ready monitor to the caller: yield it to the block passed to
+   select, or add it to the array select returns */
+static void NIO_Selector_dispatch(struct NIO_Selector *selector, VALUE monitor)
+{
+    struct NIO_Monitor *monitor_data;
+    Data_Get_Struct(monitor, struct NIO_Monitor, monitor_data);
+
+    /* Where receive latency measurements end */
+    if(monitor_data->receive_timestamps) {
+        monitor_data->dispatched_at = ev_time();
+    }
+
+    if(rb_block_given_p()) {
+        NIO_Selector_yield(selector, monitor);
+    } else {
+        /* Made on demand, so selects that find nothing don't allocate */
+        if(selector->ready_array == Qnil) {
+            selector->ready_array = rb_ary_new();
+        }
+        rb_ary_push(selector->ready_array, monitor);
+    }
+}
+
+/* A handler being timed by NIO_Selector_yield */
+struct NIO_Selector_timing
+{
+    struct NIO_Monitor *monitor;
+    ev_tstamp started_at;
+};
+
+/* Hand a ready monitor to the block passed to select, timing the handler
+   if accounting is on. Handlers that raise or break still get timed */
+static void NIO_Selector_yield(struct NIO_Selector *selector, VALUE monitor)
+{
+    struct NIO_Selector_timing timing;
+
+    if(!selector->accounting) {
+        rb_yield(monitor);
+        return;
+    }
+
+    Data_Get_Struct(monitor, struct NIO_Monitor, timing.monitor);
+
+    timing.started_at = ev_time();
+    rb_ensure(NIO_Selector_yield_block, monitor, NIO_Selector_yield_timed, (VALUE)&timing);
+}
+
+static VALUE NIO_Selector_yield_block(VALUE monitor)
+{
+    return rb_yield(monitor);
+}
+
+static VALUE NIO_Selector_yield_timed(VALUE data)
+{
+    struct NIO_Selector_timing *timing = (struct NIO_Selector_timing *)data;
+
+    timing->monitor->accounting.handler_time += ev_time() - timing->started_at;
     return Qnil;
 }
 
-/* Close the selector and free system resources */
-static VALUE NIO_Selector_close(VALUE self)
+/* Wake the selector up from another thread */
+static VALUE NIO_Selector_wakeup(VALUE self)
 {
     struct NIO_Selector *selector;
     Data_Get_Struct(self, struct NIO_Selector, selector);
 
-    NIO_Selector_shutdown(selector);
+    /* Nothing else runs while we hold the GVL, so creating the pipe here
+       can't race a selecting thread. The byte we write makes the next
+       select return immediately */
+    NIO_Selector_setup(selector);
 
+    write(selector->wakeup_writer, "\0", 1);
     return Qnil;
 }
 
-/* Is the selector closed? */
-static VALUE NIO_Selector_closed(VALUE self)
+/* Move monitors to another selector without closing them, so they keep
+   their identity, value, accounting and rate limits. Both selectors are
+   locked once for the lot, lowest address first so two selectors trading
+   monitors can't deadlock. Monitors closed or moved elsewhere in the
+   meantime are skipped. Returns the monitors that moved */
+VALUE NIO_Selector_migrate(VALUE self, VALUE monitors, VALUE other)
 {
-    struct NIO_Selector *selector;
-    Data_Get_Struct(self, struct NIO_Selector, selector);
+    VALUE args[4];
 
-    return selector->closed ? Qtrue : Qfalse;
+    if(!rb_obj_is_kind_of(other, cNIO_Selector)) {
+        rb_raise(rb_eTypeError, "can't migrate a monitor to %s",
+            RSTRING_PTR(rb_funcall(other, rb_intern("inspect"), 0, 0)));
+    }
+
+    monitors = rb_convert_type(monitors, T_ARRAY, "Array", "to_ary");
+
+    if(other == self) {
+        return rb_ary_new();
+    }
+
+    args[0] = self;
+    args[1] = monitors;
+    args[2] = other;
+    args[3] = self < other ? other : self;
+
+    return NIO_Selector_synchronize(self < other ? self : other, NIO_Selector_migrate_locked, args);
 }
 
-/* Called whenever a timeout fires on the event loop */
-static void NIO_Selector_timeout_callback(struct ev_loop *ev_loop, struct ev_timer *timer, int revents)
+/* Take the second selector's lock too */
+static VALUE NIO_Selector_migrate_locked(VALUE *args)
 {
-    /* We don't actually need to do anything here, the mere firing of the
-       timer is sufficient to interrupt the selector. However, libev still wants a callback */
+    return NIO_Selector_synchronize(args[3], NIO_Selector_migrate_synchronized, args);
 }
 
-/* Called whenever a wakeup request is sent to a selector */
-static void NIO_Selector_wakeup_callback(struct ev_loop *ev_loop, struct ev_io *io, int revents)
+/* Internal implementation of migrate with both selector locks held */
+static VALUE NIO_Selector_migrate_synchronized(VALUE *args)
 {
-    char buffer[128];
-    struct NIO_Selector *selector = (struct NIO_Selector *)io->data;
-    selector->selecting = 0;
+    VALUE monitor, moved = rb_ary_new();
+    struct NIO_Selector *selector, *target;
+    long i;
 
-    /* Drain the wakeup pipe, giving us level-triggered behavior */
-    while(read(selector->wakeup_reader, buffer, 128) > 0);
+    Data_Get_Struct(args[0], struct NIO_Selector, selector);
+    Data_Get_Struct(args[2], struct NIO_Selector, target);
+    NIO_Selector_setup(target);
+
+    for(i = 0; i < RARRAY_LEN(args[1]); i++) {
+        monitor = rb_ary_entry(args[1], i);
+
+        if(NIO_Selector_move(args[0], selector, monitor, args[2], target)) {
+            rb_ary_push(moved, monitor);
+        }
+    }
+
+    return moved;
 }
 
-/* libev callback fired whenever a monitor gets an event */
-void NIO_Selector_monitor_callback(struct ev_loop *ev_loop, struct ev_io *io, int revents)
+/* Move one monitor across. Returns false if it was closed or moved
+   elsewhere while we waited for the locks */
+static int NIO_Selector_move(VALUE self, struct NIO_Selector *selector, VALUE monitor, VALUE other, struct NIO_Selector *target)
 {
-    struct NIO_Monitor *monitor_data = (struct NIO_Monitor *)io->data;
-    struct NIO_Selector *selector = monitor_data->selector;
-    VALUE monitor = monitor_data->self;
+    VALUE io, selectables, group_key = Qnil;
+    struct NIO_Monitor *monitor_data;
+    struct NIO_Group *group;
+    ev_tstamp rate_remaining = -1, min_readable_remaining = -1;
+    int group_weight = 0;
+
+    if(!rb_obj_is_kind_of(monitor, cNIO_Monitor)) {
+        rb_raise(rb_eTypeError, "can't migrate %s",
+            RSTRING_PTR(rb_funcall(monitor, rb_intern("inspect"), 0, 0)));
+    }
 
-    assert(selector != 0);
-    selector->ready_count++;
-    monitor_data->revents = revents;
+    Data_Get_Struct(monitor, struct NIO_Monitor, monitor_data);
 
-    if(rb_block_given_p()) {
-        rb_yield(monitor);
+    if(monitor_data->selector != selector) {
+        return 0;
+    }
+
+    io = rb_ivar_get(monitor, rb_intern("io"));
+    selectables = rb_ivar_get(other, rb_intern("selectables"));
+
+    if(rb_hash_lookup(selectables, io) != Qnil) {
+        rb_raise(rb_eArgError, "this IO is already registered with selector");
+    }
+
+    /* Pipelined selectors can't pause reads */
+    if(target->pipelined && (monitor_data->rate > 0 ||
+       (monitor_data->min_readable_emulated > 0 && monitor_data->min_readable > 1))) {
+        rb_raise(rb_eNotImpError, "rate limited monitors can't migrate to pipelined selectors");
+    }
+
+    /* Nothing here may dispatch it once it's gone */
+    NIO_Selector_purge(selector, monitor_data);
+
+    /* Take it off this selector's loop, remembering when its timers were
+       due to fire */
+    if(selector->pipeline) {
+        NIO_Pipeline_remove(selector->pipeline, monitor_data);
     } else {
-        assert(selector->ready_array != Qnil);
-        rb_ary_push(selector->ready_array, monitor);
+        ev_io_stop(selector->ev_loop, &monitor_data->ev_io);
+    }
+
+    /* Interest changes still waiting for a select go along with it */
+    if(monitor_data->dirty) {
+        NIO_Monitor_undirty(monitor_data);
+        ev_io_set(&monitor_data->ev_io, monitor_data->ev_io.fd, NIO_Monitor_watched_events(monitor_data));
+    }
+
+    if(ev_is_active(&monitor_data->rate_timer)) {
+        rate_remaining = ev_timer_remaining(selector->ev_loop, &monitor_data->rate_timer);
+        ev_timer_stop(selector->ev_loop, &monitor_data->rate_timer);
+    }
+
+    if(ev_is_active(&monitor_data->min_readable_timer)) {
+        min_readable_remaining = ev_timer_remaining(selector->ev_loop, &monitor_data->min_readable_timer);
+        ev_timer_stop(selector->ev_loop, &monitor_data->min_readable_timer);
+    }
+
+    if(monitor_data->group) {
+        group_key = monitor_data->group->key;
+        group_weight = monitor_data->group->weight;
+        NIO_Monitor_leave_group(monitor_data);
+    }
+
+    if(monitor_data->prev) {
+        monitor_data->prev->next = monitor_data->next;
+    } else {
+        selector->monitors = monitor_data->next;
+    }
+    if(monitor_data->next) {
+        monitor_data->next->prev = monitor_data->prev;
+    }
+
+    rb_hash_delete(rb_ivar_get(self, rb_intern("selectables")), io);
+
+    /* And put it on the other one */
+    monitor_data->selector = target;
+    rb_ivar_set(monitor, rb_intern("selector"), other);
+
+    monitor_data->prev = 0;
+    monitor_data->next = target->monitors;
+    if(target->monitors) {
+        target->monitors->prev = monitor_data;
+    }
+    target->monitors = monitor_data;
+
+    rb_hash_aset(selectables, io, monitor);
+
+    /* A group the other selector doesn't have yet keeps its weight */
+    if(group_weight) {
+        group = NIO_Selector_group(other, target, group_key);
+        if(!group->monitors) {
+            group->weight = group_weight;
+        }
+
+        group->monitors++;
+        monitor_data->group = group;
+    }
+
+    if(target->pipeline) {
+        NIO_Pipeline_add(target->pipeline, monitor_data);
+    } else if(monitor_data->ev_io.events & (EV_READ | EV_WRITE)) {
+        /* Reads stay paused if they were */
+        ev_io_start(target->ev_loop, &monitor_data->ev_io);
+    }
+
+    if(rate_remaining >= 0) {
+        ev_timer_set(&monitor_data->rate_timer, rate_remaining, 0.);
+        ev_timer_start(target->ev_loop, &monitor_data->rate_timer);
+    }
+
+    if(min_readable_remaining >= 0) {
+        ev_timer_set(&monitor_data->min_readable_timer, min_readable_remaining, 0.);
+        ev_timer_start(target->ev_loop, &monitor_data->min_readable_timer);
+    }
+
+    return 1;
+}
+
+/* Drop a departing monitor from everything this selector has queued for
+   dispatch: the ready and deferred arrays and its group's pending list */
+static void NIO_Selector_purge(struct NIO_Selector *selector, struct NIO_Monitor *monitor)
+{
+    struct NIO_Group *group = monitor->group ? monitor->group : selector->default_group;
+
+    if(selector->ready_array != Qnil) {
+        rb_ary_delete(selector->ready_array, monitor->self);
+    }
+
+    if(selector->deferred_array != Qnil) {
+        rb_ary_delete(selector->deferred_array, monitor->self);
+    }
+
+    if(group && group->active) {
+        rb_ary_delete(group->pending, monitor->self);
     }
 }
+
+/* Deregister everything so the selector can be reused. Unlike close, this
+   keeps the event loop and wakeup pipe around */
+static VALUE NIO_Selector_reset(VALUE self)
+{
+    VALUE args[1] = {self};
+    return NIO_Selector_synchronize(self, NIO_Selector_reset_synchronized, args);
+}
+
+/* Internal implementation of reset after acquiring mutex */
+static VALUE NIO_Selector_reset_synchronized(VALUE *args)
+{
+    VALUE self, selectables, monitors;
+    struct NIO_Selector *selector;
+    char buffer[128];
+    long i;
+
+    self = args[0];
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    if(selector->closed) {
+        rb_raise(rb_eIOError, "selector is closed");
+    }
+
+    selectables = rb_ivar_get(self, rb_intern("selectables"));
+    monitors = rb_funcall(selectables, rb_intern("values"), 0, 0);
+    rb_funcall(selectables, rb_intern("clear"), 0, 0);
+
+    for(i = 0; i < RARRAY_LEN(monitors); i++) {
+        rb_funcall(RARRAY_PTR(monitors)[i], rb_intern("close"), 1, Qfalse);
+    }
+
+    /* Swallow any wakeups nobody selected for */
+    if(selector->wakeup_reader >= 0) {
+        while(read(selector->wakeup_reader, buffer, sizeof(buffer)) > 0);
+    }
+
+    selector->slow_threshold = 0;
+    selector->slow_action = 0;
+    if(selector->deferred_array != Qnil) {
+        rb_ary_clear(selector->deferred_array);
+    }
+
+    selector->event_budget = 0;
+    NIO_Selector_release_groups(self, selector);
+    memset(selector->receive_latency, 0, sizeof(selector->receive_latency));
+
+    return self;
+}
+
+/* Close the selector and free system resources. If close_ios is true, the
+   registered IO objects are closed too */
+static VALUE NIO_Selector_close(int argc, VALUE *argv, VALUE self)
+{
+    VALUE close_ios, ios;
+    struct NIO_Selector *selector;
+    long i;
+
+    rb_scan_args(argc, argv, "01", &close_ios);
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    if(selector->closed) {
+        return Qnil;
+    }
+
+    ios = NIO_Selector_release_monitors(self, selector, RTEST(close_ios));
+    NIO_Selector_shutdown(selector);
+
+    if(ios != Qnil) {
+        for(i = 0; i < RARRAY_LEN(ios); i++) {
+            if(!RTEST(rb_funcall(RARRAY_PTR(ios)[i], rb_intern("closed?"), 0, 0))) {
+                rb_funcall(RARRAY_PTR(ios)[i], rb_intern("close"), 0, 0);
+            }
+        }
+    }
+
+    return Qnil;
+}
+
+/* Invalidate every registered monitor in a single pass over the registration
+   table. The event loop is about to be destroyed along with all its watchers,
+   so there's no need to stop them one at a time. Returns the IO objects to
+   close once it's gone: the monitors' IOs if close_ios is set, and the
+   pidfds of watched processes either way */
+static VALUE NIO_Selector_release_monitors(VALUE self, struct NIO_Selector *selector, int close_ios)
+{
+    struct NIO_Monitor *monitor, *next;
+    VALUE ios = close_ios ? rb_ary_new() : Qnil, pid, waiter;
+    ID selector_id = rb_intern("selector"), io_id = rb_intern("io");
+    ID pid_id = rb_intern("pid"), waiter_id = rb_intern("process_waiter");
+
+    for(monitor = selector->monitors; monitor; monitor = next) {
+        next = monitor->next;
+
+        NIO_Monitor_reset_min_readable(monitor);
+        monitor->selector = 0;
+        monitor->group = 0;
+        monitor->prev = monitor->next = 0;
+        monitor->dirty = 0;
+        monitor->prev_dirty = monitor->next_dirty = 0;
+        rb_ivar_set(monitor->self, selector_id, Qnil);
+
+        if(close_ios) {
+            rb_ary_push(ios, rb_ivar_get(monitor->self, io_id));
+        }
+
+        /* Watched processes own their IO, and a waiter's thread mustn't
+           outlive the monitor (see NIO_Monitor_close) */
+        pid = RTEST(rb_ivar_defined(monitor->self, pid_id)) ? rb_ivar_get(monitor->self, pid_id) : Qnil;
+        if(pid != Qnil) {
+            waiter = rb_ivar_get(monitor->self, waiter_id);
+            if(waiter != Qnil) {
+                rb_funcall(waiter, rb_intern("close"), 0);
+            } else if(!close_ios) {
+                if(ios == Qnil) {
+                    ios = rb_ary_new();
+                }
+                rb_ary_push(ios, rb_ivar_get(monitor->self, io_id));
+            }
+        }
+    }
+
+    selector->monitors = 0;
+    selector->dirty = 0;
+    selector->free_monitors = 0;
+    selector->free_count = 0;
+    rb_funcall(rb_ivar_get(self, rb_intern("selectables")), rb_intern("clear"), 0, 0);
+    NIO_Selector_release_groups(self, selector);
+
+    return ios;
+}
+
+/* Forget every group. Their monitors must already have left them */
+static void NIO_Selector_release_groups(VALUE self, struct NIO_Selector *selector)
+{
+    selector->default_group = selector->active_groups = selector->next_group = 0;
+    rb_funcall(rb_ivar_get(self, rb_intern("groups")), rb_intern("clear"), 0, 0);
+}
+
+/* Is the selector closed? */
+static VALUE NIO_Selector_closed(VALUE self)
+{
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    return selector->closed ? Qtrue : Qfalse;
+}
+
+/* Configure what happens to clients whose kernel send queue stays above
+   threshold bytes. Send queues are sampled once every interval events
+   per monitor. Passing nil as the threshold disables the policy */
+static VALUE NIO_Selector_slow_client_policy(int argc, VALUE *argv, VALUE self)
+{
+    VALUE threshold, action, interval;
+    ID action_id;
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    rb_scan_args(argc, argv, "12", &threshold, &action, &interval);
+
+    if(threshold == Qnil) {
+        selector->slow_threshold = 0;
+        return Qnil;
+    }
+
+    if(NUM2INT(threshold) <= 0) {
+        rb_raise(rb_eArgError, "threshold must be positive");
+    }
+
+    action_id = action == Qnil ? rb_intern("demote") : SYM2ID(action);
+
+    if(action_id == rb_intern("demote")) {
+        selector->slow_action = NIO_SLOW_CLIENT_DEMOTE;
+    } else if(action_id == rb_intern("throttle")) {
+        /* Pausing reads needs timers, which pipelined selectors don't run */
+        if(selector->pipelined) {
+            rb_raise(rb_eNotImpError, "the :throttle action isn't supported on pipelined selectors");
+        }
+        selector->slow_action = NIO_SLOW_CLIENT_THROTTLE;
+    } else if(action_id == rb_intern("timeout")) {
+        selector->slow_action = NIO_SLOW_CLIENT_TIMEOUT;
+    } else {
+        rb_raise(rb_eArgError, "invalid slow client action %s (must be :demote, :throttle, or :timeout)",
+            RSTRING_PTR(rb_funcall(action, rb_intern("inspect"), 0, 0)));
+    }
+
+    selector->slow_interval = interval == Qnil ? DEFAULT_SLOW_CLIENT_INTERVAL : NUM2INT(interval);
+    if(selector->slow_interval <= 0) {
+        rb_raise(rb_eArgError, "sample interval must be positive");
+    }
+
+    if(selector->deferred_array == Qnil) {
+        selector->deferred_array = rb_ary_new();
+    }
+
+    selector->slow_threshold = NUM2INT(threshold);
+    return Qnil;
+}
+
+/* Called whenever a timeout fires on the event loop */
+static void NIO_Selector_timeout_callback(struct ev_loop *ev_loop, struct ev_timer *timer, int revents)
+{
+    /* We don't actually need to do anything here, the mere firing of the
+       timer is sufficient to interrupt the selector. However, libev still wants a callback */
+}
+
+/* Called whenever a wakeup request is sent to a selector */
+static void NIO_Selector_wakeup_callback(struct ev_loop *ev_loop, struct ev_io *io, int revents)
+{
+    char buffer[128];
+    struct NIO_Selector *selector = (struct NIO_Selector *)io->data;
+    selector->selecting = 0;
+
+    /* Drain the wakeup pipe, giving us level-triggered behavior */
+    while(read(selector->wakeup_reader, buffer, 128) > 0);
+}
+
+/* libev callback fired whenever a monitor gets an event */
+void NIO_Selector_monitor_callback(struct ev_loop *ev_loop, struct ev_io *io, int revents)
+{
+    ((struct NIO_Monitor *)io->data)->selector->monitor_woke = 1;
+    NIO_Selector_handle_event((struct NIO_Monitor *)io->data, revents);
+}
+
+/* A monitor got an event, either from libev or the pipelined poller */
+void NIO_Selector_handle_event(struct NIO_Monitor *monitor_data, int revents)
+{
+    struct NIO_Selector *selector = monitor_data->selector;
+    VALUE monitor = monitor_data->self;
+
+    assert(selector != 0);
+
+    /* Not enough bytes have arrived to count as readable yet */
+    if((revents & EV_READ) && NIO_Monitor_short_read(monitor_data)) {
+        revents &= ~EV_READ;
+        if(!revents) {
+            return;
+        }
+    }
+
+    monitor_data->revents = revents;
+
+    if(selector->accounting) {
+        monitor_data->accounting.events++;
+        monitor_data->accounting.last_activity = ev_now(selector->ev_loop);
+    }
+
+    if(selector->slow_threshold) {
+        int sampled = 0, queued;
+
+        /* Amortize the getsockopt() across several events */
+        if(--monitor_data->sample_countdown <= 0) {
+            monitor_data->sample_countdown = selector->slow_interval;
+            sampled = 1;
+
+            queued = NIO_Monitor_send_queue(monitor_data);
+            if(queued > selector->slow_threshold) {
+                monitor_data->slow_samples++;
+            } else {
+                monitor_data->slow_samples = 0;
+            }
+        }
+
+        if(monitor_data->slow_samples >= NIO_SLOW_CLIENT_SAMPLES) {
+            if(selector->slow_action == NIO_SLOW_CLIENT_THROTTLE) {
+                /* Throttled clients only get the reads they're sampled on.
+                   Pause the others' watchers rather than dropping the event,
+                   which a level-triggered fd would just report again */
+                if(!sampled && (revents & EV_READ)) {
+                    if(!monitor_data->throttled) {
+                        NIO_Monitor_pause_reads(monitor_data, NIO_SLOW_CLIENT_PAUSE);
+                    }
+
+                    revents &= ~EV_READ;
+                    if(!revents) {
+                        return;
+                    }
+
+                    monitor_data->revents = revents;
+                }
+            } else {
+                /* Demoted and timed out clients go after everyone else */
+                selector->ready_count++;
+                rb_ary_push(selector->deferred_array, monitor);
+                return;
+            }
+        }
+    }
+
+    selector->ready_count++;
+
+    /* With an event budget, monitors wait for their group's turn */
+    if(selector->event_budget) {
+        NIO_Selector_enqueue(selector, monitor_data);
+        return;
+    }
+
+    if(monitor_data->group) {
+        monitor_data->group->events++;
+    }
+
+    NIO_Selector_dispatch(selector, monitor);
+}
+
+/* Find or create the group with the given key. Ungrouped monitors share
+   the group whose key is nil */
+static struct NIO_Group *NIO_Selector_group(VALUE self, struct NIO_Selector *selector, VALUE key)
+{
+    VALUE groups, group_obj;
+    struct NIO_Group *group;
+
+    if(key == Qnil && selector->default_group) {
+        return selector->default_group;
+    }
+
+    groups = rb_ivar_get(self, rb_intern("groups"));
+    group_obj = rb_hash_lookup(groups, key);
+
+    if(group_obj != Qnil) {
+        Data_Get_Struct(group_obj, struct NIO_Group, group);
+        return group;
+    }
+
+    group = (struct NIO_Group *)xmalloc(sizeof(struct NIO_Group));
+    group->key = key;
+    group->weight = 1;
+    group->active = 0;
+    group->deficit = 0;
+    group->monitors = group->events = 0;
+    group->pending = rb_ary_new();
+    group->next_active = 0;
+
+    /* The groups hash keeps these alive. They're never exposed to Ruby */
+    group_obj = Data_Wrap_Struct(rb_cObject, NIO_Group_mark, NIO_Group_free, group);
+    rb_hash_aset(groups, key, group_obj);
+
+    if(key == Qnil) {
+        selector->default_group = group;
+    }
+
+    return group;
+}
+
+void NIO_Selector_release_group(struct NIO_Selector *selector, struct NIO_Group *group)
+{
+    /* Ungrouped monitors always share the default group */
+    if(group->monitors || group->active || group == selector->default_group) {
+        return;
+    }
+
+    if(selector->next_group == group) {
+        selector->next_group = 0;
+    }
+
+    /* Dropping it from the hash leaves it to the GC */
+    rb_hash_delete(selector->groups, group->key);
+}
+
+static void NIO_Group_mark(struct NIO_Group *group)
+{
+    rb_gc_mark(group->key);
+    rb_gc_mark(group->pending);
+}
+
+static void NIO_Group_free(struct NIO_Group *group)
+{
+    xfree(group);
+}
+
+/* Queue a ready monitor until its group gets a turn */
+static void NIO_Selector_enqueue(struct NIO_Selector *selector, struct NIO_Monitor *monitor)
+{
+    struct NIO_Group *group = monitor->group ? monitor->group : selector->default_group;
+
+    rb_ary_push(group->pending, monitor->self);
+
+    if(!group->active) {
+        group->active = 1;
+        group->next_active = selector->active_groups;
+        selector->active_groups = group;
+    }
+}
+
+/* Deficit round robin: each round, every group with monitors waiting earns
+   its weight in events and spends it dispatching them, until the budget
+   runs out. Groups cut short keep their credit for the next select.
+   Returns how many monitors didn't get a turn */
+static int NIO_Selector_dispatch_groups(struct NIO_Selector *selector)
+{
+    struct NIO_Group *group, **link;
+    struct NIO_Monitor *monitor_data;
+    VALUE monitor;
+    int budget = selector->event_budget;
+
+    /* Pick up the round where the last select left off */
+    if(selector->next_group && selector->next_group->active) {
+        for(link = &selector->active_groups; *link != selector->next_group; link = &(*link)->next_active);
+
+        *link = 0;
+        for(group = selector->next_group; group->next_active; group = group->next_active);
+        group->next_active = selector->active_groups;
+        selector->active_groups = selector->next_group;
+    }
+    selector->next_group = 0;
+
+    while(selector->active_groups && budget > 0) {
+        link = &selector->active_groups;
+
+        while((group = *link) && budget > 0) {
+            group->deficit += group->weight;
+
+            while(group->deficit > 0 && budget > 0 && (monitor = rb_ary_shift(group->pending)) != Qnil) {
+                Data_Get_Struct(monitor, struct NIO_Monitor, monitor_data);
+
+                /* An earlier handler may have closed it */
+                if(monitor_data->selector != selector) {
+                    continue;
+                }
+
+                group->deficit--;
+                group->events++;
+                budget--;
+
+                NIO_Selector_dispatch(selector, monitor);
+            }
+
+            if(RARRAY_LEN(group->pending) == 0) {
+                /* Idle groups don't get to bank credit */
+                group->deficit = 0;
+                group->active = 0;
+                *link = group->next_active;
+
+                /* Its last monitors may have left while they waited */
+                NIO_Selector_release_group(selector, group);
+            } else {
+                link = &group->next_active;
+            }
+        }
+
+        /* Groups that missed out on this round go first next select */
+        selector->next_group = group;
+    }
+
+    return NIO_Selector_drop_pending(selector);
+}
+
+/* Forget monitors that are still waiting for their group's turn. They're
+   still ready, so the next select picks them up again. Returns how many
+   there were */
+static int NIO_Selector_drop_pending(struct NIO_Selector *selector)
+{
+    struct NIO_Group *group, *next;
+    int dropped = 0;
+
+    for(group = selector->active_groups; group; group = next) {
+        next = group->next_active;
+        dropped += (int)RARRAY_LEN(group->pending);
+        rb_ary_clear(group->pending);
+        group->active = 0;
+        NIO_Selector_release_group(selector, group);
+    }
+
+    selector->active_groups = 0;
+    return dropped;
+}
+
+/* Counters describing what the selector has been up to */
+static VALUE NIO_Selector_stats(VALUE self)
+{
+    VALUE stats;
+    unsigned long requests;
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    requests = selector->pool_hits + selector->pool_misses;
+
+    stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("monitor_pool_size")), INT2NUM(selector->free_count));
+    rb_hash_aset(stats, ID2SYM(rb_intern("monitor_pool_hits")), ULONG2NUM(selector->pool_hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("monitor_pool_misses")), ULONG2NUM(selector->pool_misses));
+    rb_hash_aset(stats, ID2SYM(rb_intern("monitor_pool_hit_ratio")),
+        rb_float_new(requests ? (double)selector->pool_hits / requests : 0.0));
+    rb_hash_aset(stats, ID2SYM(rb_intern("idle_gc_minor")), ULONG2NUM(selector->idle_gc_minor));
+    rb_hash_aset(stats, ID2SYM(rb_intern("idle_gc_major")), ULONG2NUM(selector->idle_gc_major));
+    rb_hash_aset(stats, ID2SYM(rb_intern("lag")), rb_float_new(selector->lag));
+    rb_hash_aset(stats, ID2SYM(rb_intern("event_rate")), rb_float_new(selector->event_rate));
+    rb_hash_aset(stats, ID2SYM(rb_intern("polls")), ULONG2NUM(NIO_Selector_polls(selector)));
+    rb_hash_aset(stats, ID2SYM(rb_intern("interest_changes")), ULONG2NUM(selector->interest_changes));
+    rb_hash_aset(stats, ID2SYM(rb_intern("interest_updates")), ULONG2NUM(selector->interest_updates));
+
+    return stats;
+}
+
+/* How many times the selector has polled the kernel for events. Every
+   libev loop iteration is one backend poll (epoll_wait, kevent, select...),
+   and pipelined selectors count their poller thread's epoll_waits */
+static unsigned long NIO_Selector_polls(struct NIO_Selector *selector)
+{
+    unsigned long polls = selector->polls;
+
+    if(selector->ev_loop) {
+        polls += ev_iteration(selector->ev_loop);
+    }
+
+    if(selector->pipeline) {
+        polls += NIO_Pipeline_polls(selector->pipeline);
+    }
+
+    return polls;
+}
+
+/* Turn per-monitor accounting on or off. Monitors keep their counters
+   while it's off, but they stop being updated */
+static VALUE NIO_Selector_set_accounting(VALUE self, VALUE enabled)
+{
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    selector->accounting = RTEST(enabled);
+    return enabled;
+}
+
+static VALUE NIO_Selector_is_accounting(VALUE self)
+{
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    return selector->accounting ? Qtrue : Qfalse;
+}
+
+/* Cap how many events each select dispatches, sharing them between groups
+   of monitors in proportion to their weights. nil lifts the cap */
+static VALUE NIO_Selector_set_event_budget(VALUE self, VALUE budget)
+{
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    if(budget == Qnil) {
+        selector->event_budget = 0;
+        return budget;
+    }
+
+    if(NUM2INT(budget) <= 0) {
+        rb_raise(rb_eArgError, "event budget must be positive");
+    }
+
+    /* Ungrouped monitors need somewhere to wait their turn */
+    NIO_Selector_group(self, selector, Qnil);
+    selector->event_budget = NUM2INT(budget);
+
+    return budget;
+}
+
+static VALUE NIO_Selector_event_budget(VALUE self)
+{
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    return selector->event_budget ? INT2NUM(selector->event_budget) : Qnil;
+}
+
+/* Weight, registered monitors and events dispatched for each group */
+static VALUE NIO_Selector_group_stats(VALUE self)
+{
+    VALUE groups, stats, group_stats;
+    struct NIO_Group *group;
+    long i;
+
+    groups = rb_funcall(rb_ivar_get(self, rb_intern("groups")), rb_intern("values"), 0, 0);
+    stats = rb_hash_new();
+
+    for(i = 0; i < RARRAY_LEN(groups); i++) {
+        Data_Get_Struct(RARRAY_PTR(groups)[i], struct NIO_Group, group);
+
+        group_stats = rb_hash_new();
+        rb_hash_aset(group_stats, ID2SYM(rb_intern("weight")), INT2NUM(group->weight));
+        rb_hash_aset(group_stats, ID2SYM(rb_intern("monitors")), ULONG2NUM(group->monitors));
+        rb_hash_aset(group_stats, ID2SYM(rb_intern("events")), ULONG2NUM(group->events));
+
+        rb_hash_aset(stats, group->key, group_stats);
+    }
+
+    return stats;
+}
+
+/* Histogram of how long timestamped reads waited between the kernel
+   receiving them and the selector dispatching their monitor, with the
+   sample count and estimated percentiles. Buckets are keyed by their upper
+   bound in seconds */
+static VALUE NIO_Selector_receive_latency(VALUE self)
+{
+    VALUE result, histogram, p50 = Qnil, p99 = Qnil;
+    struct NIO_Selector *selector;
+    unsigned long samples = 0, seen = 0;
+    double upper_bound;
+    int i;
+
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    for(i = 0; i < NIO_LATENCY_BUCKETS; i++) {
+        samples += selector->receive_latency[i];
+    }
+
+    histogram = rb_hash_new();
+    for(i = 0; i < NIO_LATENCY_BUCKETS; i++) {
+        if(!selector->receive_latency[i]) {
+            continue;
+        }
+
+        upper_bound = (double)(1UL << i) / 1e6;
+        rb_hash_aset(histogram, rb_float_new(upper_bound), ULONG2NUM(selector->receive_latency[i]));
+
+        seen += selector->receive_latency[i];
+        if(p50 == Qnil && seen * 2 >= samples) {
+            p50 = rb_float_new(upper_bound);
+        }
+        if(p99 == Qnil && seen * 100 >= samples * 99) {
+            p99 = rb_float_new(upper_bound);
+        }
+    }
+
+    result = rb_hash_new();
+    rb_hash_aset(result, ID2SYM(rb_intern("samples")), ULONG2NUM(samples));
+    rb_hash_aset(result, ID2SYM(rb_intern("p50")), p50);
+    rb_hash_aset(result, ID2SYM(rb_intern("p99")), p99);
+    rb_hash_aset(result, ID2SYM(rb_intern("histogram")), histogram);
+
+    return result;
+}
+
+/* Does a native poller thread wait for this selector's events? */
+static VALUE NIO_Selector_is_pipelined(VALUE self)
+{
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    return selector->pipelined ? Qtrue : Qfalse;
+}
+
+/* The libev backend the selector polls with, as a symbol */
+static VALUE NIO_Selector_backend(VALUE self)
+{
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    if(selector->closed) {
+        rb_raise(rb_eIOError, "selector is closed");
+    }
+
+    NIO_Selector_setup(selector);
+
+    switch(ev_backend(selector->ev_loop)) {
+        case EVBACKEND_EPOLL:  return ID2SYM(rb_intern("epoll"));
+        case EVBACKEND_KQUEUE: return ID2SYM(rb_intern("kqueue"));
+        case EVBACKEND_PORT:   return ID2SYM(rb_intern("port"));
+        case EVBACKEND_POLL:   return ID2SYM(rb_intern("poll"));
+        case EVBACKEND_SELECT: return ID2SYM(rb_intern("select"));
+        default:               return Qnil;
+    }
+}
+
+/* libev's flag for a backend name */
+static unsigned int NIO_Selector_backend_flag(VALUE name)
+{
+    ID id;
+
+    Check_Type(name, T_SYMBOL);
+    id = SYM2ID(name);
+
+    if(id == rb_intern("epoll"))  return EVBACKEND_EPOLL;
+    if(id == rb_intern("kqueue")) return EVBACKEND_KQUEUE;
+    if(id == rb_intern("port"))   return EVBACKEND_PORT;
+    if(id == rb_intern("poll"))   return EVBACKEND_POLL;
+    if(id == rb_intern("select")) return EVBACKEND_SELECT;
+
+    rb_raise(rb_eArgError, "unknown backend: %s", rb_id2name(id));
+    return 0;
+}
+
+/* The monitor's value for the given accounting metric */
+static double NIO_Selector_metric(struct NIO_Monitor *monitor, ID by)
+{
+    if(by == rb_intern("handler_time")) {
+        return monitor->accounting.handler_time;
+    } else if(by == rb_intern("events")) {
+        return (double)monitor->accounting.events;
+    } else if(by == rb_intern("bytes_read")) {
+        return (double)monitor->accounting.bytes_read;
+    } else if(by == rb_intern("bytes_written")) {
+        return (double)monitor->accounting.bytes_written;
+    } else if(by == rb_intern("bytes")) {
+        return (double)(monitor->accounting.bytes_read + monitor->accounting.bytes_written);
+    } else {
+        return monitor->accounting.last_activity;
+    }
+}
+
+/* The n heaviest monitors by the given metric (:handler_time by default,
+   or :events, :bytes_read, :bytes_written, :bytes or :last_activity).
+   Walks the native registration table rather than the Ruby objects */
+static VALUE NIO_Selector_top(int argc, VALUE *argv, VALUE self)
+{
+    VALUE n_obj, options, by_obj, result;
+    struct NIO_Selector *selector;
+    struct NIO_Monitor *monitor, **top;
+    double *values, value;
+    long n, count, i;
+    ID by;
+
+    rb_scan_args(argc, argv, "11", &n_obj, &options);
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    n = NUM2LONG(n_obj);
+    if(n < 0) {
+        rb_raise(rb_eArgError, "negative count");
+    }
+
+    by = rb_intern("handler_time");
+    if(options != Qnil) {
+        Check_Type(options, T_HASH);
+        by_obj = rb_hash_aref(options, ID2SYM(rb_intern("by")));
+
+        if(by_obj != Qnil) {
+            by = SYM2ID(by_obj);
+
+            if(by != rb_intern("handler_time") && by != rb_intern("events") &&
+               by != rb_intern("bytes_read") && by != rb_intern("bytes_written") &&
+               by != rb_intern("bytes") && by != rb_intern("last_activity")) {
+                rb_raise(rb_eArgError, "invalid metric %s", rb_id2name(by));
+            }
+        }
+    }
+
+    /* Never more than there are monitors, however many were asked for */
+    count = 0;
+    for(monitor = selector->monitors; monitor && count < n; monitor = monitor->next) {
+        count++;
+    }
+    n = count;
+
+    result = rb_ary_new();
+    if(n == 0) {
+        return result;
+    }
+
+    top = ALLOC_N(struct NIO_Monitor *, n);
+    values = ALLOC_N(double, n);
+    count = 0;
+
+    /* Insertion into a sorted array of the n largest seen so far */
+    for(monitor = selector->monitors; monitor; monitor = monitor->next) {
+        value = NIO_Selector_metric(monitor, by);
+
+        if(count == n && value <= values[n - 1]) {
+            continue;
+        }
+
+        i = count < n ? count++ : n - 1;
+        while(i > 0 && values[i - 1] < value) {
+            top[i] = top[i - 1];
+            values[i] = values[i - 1];
+            i--;
+        }
+
+        top[i] = monitor;
+        values[i] = value;
+    }
+
+    for(i = 0; i < count; i++) {
+        rb_ary_push(result, top[i]->self);
+    }
+
+    xfree(top);
+    xfree(values);
+
+    return result;
+}
+
+/* Run collections that are coming due while the selector has nothing else
+   to do, instead of letting them land in the middle of handling a burst */
+static VALUE NIO_Selector_set_gc_when_idle(VALUE self, VALUE enabled)
+{
+    struct NIO_Selector *selector;
+#ifdef HAVE_RB_GC_STAT
+    VALUE stat;
+    const char **key;
+    static const char *keys[] = {
+        "old_objects", "old_objects_limit", "oldmalloc_increase_bytes", "oldmalloc_increase_bytes_limit",
+        "malloc_increase_bytes", "malloc_increase_bytes_limit", "heap_free_slots", "heap_available_slots", 0
+    };
+#endif
+
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    if(RTEST(enabled)) {
+#ifdef HAVE_RB_GC_STAT
+        /* Make sure this Ruby's GC reports everything NIO_Selector_gc_due looks at */
+        stat = rb_funcall(rb_const_get(rb_cObject, rb_intern("GC")), rb_intern("stat"), 0);
+        for(key = keys; *key; key++) {
+            if(rb_hash_lookup(stat, ID2SYM(rb_intern(*key))) == Qnil) {
+                rb_raise(rb_eNotImpError, "GC.stat doesn't report %s on this Ruby", *key);
+            }
+        }
+#else
+        rb_raise(rb_eNotImpError, "gc_when_idle needs GC.stat");
+#endif
+    }
+
+    selector->gc_when_idle = RTEST(enabled);
+    return enabled;
+}
+
+static VALUE NIO_Selector_is_gc_when_idle(VALUE self)
+{
+    struct NIO_Selector *selector;
+    Data_Get_Struct(self, struct NIO_Selector, selector);
+
+    return selector->gc_when_idle ? Qtrue : Qfalse;
+}
+
+#ifdef HAVE_RB_GC_STAT
+# define GC_STAT(key) ((double)rb_gc_stat(ID2SYM(rb_intern(key))))
+#endif
+
+/* Is the GC close to collecting? Old objects or old malloc growth near
+   their limits mean a major collection is on its way, and a minor one is
+   near once the heap is almost out of free slots or malloc growth is near
+   its limit */
+static int NIO_Selector_gc_due()
+{
+#ifdef HAVE_RB_GC_STAT
+    if(GC_STAT("old_objects") >= IDLE_GC_RATIO * GC_STAT("old_objects_limit") ||
+       GC_STAT("oldmalloc_increase_bytes") >= IDLE_GC_RATIO * GC_STAT("oldmalloc_increase_bytes_limit")) {
+        return IDLE_GC_MAJOR;
+    }
+
+    if(GC_STAT("heap_free_slots") < (1 - IDLE_GC_RATIO) * GC_STAT("heap_available_slots") ||
+       GC_STAT("malloc_increase_bytes") >= IDLE_GC_RATIO * GC_STAT("malloc_increase_bytes_limit")) {
+        return IDLE_GC_MINOR;
+    }
+#endif
+
+    return 0;
+}
+
+int NIO_Selector_idle_gc(struct NIO_Selector *selector)
+{
+    VALUE options;
+    int due = NIO_Selector_gc_due();
+
+    if(!due) {
+        return 0;
+    }
+
+    /* Leave sweeping to be done lazily, a little at a time, as objects are
+       allocated. Only marking has to happen all at once */
+    options = rb_hash_new();
+    rb_hash_aset(options, ID2SYM(rb_intern("full_mark")), due == IDLE_GC_MAJOR ? Qtrue : Qfalse);
+    rb_hash_aset(options, ID2SYM(rb_intern("immediate_sweep")), Qfalse);
+
+#ifdef RB_PASS_KEYWORDS
+    rb_funcallv_kw(rb_const_get(rb_cObject, rb_intern("GC")), rb_intern("start"), 1, &options, RB_PASS_KEYWORDS);
+#else
+    rb_funcall(rb_const_get(rb_cObject, rb_intern("GC")), rb_intern("start"), 1, options);
+#endif
+
+    if(due == IDLE_GC_MAJOR) {
+        selector->idle_gc_major++;
+    } else {
+        selector->idle_gc_minor++;
+    }
+
+    return 1;
+}
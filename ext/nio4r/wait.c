@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2011 Tony Arcieri. Distributed under the MIT License. See
+ * LICENSE.txt for further details.
+ */
+
+/* NIO.wait: wait for one IO without a selector
+
+   Client libraries mostly wait on a single socket at a time. Going through
+   a selector for that costs a monitor, an epoll_ctl() each way and the
+   selector's lock, for what is really one system call. Here it's one
+   ppoll() (or poll()) on the IO's fd with the GVL released */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1 /* ppoll */
+#endif
+
+#include "nio4r.h"
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+/* Ruby 1.8 can't block other green threads, so it waits in slices */
+#define NIO_WAIT_SLICE 0.01
+
+struct NIO_Wait_args
+{
+    struct pollfd fd;
+    double timeout; /* seconds, negative waits forever */
+    int result, error;
+};
+
+static VALUE NIO_wait(int argc, VALUE *argv, VALUE self);
+static VALUE NIO_Wait_poll(void *data);
+
+void Init_NIO_Wait()
+{
+    VALUE mNIO = rb_define_module("NIO");
+    rb_define_singleton_method(mNIO, "wait", NIO_wait, -1);
+}
+
+/* Wait up to timeout seconds (forever if nil) for io to be ready for
+   interests, returning :r, :w or :rw as it is, or nil on timeout */
+static VALUE NIO_wait(int argc, VALUE *argv, VALUE self)
+{
+    VALUE io, interests, timeout;
+    ID interests_id;
+    struct NIO_Wait_args args;
+    ev_tstamp deadline = 0;
+    int readiness;
+
+    #if HAVE_RB_IO_T
+        rb_io_t *fptr;
+    #else
+        OpenFile *fptr;
+    #endif
+
+    rb_scan_args(argc, argv, "21", &io, &interests, &timeout);
+    interests_id = SYM2ID(interests);
+
+    if(interests_id == rb_intern("r")) {
+        args.fd.events = POLLIN;
+    } else if(interests_id == rb_intern("w")) {
+        args.fd.events = POLLOUT;
+    } else if(interests_id == rb_intern("rw")) {
+        args.fd.events = POLLIN | POLLOUT;
+    } else {
+        rb_raise(rb_eArgError, "invalid event type %s (must be :r, :w, or :rw)",
+            RSTRING_PTR(rb_funcall(interests, rb_intern("inspect"), 0, 0)));
+    }
+
+    args.timeout = -1;
+    if(timeout != Qnil) {
+        args.timeout = NUM2DBL(timeout);
+        if(args.timeout < 0) {
+            rb_raise(rb_eArgError, "time interval must be positive");
+        }
+        deadline = ev_time() + args.timeout;
+    }
+
+    GetOpenFile(rb_convert_type(io, T_FILE, "IO", "to_io"), fptr);
+    args.fd.fd = FPTR_TO_FD(fptr);
+    args.fd.revents = 0;
+
+#ifdef HAVE_RB_IO_READ_PENDING
+    /* Data Ruby has already buffered won't show up on the fd */
+    if((args.fd.events & POLLIN) && rb_io_read_pending(fptr)) {
+        args.timeout = 0;
+    }
+#endif
+
+    for(;;) {
+#if defined(HAVE_RB_THREAD_BLOCKING_REGION)
+        if(args.timeout == 0) {
+            NIO_Wait_poll(&args);
+        } else {
+            rb_thread_blocking_region(NIO_Wait_poll, (void *)&args, RUBY_UBF_IO, 0);
+        }
+#else
+        if(args.timeout != 0 && rb_thread_alone()) {
+            TRAP_BEG;
+            NIO_Wait_poll(&args);
+            TRAP_END;
+        } else {
+            /* Let the other green threads run between slices */
+            double remaining = args.timeout;
+
+            if(args.timeout < 0 || args.timeout > NIO_WAIT_SLICE) {
+                args.timeout = NIO_WAIT_SLICE;
+            }
+            NIO_Wait_poll(&args);
+            args.timeout = remaining;
+
+            if(args.result == 0 && remaining != 0) {
+                args.result = -1;
+                args.error = EINTR;
+                rb_thread_schedule();
+            }
+        }
+#endif
+
+        if(args.result >= 0 || args.error != EINTR) {
+            break;
+        }
+
+        /* Interrupted: let Thread#raise and friends in, then wait out what's
+           left of the timeout */
+#if defined(HAVE_RB_THREAD_BLOCKING_REGION)
+        rb_thread_check_ints();
+#endif
+        if(timeout != Qnil) {
+            args.timeout = deadline - ev_time();
+            if(args.timeout <= 0) {
+                args.timeout = 0;
+            }
+        }
+    }
+
+    if(args.result < 0) {
+        errno = args.error;
+        rb_sys_fail("poll");
+    }
+
+    if(args.fd.revents & POLLNVAL) {
+        rb_raise(rb_eIOError, "closed stream");
+    }
+
+    /* Errors and hangups are ready for whatever was asked, so the next
+       read or write finds out what happened */
+    readiness = 0;
+    if(args.fd.revents & (POLLIN | POLLHUP | POLLERR)) {
+        readiness |= POLLIN;
+    }
+    if(args.fd.revents & (POLLOUT | POLLHUP | POLLERR)) {
+        readiness |= POLLOUT;
+    }
+#ifdef HAVE_RB_IO_READ_PENDING
+    if(rb_io_read_pending(fptr)) {
+        readiness |= POLLIN;
+    }
+#endif
+    readiness &= args.fd.events;
+
+    switch(readiness) {
+        case POLLIN:           return ID2SYM(rb_intern("r"));
+        case POLLOUT:          return ID2SYM(rb_intern("w"));
+        case POLLIN | POLLOUT: return ID2SYM(rb_intern("rw"));
+        default:               return Qnil;
+    }
+}
+
+/* The system call itself, safe to run without the GVL */
+static VALUE NIO_Wait_poll(void *data)
+{
+    struct NIO_Wait_args *args = (struct NIO_Wait_args *)data;
+#ifdef HAVE_PPOLL
+    struct timespec ts;
+
+    if(args->timeout >= 0) {
+        ts.tv_sec = (time_t)args->timeout;
+        ts.tv_nsec = (long)((args->timeout - (double)ts.tv_sec) * 1e9);
+    }
+
+    args->result = ppoll(&args->fd, 1, args->timeout < 0 ? 0 : &ts, 0);
+#else
+    /* Round up, so timeouts under a millisecond don't become busy loops */
+    int millis = args->timeout < 0 ? -1 : (int)(args->timeout * 1000 + 0.999);
+
+    args->result = poll(&args->fd, 1, millis);
+#endif
+    args->error = errno;
+
+    return Qnil;
+}
@@ -1,5 +1,6 @@
 require 'thread'
 require 'nio/version'
+require 'nio/tcp_info'
 
 # New I/O for Ruby
 module NIO
@@ -7,21 +8,35 @@ module NIO
   # * select: in pure Ruby using Kernel.select
   # * libev: as a C extension using libev
   # * java: using Java NIO
+  # * epoll: on JRuby calling epoll directly (opt in by setting NIO4R_EPOLL)
   def self.engine; ENGINE end
 end
 
 if ENV["NIO4R_PURE"]
   require 'nio/monitor'
   require 'nio/selector'
+  require 'nio/wait'
   NIO::ENGINE = 'select'
 else
   require 'nio4r_ext'
 
   if defined?(JRUBY_VERSION)
     require 'java'
-    org.nio4r.Nio4r.new.load(JRuby.runtime, false)
-    NIO::ENGINE = 'java'
+
+    if ENV["NIO4R_EPOLL"]
+      org.nio4r.Nio4rEpoll.new.load(JRuby.runtime, false)
+      NIO::ENGINE = 'epoll'
+    else
+      org.nio4r.Nio4r.new.load(JRuby.runtime, false)
+      NIO::ENGINE = 'java'
+    end
   else
     NIO::ENGINE = 'libev'
   end
-end
\ No newline at end of file
+end
+
+require 'nio/process_waiter'
+require 'nio/selector_pool'
+require 'nio/handoff'
+require 'nio/rebalancer'
+require 'nio/reactor'
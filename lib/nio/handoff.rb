@@ -0,0 +1,126 @@
+require 'socket'
+
+module NIO
+  # Hot restarts: hand live registrations over to another process
+  class Selector
+    # How many file descriptors we pass in a single SCM_RIGHTS message
+    HANDOFF_BATCH_SIZE = 128
+
+    # Interests as they go over the wire
+    HANDOFF_INTERESTS = { :r => 1, :w => 2, :rw => 3 }.freeze
+
+    # Token length that stands for no token at all
+    HANDOFF_NO_TOKEN = 0xFFFFFFFF
+
+    # Send every registered IO object, along with its interests, over the
+    # given UNIXSocket so another process can take over selecting on it
+    # with #import_registrations. If a block is given, it's called with each
+    # monitor and can return a state token (a String, or nil for none) which
+    # is passed along with the IO object.
+    #
+    # The IO objects stay registered with this selector. Once the other side
+    # has imported them, deregister and close them here as usual. Returns the
+    # number of IO objects sent
+    def export_registrations(sock)
+      exported = monitors
+
+      exported.each_slice(HANDOFF_BATCH_SIZE) do |batch|
+        payload = ""
+        batch.each do |monitor|
+          token = block_given? ? yield(monitor) : nil
+          payload << encode_handoff_entry(monitor.io.class.name, monitor.interests, token)
+        end
+
+        rights = Socket::AncillaryData.unix_rights(*batch.map { |monitor| monitor.io })
+
+        sock.sendmsg [batch.size, payload.bytesize].pack("NN"), 0, nil, rights
+        sock.write payload
+      end
+
+      # An empty batch marks the end of the handoff
+      sock.sendmsg [0, 0].pack("NN")
+      exported.size
+    end
+
+    # Receive IO objects sent by #export_registrations and register them with
+    # this selector using their original interests. If a block is given, it's
+    # called with each new monitor and the state token sent along with it.
+    # Returns an array of the new monitors
+    def import_registrations(sock)
+      imported = []
+
+      loop do
+        header, _, _, *controls = sock.recvmsg(8, 0, nil, :scm_rights => true)
+        raise EOFError, "handoff ended prematurely" if header.nil? || header.empty?
+        header << sock.read(8 - header.bytesize) while header.bytesize < 8
+
+        count, size = header.unpack("NN")
+        break if count.zero?
+
+        ios = controls.map { |control| control.unix_rights }.flatten.compact
+        raise IOError, "expected #{count} file descriptors, got #{ios.size}" unless ios.size == count
+
+        entries = decode_handoff_entries(sock.read(size), count)
+        entries.zip(ios) do |(class_name, interests, token), io|
+          monitor = register(restore_handoff_io(io, class_name), interests)
+          yield monitor, token if block_given?
+          imported << monitor
+        end
+      end
+
+      imported
+    end
+
+    private
+
+    # Each entry is its interests, the IO's class name and its token, with
+    # lengths up front. The other end only ever unpacks these: nothing it
+    # receives is turned back into arbitrary objects
+    def encode_handoff_entry(class_name, interests, token)
+      unless token.nil? || token.is_a?(String)
+        raise TypeError, "handoff tokens must be Strings (got #{token.class})"
+      end
+
+      class_name = class_name.to_s
+      token_size = token ? token.bytesize : HANDOFF_NO_TOKEN
+      [HANDOFF_INTERESTS[interests], class_name.bytesize, token_size, class_name, token.to_s].pack("CnNa*a*")
+    end
+
+    def decode_handoff_entries(payload, count)
+      raise EOFError, "handoff ended prematurely" if payload.nil?
+
+      offset = 0
+      entries = Array.new(count) do
+        raise IOError, "malformed handoff" if payload.bytesize < offset + 7
+        code, name_size, token_size = payload.unpack("@#{offset}CnN")
+        offset += 7
+
+        interests = HANDOFF_INTERESTS.keys.find { |key| HANDOFF_INTERESTS[key] == code }
+        has_token = token_size != HANDOFF_NO_TOKEN
+        token_size = 0 unless has_token
+        unless interests && payload.bytesize >= offset + name_size + token_size
+          raise IOError, "malformed handoff"
+        end
+
+        class_name, token = payload.unpack("@#{offset}a#{name_size}a#{token_size}")
+        offset += name_size + token_size
+
+        [class_name, interests, has_token ? token : nil]
+      end
+
+      raise IOError, "malformed handoff" unless offset == payload.bytesize
+      entries
+    end
+
+    # Received descriptors arrive as plain IO objects. Rewrap them in the
+    # class they were sent as (e.g. TCPSocket, TCPServer) where we can
+    def restore_handoff_io(io, class_name)
+      klass = class_name.split("::").inject(Object) { |mod, name| mod.const_get(name) } rescue IO
+      return io if klass == IO || !(klass <= IO)
+
+      restored = klass.for_fd(io.fileno)
+      io.autoclose = false
+      restored
+    end
+  end
+end
@@ -1,9 +1,45 @@
+require 'io/wait'
+
 module NIO
   # Monitors watch IO objects for specific events
   class Monitor
+    # How often to check whether enough bytes have arrived when emulating
+    # SO_RCVLOWAT
+    MIN_READABLE_POLL_INTERVAL = 0.001
+
+    # IOs closed with :close_io => :async, waiting for the closer thread
+    CLOSER_QUEUE = Queue.new
+    CLOSER_LOCK  = Mutex.new
+
     attr_reader :io, :interests, :selector
     attr_accessor :value, :readiness
 
+    # :nodoc: bookkeeping for the selector's slow client policy
+    attr_accessor :sample_countdown, :slow_samples
+
+    # Accounting counters, kept up to date if the selector has accounting on
+    attr_reader :bytes_read, :bytes_written
+
+    # :nodoc: updated by the selector
+    attr_accessor :events, :handler_time, :last_activity
+
+
+    # :nodoc: the selector's bookkeeping for this monitor's group
+    attr_accessor :membership
+
+    # The kernel's receive timestamp for the last timestamped read_nonblock,
+    # or nil. On TCP that's the latest segment the read took data from
+    attr_reader :received_at
+
+    # :nodoc: when the selector last handed this monitor out
+    attr_writer :dispatched_at
+
+    # :nodoc: set by the selector the monitor migrates to
+    attr_writer :selector
+
+    # :nodoc: set by Selector#watch_process
+    attr_writer :process_waiter
+
     # :nodoc
     def initialize(io, interests, selector)
       unless io.is_a?(IO)
@@ -15,9 +51,24 @@ module NIO
 
         raise TypeError, "can't convert #{io.class} into IO" unless io.is_a? IO
       end
+      raise IOError, "closed stream" if io.closed?
 
       @io, @interests, @selector = io, interests, selector
       @closed = false
+      @readiness = nil
+      @sample_countdown = @slow_samples = 0
+      @bytes_read = @bytes_written = @events = 0
+      @handler_time = 0.0
+      @last_activity = nil
+      @rate = @throttled_until = @poll_at = nil
+      @throttled = false
+      @membership = nil
+      @min_readable_bytes = 1
+      @process_waiter = nil
+      @min_readable_emulated = nil
+      @awaiting_bytes = false
+      @receive_timestamps = false
+      @received_at = @dispatched_at = nil
     end
 
     # Is the IO object readable?
@@ -31,13 +82,429 @@ module NIO
     end
     alias_method :writeable?, :writable?
 
+    # Sample the kernel's TCP statistics for this socket. If an NIO::TCPInfo
+    # is given it's filled in place rather than allocating a new one
+    def tcp_info(info = nil)
+      unless defined?(::Socket::TCP_INFO) && RUBY_PLATFORM =~ /linux/
+        raise NotImplementedError, "TCP_INFO is not supported on this platform"
+      end
+
+      # Offsets into the kernel's struct tcp_info, unpacked in one go since
+      # the selector samples in its dispatch loop. Older kernels stop short
+      # of the later fields
+      data = io.getsockopt(::Socket::IPPROTO_TCP, ::Socket::TCP_INFO).data
+      size = data.bytesize
+      layout = size >= 168 ? "@24L@68L@144L@160Q" : size >= 148 ? "@24L@68L@144L" : "@24L@68L"
+      unacked, rtt, notsent_bytes, delivery_rate = data.unpack(layout)
+
+      info ||= TCPInfo.new
+      info.rtt           = rtt
+      info.unacked       = unacked
+      info.notsent_bytes = notsent_bytes
+      info.delivery_rate = delivery_rate
+      info
+    end
+
+    # Has the selector's slow client policy flagged this monitor?
+    def slow?
+      @slow_samples >= Selector::SLOW_CLIENT_SAMPLES
+    end
+
     # Is this monitor closed?
     def closed?; @closed; end
 
-    # Deactivate this monitor
+    # Change what the monitor waits for (:r, :w or :rw). This takes effect
+    # at the next select, so a handler can flip interests back and forth
+    # and only the last change costs anything
+    def interests=(interests)
+      raise IOError, "monitor is closed" if @closed
+      unless interests == :r || interests == :w || interests == :rw
+        raise ArgumentError, "invalid event type #{interests.inspect} (must be :r, :w, or :rw)"
+      end
+
+      unless interests == @interests
+        previous, @interests = @interests, interests
+        @selector.interests_changed(self, previous)
+      end
+
+      interests
+    end
+
+    # Deactivate this monitor. Pass :close_io => true to close the IO as
+    # well, or :close_io => :async to leave the closing to a background thread
     def close(deregister = true)
-      @closed = true
+      close_io_mode = nil
+
+      if deregister.is_a? Hash
+        close_io_mode = deregister[:close_io]
+        deregister = deregister[:deregister] != false
+
+        unless [nil, false, true, :async].include? close_io_mode
+          raise ArgumentError, "close_io must be true, false or :async"
+        end
+      end
+
+      unless @closed
+        @closed = true
+        @selector.leave_group(self) if @membership
+        reset_min_readable_bytes
+
+        # Don't leave a thread waiting for a process nobody will reap
+        @process_waiter.close if @process_waiter
+      end
+
       @selector.deregister(io) if deregister
+      close_io(close_io_mode == :async) if close_io_mode && io && !io.closed?
+    end
+
+    # :nodoc: close IOs queued by close(:close_io => :async), a batch at a
+    # time, on a thread of their own. Started on first use, and again in
+    # forked children, whose copies of the queue are theirs to close
+    def self.close_later(io)
+      CLOSER_LOCK.synchronize do
+        unless @closer && @closer.alive?
+          @closer = Thread.new do
+            loop do
+              batch = [CLOSER_QUEUE.pop]
+              batch << CLOSER_QUEUE.pop until CLOSER_QUEUE.empty?
+              batch.each { |closing| closing.close rescue nil }
+            end
+          end
+        end
+      end
+
+      CLOSER_QUEUE << io
+    end
+
+    # Move this monitor to another selector. Unlike deregistering and
+    # registering again, it stays the same Monitor, with the same value
+    def migrate_to(selector)
+      raise IOError, "monitor is closed" if @closed
+      return self if selector.equal?(@selector)
+
+      # It may have been closed while we waited for the locks
+      raise IOError, "monitor is closed" if @selector.migrate([self], selector).empty?
+      self
+    end
+
+    # The group this monitor was registered with, if any
+    def group
+      @membership.key if @membership
+    end
+
+    # IO#read_nonblock, counting the bytes read if accounting is on
+    def read_nonblock(*args)
+      result = (@receive_timestamps && !@closed && recvmsg(*args)) || io.read_nonblock(*args)
+      return result unless result.is_a?(String) && !@closed
+
+      @bytes_read += result.bytesize if accounting?
+
+      if @rate
+        refill(Time.now)
+        @tokens -= result.bytesize
+
+        # Out of tokens: stop reading until the bucket has refilled
+        if @tokens < 1 && !@throttled
+          pause_reads(@refilled_at + (1 - @tokens) / @rate - Time.now)
+        end
+      end
+
+      result
+    end
+
+    # IO#write_nonblock, counting the bytes written if accounting is on
+    def write_nonblock(*args)
+      result = io.write_nonblock(*args)
+      @bytes_written += result if result.is_a?(Integer) && accounting?
+      result
+    end
+
+    # Pass keyword arguments like exception: false through on Ruby 3
+    ruby2_keywords(:read_nonblock, :write_nonblock) if respond_to?(:ruby2_keywords, true)
+
+    # Most bytes accept_nonblock reads from a new connection by default
+    ACCEPT_READ_SIZE = 16384
+
+    # Only report a listener readable once a new connection has sent some
+    # data, waiting up to the given number of seconds for it. 0 or false
+    # turns it off
+    def defer_accept=(seconds)
+      raise IOError, "monitor is closed" if @closed
+
+      if defined?(::Socket::TCP_DEFER_ACCEPT)
+        io.setsockopt(::Socket::IPPROTO_TCP, ::Socket::TCP_DEFER_ACCEPT, seconds || 0)
+      elsif seconds && seconds != 0
+        raise NotImplementedError, "TCP_DEFER_ACCEPT isn't supported on this platform"
+      end
+    end
+
+    # Accept a connection and read whatever the client has sent in the same
+    # call. Returns [socket, data]: data is empty if nothing has arrived yet
+    # and nil if the client has already hung up
+    def accept_nonblock(maxlen = ACCEPT_READ_SIZE)
+      raise ArgumentError, "maxlen must be positive" unless maxlen > 0
+
+      socket = io.accept_nonblock
+      data = begin
+        socket.read_nonblock(maxlen)
+      rescue EOFError
+        nil
+      rescue SystemCallError
+        "" # nothing yet (EAGAIN), or an error the next read will report
+      end
+
+      @bytes_read += data.bytesize if data && accounting?
+      [socket, data]
+    end
+
+    # Limit how fast data is read through #read_nonblock to rate bytes per
+    # second, allowing bursts of up to burst bytes (one second's worth by
+    # default). Once the bucket runs dry the monitor stops selecting for
+    # reads until it refills. Passing nil removes the limit
+    def rate_limit(rate, burst = nil)
+      raise IOError, "monitor is closed" if @closed
+
+      if rate.nil?
+        @rate = nil
+        @throttled_until = Time.now if @throttled
+        return
+      end
+
+      raise ArgumentError, "rate must be positive" unless rate > 0
+      raise ArgumentError, "burst must be at least one byte" if burst && burst < 1
+
+      @rate = rate.to_f
+      @burst = [(burst || rate).to_f, 1.0].max
+      @tokens = @burst
+      @refilled_at = Time.now
+      nil
+    end
+
+    # Has the rate limiter or slow client policy stopped this monitor from
+    # reading?
+    def throttled?; @throttled end
+
+    # Ask the kernel to timestamp data as it arrives on this monitor's
+    # socket. read_nonblock then records the timestamp of what it read (the
+    # datagram, or on TCP the latest segment it read from), and how long that
+    # waited to be dispatched
+    def receive_timestamps=(enabled)
+      raise IOError, "monitor is closed" if @closed
+
+      if defined?(::Socket::SO_TIMESTAMPNS) && io.respond_to?(:recvmsg_nonblock)
+        io.setsockopt(::Socket::SOL_SOCKET, ::Socket::SO_TIMESTAMPNS, enabled ? 1 : 0)
+      elsif enabled
+        raise NotImplementedError, "receive timestamps aren't supported on this platform"
+      end
+
+      @receive_timestamps = !!enabled
+      @dispatched_at = nil
+    end
+
+    def receive_timestamps?; @receive_timestamps end
+
+    # Only report the monitor readable once at least this many bytes are
+    # buffered. TCP sockets on Linux use SO_RCVLOWAT. Elsewhere this is
+    # emulated: if fewer bytes have arrived, reads are paused and the IO
+    # polled until they have. Cheap enough to change for every frame
+    attr_reader :min_readable_bytes
+
+    def min_readable_bytes=(bytes)
+      raise IOError, "monitor is closed" if @closed
+
+      bytes ||= 1
+      raise ArgumentError, "minimum must be at least one byte" if bytes < 1
+      return if bytes == @min_readable_bytes
+
+      # Work out whether the kernel can do this for us the first time round
+      @min_readable_emulated = !kernel_rcvlowat? if @min_readable_emulated.nil?
+
+      unless @min_readable_emulated
+        begin
+          io.setsockopt(::Socket::SOL_SOCKET, ::Socket::SO_RCVLOWAT, bytes)
+        rescue SystemCallError
+          @min_readable_emulated = true
+        end
+      end
+
+      @min_readable_bytes = bytes
+
+      # Let the next select check against the new minimum
+      @poll_at = Time.now if @awaiting_bytes
+    end
+
+    # :nodoc: called by the selector when the IO is readable. If we're
+    # emulating SO_RCVLOWAT and not enough has arrived yet, pause reads until
+    # it has and return true
+    def short_read?
+      return false unless @min_readable_emulated && @min_readable_bytes > 1 && short_of_bytes?
+
+      @awaiting_bytes = true
+      @poll_at = Time.now + MIN_READABLE_POLL_INTERVAL
+      true
+    end
+
+    # :nodoc: stop selecting for reads for the given number of seconds. Used
+    # by the rate limiter and the selector's slow client policy
+    def pause_reads(seconds)
+      return if @throttled
+
+      @throttled = true
+      @throttled_until = Time.now + seconds
+      @selector.throttle(self)
+    end
+
+    # :nodoc: should the selector leave this monitor out of its read set?
+    def paused?
+      @throttled || @awaiting_bytes
+    end
+
+    # :nodoc: when a paused monitor is next worth checking on. Throttling and
+    # waiting for bytes keep deadlines of their own: with both, there's no
+    # point polling for bytes before the throttle lifts
+    def resume_at
+      if @throttled && @awaiting_bytes
+        @throttled_until > @poll_at ? @throttled_until : @poll_at
+      else
+        @throttled ? @throttled_until : @poll_at
+      end
+    end
+
+    # :nodoc: called by the selector. Returns true if the monitor can start
+    # reading again
+    def resume(now)
+      return true if @closed
+
+      if @throttled
+        return false if now < @throttled_until
+
+        refill(now) if @rate
+        @throttled = false
+      end
+
+      if @awaiting_bytes
+        return false if now < @poll_at
+
+        if short_of_bytes?
+          @poll_at = now + MIN_READABLE_POLL_INTERVAL
+          return false
+        end
+
+        @awaiting_bytes = false
+      end
+
+      true
+    end
+
+    # For monitors from Selector#watch_process: the process's
+    # Process::Status once it has exited, which also closes the monitor and
+    # its IO. Returns nil while the process is still running. Once the
+    # monitor is closed it returns the status if it already has one, and
+    # raises IOError if not
+    def reap
+      raise ArgumentError, "monitor isn't watching a process" unless @process_waiter
+
+      status = @process_waiter.reap
+      close(:close_io => true) if status && !@closed
+      status
+    end
+
+    # Close this monitor and hand it back to its selector, which reuses it
+    # for the next register(io, interests, :reuse => true)
+    def recycle
+      return if @closed
+
+      close
+      @io = @value = @process_waiter = nil
+      @selector.recycle(self)
+      nil
+    end
+
+    private
+
+    # Asynchronous closes detach the descriptor from the IO first, so
+    # closing the IO leaves it open and the real close happens on the closer
+    # thread. Rubies without IO#autoclose= get a dup instead
+    def close_io(async)
+      if async
+        raw = io.to_io
+        if raw.respond_to?(:autoclose=)
+          fd = raw.fileno
+          raw.autoclose = false
+        else
+          copy = raw.dup
+        end
+      end
+
+      io.close
+    ensure
+      copy = IO.for_fd(fd) if fd
+      Monitor.close_later(copy) if copy
+    end
+
+    # read_nonblock(maxlen, buffer = nil) with recvmsg, picking up the
+    # kernel's receive timestamp. Returns nil to leave buffered data, EOF,
+    # errors and EAGAIN to IO#read_nonblock, so they behave just like they
+    # usually do
+    def recvmsg(maxlen, buffer = nil, *)
+      begin
+        data, _, _, *controls = io.recvmsg_nonblock(maxlen)
+      rescue IO::WaitReadable, IOError, SystemCallError
+        return
+      end
+      return if data.nil? || data.empty?
+
+      controls.each do |control|
+        next unless control.cmsg_is?(:SOCKET, :TIMESTAMPNS)
+        @received_at = control.timestamp.to_f
+
+        # Only the first read after each dispatch counts
+        if @dispatched_at
+          @selector.record_receive_latency(@dispatched_at - @received_at)
+          @dispatched_at = nil
+        end
+      end
+
+      buffer.is_a?(String) ? buffer.replace(data) : data
+    end
+
+    # Are some, but fewer than the minimum, bytes waiting to be read? Unlike
+    # the C extension we can't tell whether the other end has hung up
+    def short_of_bytes?
+      available = io.nread
+      available > 0 && available < @min_readable_bytes
+    end
+
+    # SO_RCVLOWAT belongs to the socket, so it would outlive the monitor on
+    # an IO that's still in use
+    def reset_min_readable_bytes
+      if @min_readable_bytes > 1 && !@min_readable_emulated && !io.closed?
+        io.setsockopt(::Socket::SOL_SOCKET, ::Socket::SO_RCVLOWAT, 1) rescue nil
+      end
+
+      @min_readable_bytes = 1
+    end
+
+    # Does the kernel honour SO_RCVLOWAT for this IO?
+    def kernel_rcvlowat?
+      return false unless RUBY_PLATFORM =~ /linux/ && defined?(::Socket::SO_RCVLOWAT) && io.is_a?(::BasicSocket)
+
+      type = io.getsockopt(::Socket::SOL_SOCKET, ::Socket::SO_TYPE).data.unpack("i").first
+      family = io.getsockname.unpack("S").first
+      type == ::Socket::SOCK_STREAM && (family == ::Socket::AF_INET || family == ::Socket::AF_INET6)
+    rescue SystemCallError
+      false
+    end
+
+    # Add the tokens earned since the bucket was last refilled
+    def refill(now)
+      @tokens += @rate * (now - @refilled_at)
+      @tokens = @burst if @tokens > @burst
+      @refilled_at = now
+    end
+
+    def accounting?
+      !@closed && @selector.accounting?
     end
   end
 end
@@ -0,0 +1,52 @@
+module NIO
+  # :nodoc: waits for a process to exit on a thread of its own, for
+  # Selector#watch_process where there are no pidfds. The thread reaps the
+  # process, then closes the write end of a pipe, so the read end that's
+  # registered with the selector turns readable
+  class ProcessWaiter
+    attr_reader :reader
+
+    def initialize(pid)
+      @reader, writer = IO.pipe
+      @status = @error = nil
+      @done = @closed = false
+
+      @thread = Thread.new do
+        begin
+          @status = Process.wait2(pid).last
+        rescue SystemCallError => ex
+          @error = ex
+        ensure
+          @done = true
+          writer.close
+        end
+      end
+    end
+
+    # The process's Process::Status once it has exited, otherwise nil.
+    # Raises whatever waiting for it did, e.g. Errno::ECHILD if it wasn't
+    # a child of ours. Once closed, only a status it already has is left
+    def reap
+      if @closed
+        raise IOError, "monitor is closed" unless @status || @error
+      else
+        return unless @done
+        @thread.join
+      end
+
+      raise @error if @error
+      @status
+    end
+
+    # Stop waiting, leaving a process that's still running for whoever
+    # waits for it next, and close the reader
+    def close
+      return if @closed
+      @closed = true
+
+      @thread.kill unless @done
+      @thread.join
+      @reader.close unless @reader.closed?
+    end
+  end
+end
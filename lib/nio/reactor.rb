@@ -0,0 +1,329 @@
+module NIO
+  # Runs servers and clients on a selector: accepts connections, reads into
+  # a shared buffer, queues writes the socket can't take yet and closes
+  # connections that go idle. Handlers subclass Reactor::Connection and
+  # implement on_data, and on_open/on_close if they need them:
+  #
+  #   class Echo < NIO::Reactor::Connection
+  #     def on_data(data)
+  #       write data
+  #     end
+  #   end
+  #
+  #   reactor = NIO::Reactor.new(:idle_timeout => 30)
+  #   reactor.listen TCPServer.new("localhost", 1234), Echo
+  #   reactor.run
+  class Reactor
+    # Most bytes read from a connection per event
+    DEFAULT_READ_SIZE = 16384
+
+    # Most connections accepted per listener event, so a flood of new
+    # connections can't starve the existing ones
+    ACCEPT_BATCH = 32
+
+    # Connections are checked for idleness at most this often, in seconds
+    MAX_SWEEP_INTERVAL = 1.0
+
+    REUSE = { :reuse => true }.freeze
+
+    # A connection handled by the reactor. Subclass it and override the
+    # callbacks you need
+    class Connection
+      attr_reader :io, :reactor
+
+      # :nodoc: the reactor's bookkeeping
+      attr_accessor :monitor, :writes, :active_at, :closing
+
+      def initialize(reactor, io)
+        @reactor = reactor
+        @io      = io
+        @closed  = false
+      end
+
+      # Called once the connection is being watched
+      def on_open; end
+
+      # Called with each chunk read. The reactor reads every connection into
+      # the same buffer, so data only stays the same until on_data returns:
+      # dup it to keep it
+      def on_data(data); end
+
+      # Called once the connection has been closed, by either end
+      def on_close; end
+
+      # Write data, queueing whatever the socket won't take yet
+      def write(data)
+        @reactor.write(self, data)
+      end
+
+      # Close the connection, by default once everything written so far has
+      # gone out. Pass false to close it straight away
+      def close(flush = true)
+        @reactor.close_connection(self, flush)
+      end
+
+      def closed?; @closed end
+
+      # :nodoc:
+      def closed!; @closed = true end
+    end
+
+    # :nodoc: a listening socket and what to do with its connections
+    Listener = Struct.new(:server, :connection_class, :block)
+
+    attr_reader :selector
+
+    # Options:
+    #
+    # * :idle_timeout - close connections that neither read nor write for
+    #   this many seconds (never by default)
+    # * :read_size - most bytes read per event (16KB by default)
+    # * :defer_accept - on Linux, only accept TCP connections once they've
+    #   sent something, waiting up to this many seconds for it
+    # * :selector - the NIO::Selector to run on (a new one by default)
+    def initialize(options = {})
+      @selector     = options[:selector] || Selector.new
+      @idle_timeout = options[:idle_timeout]
+      @read_size    = options[:read_size] || DEFAULT_READ_SIZE
+      @defer_accept = options[:defer_accept]
+
+      @buffer      = ""
+      @connections = {}
+      @fused_accept = true
+      @running = false
+      @now = @swept_at = Time.now
+    end
+
+    # Accept connections on server, handling each with a new instance of
+    # connection_class. The block, if any, is called with each connection
+    # after on_open
+    def listen(server, connection_class = Connection, &block)
+      monitor = @selector.register(server, :r)
+      monitor.value = Listener.new(server, connection_class, block)
+
+      if @defer_accept && defined?(::TCPServer) && server.is_a?(::TCPServer)
+        begin
+          monitor.defer_accept = @defer_accept
+        rescue NotImplementedError
+        end
+      end
+
+      monitor
+    end
+
+    # Handle an already connected socket, e.g. one we've connected out
+    def attach(io, connection_class = Connection)
+      connection = connection_class.new(self, io)
+      open(connection)
+      connection
+    end
+
+    # Number of open connections
+    def connections
+      @connections.size
+    end
+
+    # Run until #stop is called, handling events as they come in
+    def run
+      @running = true
+      run_once while @running
+    end
+
+    # Wait up to timeout seconds (forever by default) for events and handle
+    # them
+    def run_once(timeout = nil)
+      if @idle_timeout
+        interval = @idle_timeout / 4.0
+        interval = MAX_SWEEP_INTERVAL if interval > MAX_SWEEP_INTERVAL
+
+        until_sweep = interval - (Time.now - @swept_at)
+        until_sweep = 0 if until_sweep < 0
+        timeout = until_sweep if timeout.nil? || until_sweep < timeout
+      end
+
+      # Without a block, so handlers run after the selector has let go of
+      # its lock and can register and close monitors freely
+      ready = @selector.select(timeout)
+      @now = Time.now
+
+      if ready
+        ready.each do |monitor|
+          next if monitor.closed?
+
+          value = monitor.value
+          if value.is_a? Listener
+            accept(monitor, value)
+          else
+            ready(monitor, value)
+          end
+        end
+      end
+
+      sweep if @idle_timeout && @now - @swept_at >= interval
+    end
+
+    # Make #run return once it's done with the events at hand. Safe to call
+    # from other threads
+    def stop
+      @running = false
+      @selector.wakeup
+    end
+
+    # Close every connection and the selector. Listening sockets are left
+    # open
+    def close
+      @connections.keys.each { |connection| close_connection(connection, false) }
+      @selector.close
+    end
+
+    # :nodoc: see Connection#write
+    def write(connection, data)
+      return if connection.closed? || data.empty?
+
+      if connection.writes
+        connection.writes << data.dup
+        return
+      end
+
+      written = begin
+        connection.monitor.write_nonblock(data)
+      rescue Errno::EAGAIN, Errno::EWOULDBLOCK
+        0
+      rescue IOError, SystemCallError
+        close_connection(connection, false)
+        return
+      end
+
+      connection.active_at = @now
+      return if written == data.bytesize
+
+      # Wait for the socket to take the rest
+      connection.writes = [rest(data, written)]
+      watch(connection, :rw)
+    end
+
+    # :nodoc: see Connection#close
+    def close_connection(connection, flush)
+      return if connection.closed?
+
+      if flush && connection.writes
+        connection.closing = true
+        return
+      end
+
+      connection.closed!
+      @connections.delete(connection)
+      connection.monitor.recycle
+      connection.io.close unless connection.io.closed?
+      connection.on_close
+    end
+
+    private
+
+    def open(connection)
+      connection.monitor = @selector.register(connection.io, :r, REUSE)
+      connection.monitor.value = connection
+      connection.active_at = @now
+      @connections[connection] = true
+      connection.on_open
+    end
+
+    # Accept a batch of connections, reading each one's first data in the
+    # same call where the engine can
+    def accept(monitor, listener)
+      ACCEPT_BATCH.times do
+        data = ""
+
+        begin
+          if @fused_accept
+            socket, data = monitor.accept_nonblock(@read_size)
+          else
+            socket = listener.server.accept_nonblock
+          end
+        rescue NotImplementedError
+          @fused_accept = false
+          retry
+        rescue Errno::EAGAIN, Errno::EWOULDBLOCK, Errno::ECONNABORTED
+          return
+        end
+
+        connection = listener.connection_class.new(self, socket)
+        open(connection)
+        listener.block.call(connection) if listener.block && !connection.closed?
+
+        if data.nil?
+          close_connection(connection, false)
+        elsif !data.empty? && !connection.closed?
+          connection.on_data(data)
+        end
+      end
+    end
+
+    def ready(monitor, connection)
+      flush(connection) if monitor.writable? && connection.writes
+      return if connection.closed? || connection.closing || !monitor.readable?
+
+      begin
+        data = monitor.read_nonblock(@read_size, @buffer)
+      rescue Errno::EAGAIN, Errno::EWOULDBLOCK
+        return
+      rescue EOFError, IOError, SystemCallError
+        close_connection(connection, false)
+        return
+      end
+
+      connection.active_at = @now
+      connection.on_data(data)
+    end
+
+    # Write out as much of the queue as the socket will take
+    def flush(connection)
+      writes = connection.writes
+
+      until writes.empty?
+        data = writes.first
+
+        begin
+          written = connection.monitor.write_nonblock(data)
+        rescue Errno::EAGAIN, Errno::EWOULDBLOCK
+          return
+        rescue IOError, SystemCallError
+          close_connection(connection, false)
+          return
+        end
+
+        connection.active_at = @now
+        return writes[0] = rest(data, written) if written < data.bytesize
+        writes.shift
+      end
+
+      connection.writes = nil
+      connection.closing ? close_connection(connection, false) : watch(connection, :r)
+    end
+
+    # Change what a connection's monitor is interested in. The selector
+    # applies it at the next select, so a connection that fills its socket
+    # and drains it again within one round costs nothing
+    def watch(connection, interests)
+      connection.monitor.interests = interests
+    end
+
+    def sweep
+      @swept_at = @now
+      deadline = @now - @idle_timeout
+
+      @connections.keys.each do |connection|
+        close_connection(connection, false) if connection.active_at < deadline
+      end
+    end
+
+    # What's left of data after the first n bytes
+    def rest(data, n)
+      if data.respond_to? :byteslice
+        data.byteslice(n, data.bytesize - n)
+      else
+        data[n..-1]
+      end
+    end
+  end
+end
@@ -0,0 +1,106 @@
+module NIO
+  # Evens out load between several selectors by migrating monitors from the
+  # most lagged selector to the least lagged one (see Monitor#migrate_to).
+  # Call #rebalance every so often, e.g. from a timer thread
+  class Rebalancer
+    # The busiest selector's lag has to be this many times the idlest's
+    DEFAULT_RATIO = 2.0
+
+    # Don't bother moving anything unless the busiest selector lags by at
+    # least this many seconds
+    DEFAULT_MIN_LAG = 0.005
+
+    # Most monitors moved per #rebalance
+    DEFAULT_MAX_MOVES = 16
+
+    attr_reader :selectors
+
+    # Options are :ratio, :min_lag and :max_moves
+    def initialize(selectors, options = {})
+      @selectors = selectors
+      @ratio     = options[:ratio]     || DEFAULT_RATIO
+      @min_lag   = options[:min_lag]   || DEFAULT_MIN_LAG
+      @max_moves = options[:max_moves] || DEFAULT_MAX_MOVES
+
+      # Each monitor's event count as of the last call, for working out how
+      # busy it's been since. Only kept up to date with accounting on
+      @events = {}
+      @sampled_at = nil
+    end
+
+    # Move monitors from the most lagged selector to the least lagged one,
+    # if they're far enough apart. Enough monitors move to carry about half
+    # the difference in their event rates, busiest first when the selectors
+    # have accounting on. Returns the monitors that moved
+    def rebalance
+      rates = monitor_rates
+      stats = {}
+      @selectors.each { |selector| stats[selector] = selector.stats unless selector.closed? }
+      return [] if stats.size < 2
+
+      busiest = stats.keys.max_by { |selector| stats[selector][:lag] }
+      idlest  = stats.keys.min_by { |selector| stats[selector][:lag] }
+      high, low = stats[busiest][:lag], stats[idlest][:lag]
+      return [] if high < @min_lag || high < @ratio * low
+
+      candidates = busiest.monitors
+      return [] if candidates.empty?
+
+      # Without accounting, assume everything on the busiest selector is as
+      # busy as everything else on it. Before either selector has a full
+      # event rate window behind it, even out the monitor counts instead
+      if stats[busiest][:event_rate] > 0
+        average = stats[busiest][:event_rate] / candidates.size
+        excess  = (stats[busiest][:event_rate] - stats[idlest][:event_rate]) / 2
+      else
+        rates.clear
+        average = 1
+        excess  = (candidates.size - idlest.monitors.size) / 2
+      end
+      candidates = candidates.sort_by { |monitor| -rates.fetch(monitor, average) }
+
+      chosen = []
+      candidates.each do |monitor|
+        break if chosen.size >= @max_moves || excess <= 0
+
+        rate = rates.fetch(monitor, average)
+        next if rate > excess || monitor.closed?
+
+        chosen << monitor
+        excess -= rate
+      end
+      return [] if chosen.empty?
+
+      # Selectors blocked in select hold their locks, so hurry them along,
+      # then move everything in one go. Monitors closed while we weren't
+      # looking stay put
+      busiest.wakeup
+      idlest.wakeup
+      busiest.migrate(chosen, idlest)
+    end
+
+    private
+
+    # Events per second for each monitor with accounting on since the last
+    # call, and remember where they're at for the next one
+    def monitor_rates
+      now = Time.now
+      elapsed = @sampled_at && now - @sampled_at
+      @sampled_at = now
+
+      rates, events = {}, {}
+      @selectors.each do |selector|
+        next if selector.closed? || !selector.accounting?
+
+        selector.monitors.each do |monitor|
+          events[monitor] = monitor.events
+          previous = @events[monitor]
+          rates[monitor] = (monitor.events - previous) / elapsed if previous && elapsed && elapsed > 0
+        end
+      end
+
+      @events = events
+      rates
+    end
+  end
+end
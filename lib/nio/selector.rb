@@ -1,13 +1,73 @@
 module NIO
   # Selectors monitor IO objects for events of interest
   class Selector
-    # Create a new NIO::Selector
-    def initialize
+    # Consecutive samples over the threshold before a client counts as slow
+    SLOW_CLIENT_SAMPLES = 2
+
+    # How long a throttled slow client stops reading after an event it isn't
+    # sampled on
+    SLOW_CLIENT_PAUSE = 0.01
+
+    # Most recycled monitors a selector holds onto
+    MONITOR_POOL_SIZE = 1024
+
+    # Buckets in the receive latency histogram. The last one catches
+    # everything over 2**30 microseconds
+    LATENCY_BUCKETS = 32
+
+    # How close to its limits the heap gets before idle time goes to the GC
+    IDLE_GC_RATIO = 0.9
+
+    # Weight of each new sample in the lag moving average
+    LAG_SMOOTHING = 0.1
+
+    # Shortest window the event rate is measured over, in seconds
+    EVENT_RATE_WINDOW = 1.0
+
+    # What GC.stat has to report for #gc_when_idle= to work
+    IDLE_GC_STATS = [
+      :old_objects, :old_objects_limit, :oldmalloc_increase_bytes, :oldmalloc_increase_bytes_limit,
+      :malloc_increase_bytes, :malloc_increase_bytes_limit, :heap_free_slots, :heap_available_slots
+    ]
+
+    # :nodoc: monitors sharing a weighted slice of the event budget
+    Group = Struct.new(:key, :weight, :monitors, :events, :deficit, :pending)
+
+    # Create a new NIO::Selector. Pipelined polling (:pipelined => true)
+    # needs a native poller thread, which only the C extension has
+    def initialize(options = {})
+      if options[:pipelined]
+        raise NotImplementedError, "pipelined selectors aren't supported by the pure Ruby backend"
+      end
+
+      if options[:backend] && options[:backend] != :select
+        raise NotImplementedError, "the pure Ruby backend only polls with select"
+      end
+
       @selectables = {}
       @lock = Mutex.new
+      @lock_owner = nil
+      @interest_arrays = nil
+      @slow_threshold = @tcp_sample = nil
+      @free_monitors = []
+      @pool_hits = @pool_misses = 0
+      @accounting = false
+      @throttled = []
+      @event_budget = @next_group = nil
+      @groups = {}
+      @receive_latency = Array.new(LATENCY_BUCKETS, 0)
+      @gc_when_idle = false
+      @idle_gc_minor = @idle_gc_major = 0
+      @lag = @event_rate = 0.0
+      @polls = 0
+      @dirty = {}
+      @interest_changes = @interest_updates = 0
+      @waited_at = @window_started_at = nil
+      @window_events = 0
 
-      # Other threads can wake up a selector
-      @wakeup, @waker = IO.pipe
+      # Other threads can wake up a selector. The pipe is created on first use
+      @wakeup = @waker = nil
+      @wakeup_lock = Mutex.new
       @closed = false
     end
 
@@ -16,12 +76,44 @@ module NIO
     # * :r - is the IO readable?
     # * :w - is the IO writeable?
     # * :rw - is the IO either readable or writeable?
-    def register(io, interest)
-      @lock.synchronize do
+    #
+    # Passing :reuse => true takes a monitor released with Monitor#recycle
+    # rather than allocating a new one, if any are available. Monitors
+    # registered with the same :group share the event budget according to
+    # the group's :weight
+    def register(io, interest, options = nil)
+      if options && options[:weight] && options[:weight] <= 0
+        raise ArgumentError, "weight must be positive"
+      end
+
+      if options && (options[:edge_triggered] || options[:oneshot] || options[:exclusive])
+        raise NotImplementedError, "only the epoll engine registers edge-triggered, oneshot or exclusive monitors"
+      end
+
+      synchronize do
         raise ArgumentError, "this IO is already registered with the selector" if @selectables[io]
+        raise IOError, "selector is closed" if @closed
+
+        if options && options[:reuse]
+          if monitor = @free_monitors.pop
+            @pool_hits += 1
+            monitor.send(:initialize, io, interest, self)
+          else
+            @pool_misses += 1
+          end
+        end
+
+        monitor ||= Monitor.new(io, interest, self)
+
+        if options && (!options[:group].nil? || options[:weight])
+          group = group(options[:group])
+          group.weight = options[:weight] if options[:weight]
+          group.monitors += 1
+          monitor.membership = group
+        end
 
-        monitor = Monitor.new(io, interest, self)
         @selectables[io] = monitor
+        @interest_arrays = nil
 
         monitor
       end
@@ -29,8 +121,9 @@ module NIO
 
     # Deregister the given IO object from the selector
     def deregister(io)
-      @lock.synchronize do
+      synchronize do
         monitor = @selectables.delete io
+        @interest_arrays = nil
         monitor.close(false) if monitor and not monitor.closed?
         monitor
       end
@@ -38,68 +131,151 @@ module NIO
 
     # Is the given IO object registered with the selector?
     def registered?(io)
-      @lock.synchronize { @selectables.has_key? io }
+      synchronize { @selectables.has_key? io }
+    end
+
+    # Monitors for all registered IO objects
+    def monitors
+      synchronize { @selectables.values }
     end
 
     # Select which monitors are ready
     def select(timeout = nil)
-      @lock.synchronize do
-        readers, writers = [@wakeup], []
+      synchronize do
+        raise IOError, "selector is closed" if @closed
+        deadline = Time.now + timeout if timeout && !@throttled.empty?
+        @lag += LAG_SMOOTHING * (Time.now - @waited_at - @lag) if @waited_at
 
-        @selectables.each do |io, monitor|
-          readers << io if monitor.interests == :r || monitor.interests == :rw
-          writers << io if monitor.interests == :w || monitor.interests == :rw
+        ready_readers = ready_writers = nil
+        collected = false
+
+        loop do
+          wait = resume_throttled(timeout, deadline)
+          flush_interests
+          readers, writers = interest_arrays
+
+          # Before giving idle time to the GC, find out without blocking
+          # whether anything is ready, which means we aren't idle after all
+          if @gc_when_idle && wait != 0 && !collected && (due = idle_gc_due)
+            ready_readers, ready_writers = Kernel.select readers, writers, [], 0
+            @polls += 1
+
+            unless ready_readers
+              idle_gc(due)
+              collected = true
+              deadline ||= Time.now + timeout if timeout
+              next
+            end
+          else
+            ready_readers, ready_writers = Kernel.select readers, writers, [], wait
+            @polls += 1
+          end
+
+          if ready_readers
+            # Leave out monitors still waiting for enough bytes to arrive
+            ready_readers.reject! do |io|
+              monitor = @selectables[io]
+              if monitor && monitor.short_read?
+                throttle(monitor)
+                true
+              end
+            end
+
+            if ready_readers.empty? && ready_writers.empty?
+              ready_readers = nil
+              deadline ||= Time.now + timeout if timeout
+              next
+            end
+          end
+
+          # Go around again if we only woke up to resume rate limited monitors
+          break if ready_readers || wait == timeout || (deadline && Time.now >= deadline)
         end
 
-        ready_readers, ready_writers = Kernel.select readers, writers, [], timeout
-        return unless ready_readers # timeout or wakeup
+        sample_load(ready_readers ? ready_readers.size + ready_writers.size : 0)
+        return unless ready_readers # timeout
+
+        # Classify readiness in a single pass over the results
+        readiness = {}
+        ready_readers.each { |io| readiness[io] = :r }
+        ready_writers.each { |io| readiness[io] = readiness[io] ? :rw : :w }
+
+        if readiness.delete(@wakeup)
+          # Clear all wakeup signals we've received by reading them
+          # Wakeups should have level triggered behavior
+          begin
+            # Loop until we've drained all incoming events
+            loop { @wakeup.read_nonblock(1024) }
+          rescue Errno::EWOULDBLOCK
+          end
+
+          return
+        end
 
         if block_given?
           result = 0
         else
           result = []
         end
+        deferred, queued = [], []
+        now = Time.now.to_f if @accounting
 
-        ready_readers.each do |io|
-          if io == @wakeup
-            # Clear all wakeup signals we've received by reading them
-            # Wakeups should have level triggered behavior
-            begin
-              @wakeup.read_nonblock(1024)
+        readiness.each do |io, ready|
+          # An earlier handler may have migrated it
+          next unless (monitor = @selectables[io])
 
-              # Loop until we've drained all incoming events
-              redo
-            rescue Errno::EWOULDBLOCK
-            end
+          monitor.readiness = ready
+
+          if @accounting
+            monitor.events += 1
+            monitor.last_activity = now
+          end
+
+          next unless dispatchable?(monitor, deferred)
+
+          # With an event budget, monitors wait for their group's turn
+          if @event_budget
+            group = monitor.membership || @groups[nil]
+            queued << group if group.pending.empty?
+            group.pending << monitor
+            next
+          end
 
-            return
+          monitor.membership.events += 1 if monitor.membership
+
+          if block_given?
+            handle(monitor) { yield monitor }
+            result += 1
           else
-            monitor = @selectables[io]
-            monitor.readiness = :r
-
-            if block_given?
-              yield monitor
-              result += 1
-            else
-              result << monitor
-            end
+            result << stamp(monitor)
           end
         end
 
-        ready_readwriters = ready_readers & ready_writers
-        ready_writers = ready_writers - ready_readwriters
+        share_budget(queued) do |monitor|
+          if block_given?
+            handle(monitor) { yield monitor }
+            result += 1
+          else
+            result << stamp(monitor)
+          end
+        end
 
-        [[ready_writers, :w], [ready_readwriters, :rw]].each do |ios, readiness|
-          ios.each do |io|
-            monitor = @selectables[io]
-            monitor.readiness = readiness
+        # Monitors held back by the slow client policy go last
+        deferred.each do |monitor|
+          next unless monitor.selector.equal?(self)
 
-            if block_given?
-              yield monitor
-              result += 1
-            else
-              result << monitor
-            end
+          if @slow_action == :timeout
+            # We already hold the lock, so deregister by hand
+            @selectables.delete monitor.io
+            @interest_arrays = nil
+            monitor.close(false)
+          end
+
+          if block_given?
+            handle(monitor) { yield monitor }
+            result += 1
+          else
+            result << stamp(monitor)
           end
         end
 
@@ -107,6 +283,206 @@ module NIO
       end
     end
 
+    # Configure what happens to clients whose kernel send queue stays above
+    # threshold bytes:
+    # * :demote - dispatch them after all other ready monitors
+    # * :throttle - only dispatch the reads they're sampled on, pausing
+    #   reads briefly instead of dispatching the others
+    # * :timeout - close their monitors and dispatch them one last time
+    #
+    # Send queues are sampled once every interval events per monitor. Passing
+    # nil as the threshold disables the policy
+    def slow_client_policy(threshold, action = :demote, interval = 64)
+      if threshold.nil?
+        @slow_threshold = nil
+        return
+      end
+
+      raise ArgumentError, "threshold must be positive" unless threshold > 0
+      raise ArgumentError, "sample interval must be positive" unless interval > 0
+      unless [:demote, :throttle, :timeout].include? action
+        raise ArgumentError, "invalid slow client action #{action.inspect} (must be :demote, :throttle, or :timeout)"
+      end
+
+      @slow_threshold, @slow_action, @slow_interval = threshold, action, interval
+      nil
+    end
+
+    # Counters describing what the selector has been up to
+    def stats
+      synchronize do
+        requests = @pool_hits + @pool_misses
+
+        {
+          :monitor_pool_size      => @free_monitors.size,
+          :monitor_pool_hits      => @pool_hits,
+          :monitor_pool_misses    => @pool_misses,
+          :monitor_pool_hit_ratio => requests > 0 ? @pool_hits.to_f / requests : 0.0,
+          :idle_gc_minor          => @idle_gc_minor,
+          :idle_gc_major          => @idle_gc_major,
+          :lag                    => @lag,
+          :event_rate             => @event_rate,
+          :polls                  => @polls,
+          :interest_changes       => @interest_changes,
+          :interest_updates       => @interest_updates
+        }
+      end
+    end
+
+    # Turn per-monitor accounting on or off. Monitors keep their counters
+    # while it's off, but they stop being updated
+    attr_writer :accounting
+
+    # Is per-monitor accounting on?
+    def accounting?; @accounting end
+
+    # The n heaviest monitors by the given metric: :handler_time (the
+    # default), :events, :bytes_read, :bytes_written, :bytes or
+    # :last_activity
+    def top(n, options = nil)
+      by = (options && options[:by]) || :handler_time
+      unless [:handler_time, :events, :bytes_read, :bytes_written, :bytes, :last_activity].include? by
+        raise ArgumentError, "invalid metric #{by}"
+      end
+
+      monitors.sort_by do |monitor|
+        if by == :bytes
+          -(monitor.bytes_read + monitor.bytes_written)
+        else
+          -(monitor.send(by) || 0)
+        end
+      end.first(n)
+    end
+
+    # Cap how many events each select dispatches, sharing them between
+    # groups of monitors in proportion to their weights. nil lifts the cap
+    def event_budget=(budget)
+      if budget
+        raise ArgumentError, "event budget must be positive" unless budget > 0
+
+        # Ungrouped monitors need somewhere to wait their turn
+        group(nil)
+      end
+
+      @event_budget = budget
+    end
+
+    # Most events dispatched per select, or nil if there's no limit
+    attr_reader :event_budget
+
+    # Weight, registered monitors and events dispatched for each group
+    def group_stats
+      synchronize do
+        stats = {}
+        @groups.each do |key, group|
+          stats[key] = { :weight => group.weight, :monitors => group.monitors, :events => group.events }
+        end
+        stats
+      end
+    end
+
+    # Histogram of how long timestamped reads waited between the kernel
+    # receiving them and the selector dispatching their monitor, with the
+    # sample count and estimated percentiles. Buckets are keyed by their
+    # upper bound in seconds
+    def receive_latency
+      counts = @receive_latency.dup
+      samples = counts.inject(0) { |sum, count| sum + count }
+      result = { :samples => samples, :p50 => nil, :p99 => nil, :histogram => {} }
+      seen = 0
+
+      counts.each_with_index do |count, bucket|
+        next if count == 0
+
+        upper_bound = (1 << bucket) / 1e6
+        result[:histogram][upper_bound] = count
+
+        seen += count
+        result[:p50] ||= upper_bound if seen * 2 >= samples
+        result[:p99] ||= upper_bound if seen * 100 >= samples * 99
+      end
+
+      result
+    end
+
+    # Does a native poller thread wait for this selector's events?
+    def pipelined?
+      false
+    end
+
+    # The system call used to poll: always Kernel.select here
+    def backend
+      :select
+    end
+
+    # Run collections that are coming due while the selector has nothing
+    # else to do, instead of letting them land in the middle of handling a
+    # burst
+    def gc_when_idle=(enabled)
+      if enabled
+        stat = GC.respond_to?(:stat) ? GC.stat : {}
+        missing = IDLE_GC_STATS.find { |key| !stat.key?(key) }
+        raise NotImplementedError, "GC.stat doesn't report #{missing} on this Ruby" if missing
+      end
+
+      @gc_when_idle = !!enabled
+    end
+
+    def gc_when_idle?; @gc_when_idle end
+
+    # :nodoc: add a timestamped read's latency to the histogram
+    def record_receive_latency(seconds)
+      microseconds = seconds * 1e6
+      bucket = 0
+      bucket += 1 while bucket < LATENCY_BUCKETS - 1 && microseconds >= (1 << bucket)
+      @receive_latency[bucket] += 1
+    end
+
+    # :nodoc: stop selecting a monitor for reads until it resumes, either
+    # because its rate limit's bucket refilled or because enough bytes have
+    # arrived. Called from Monitor#read_nonblock, possibly from inside
+    # select's block
+    def throttle(monitor)
+      synchronize do
+        @throttled << monitor
+        @interest_arrays = nil
+      end
+    end
+
+    # :nodoc: take a closing monitor out of its group. Called from
+    # Monitor#close, possibly from inside select's block
+    def leave_group(monitor)
+      synchronize { release_membership(monitor) }
+    end
+
+    # :nodoc: a monitor's interests changed from previous. The select
+    # arrays are rebuilt once, at the start of the next select, however
+    # many changes there were. Called from Monitor#interests=, possibly
+    # while we hold the lock, so it doesn't take it
+    def interests_changed(monitor, previous)
+      @interest_changes += 1
+
+      # Keep the interests the select arrays were built with
+      @dirty[monitor] = previous unless @dirty.key?(monitor)
+    end
+
+    # Watch for process pid to exit. Returns a monitor that turns readable
+    # once it has, and whose #reap returns its Process::Status. Here a
+    # thread per process waits for it, since there are no pidfds
+    def watch_process(pid)
+      waiter = ProcessWaiter.new(pid)
+      monitor = register(waiter.reader, :r)
+      monitor.process_waiter = waiter
+      monitor
+    end
+
+    # :nodoc: take back a closed monitor for reuse
+    def recycle(monitor)
+      synchronize do
+        @free_monitors << monitor if !@closed && @free_monitors.size < MONITOR_POOL_SIZE
+      end
+    end
+
     # Wake up a thread that's in the middle of selecting on this selector, if
     # any such thread exists.
     #
@@ -115,22 +491,396 @@ module NIO
     # level-triggered behavior.
     def wakeup
       # Send the selector a signal in the form of writing data to a pipe
-      @waker << "\0"
+      wakeup_pipe.last << "\0"
       nil
     end
 
-    # Close this selector and free its resources
-    def close
-      @lock.synchronize do
+    # Deregister every IO object so the selector can be reused. Unlike close,
+    # this keeps the wakeup pipe open
+    def reset
+      synchronize do
+        raise IOError, "selector is closed" if @closed
+
+        monitors = @selectables.values
+        @selectables.clear
+        @interest_arrays = nil
+        @dirty.clear
+        @slow_threshold = nil
+        @throttled.clear
+        monitors.each { |monitor| monitor.close(false) }
+        @groups.clear
+        @event_budget = @next_group = nil
+        @receive_latency.fill(0)
+
+        # Swallow any wakeups nobody selected for
+        begin
+          loop { @wakeup.read_nonblock(1024) } if @wakeup
+        rescue Errno::EWOULDBLOCK, EOFError
+        end
+      end
+
+      self
+    end
+
+    # Close this selector and free its resources. Every monitor is closed
+    # along with it. If close_ios is true, the registered IO objects are
+    # closed too
+    def close(close_ios = false)
+      synchronize do
         return if @closed
 
-        @wakeup.close rescue nil
-        @waker.close rescue nil
+        @wakeup_lock.synchronize do
+          @wakeup.close rescue nil if @wakeup
+          @waker.close rescue nil if @waker
+        end
         @closed = true
+
+        monitors = @selectables.values
+        @selectables.clear
+        @free_monitors.clear
+        @throttled.clear
+        @groups.clear
+        @next_group = nil
+        @interest_arrays = nil
+        @dirty.clear
+
+        monitors.each do |monitor|
+          monitor.close(false)
+          monitor.io.close if close_ios && !monitor.io.closed?
+        end
       end
+
+      nil
     end
 
     # Is this selector closed?
     def closed?; @closed end
+
+    # Move monitors to another selector (see Monitor#migrate_to), locking
+    # both selectors once for the lot. Monitors closed or moved elsewhere
+    # in the meantime are skipped. Returns the monitors that moved
+    def migrate(monitors, other)
+      raise TypeError, "can't migrate a monitor to #{other.inspect}" unless other.is_a?(Selector)
+      return [] if other.equal?(self)
+
+      # Lock in a fixed order so two selectors trading monitors can't deadlock
+      first, second = __id__ < other.__id__ ? [self, other] : [other, self]
+      first.synchronize do
+        second.synchronize do
+          monitors.select do |monitor|
+            next false unless @selectables[monitor.io].equal?(monitor)
+
+            other.adopt(monitor) do
+              @selectables.delete(monitor.io)
+              @interest_arrays = nil
+              @throttled.delete(monitor)
+
+              # Nothing here may dispatch it once it's gone
+              group = monitor.membership || @groups[nil]
+              group.pending.delete(monitor) if group
+              release_membership(monitor)
+            end
+
+            true
+          end
+        end
+      end
+    end
+
+    protected
+
+    # Hold the lock, unless this thread already does: monitors call back into
+    # the selector from inside select's block
+    def synchronize
+      return yield if @lock_owner == Thread.current
+
+      @lock.synchronize do
+        begin
+          @lock_owner = Thread.current
+          yield
+        ensure
+          @lock_owner = nil
+        end
+      end
+    end
+
+    # :nodoc: take over a monitor from another selector. The block takes it
+    # off the other selector, returning the group it was in
+    def adopt(monitor)
+      synchronize do
+        raise IOError, "selector is closed" if @closed
+        raise ArgumentError, "this IO is already registered with the selector" if @selectables[monitor.io]
+
+        membership = yield
+        @selectables[monitor.io] = monitor
+        @interest_arrays = nil
+        monitor.selector = self
+
+        # Reads stay paused if they were
+        @throttled << monitor if monitor.paused?
+
+        # A group this selector doesn't have yet keeps its weight
+        if membership
+          group = group(membership.key)
+          group.weight = membership.weight if group.monitors == 0
+          group.monitors += 1
+          monitor.membership = group
+        end
+      end
+    end
+
+    private
+
+    # Arrays of IO objects to pass to Kernel.select. These are only rebuilt
+    # when the set of registered IO objects changes
+    def interest_arrays
+      @interest_arrays ||= begin
+        readers, writers = [wakeup_pipe.first], []
+
+        @selectables.each do |io, monitor|
+          readers << io if (monitor.interests == :r || monitor.interests == :rw) && !monitor.paused?
+          writers << io if monitor.interests == :w || monitor.interests == :rw
+        end
+
+        [readers, writers]
+      end
+    end
+
+    # Apply the interest changes made since the last select: one update
+    # per monitor, however many times its interests changed, and none at
+    # all if they changed back
+    def flush_interests
+      return if @dirty.empty?
+      dirty, @dirty = @dirty, {}
+
+      dirty.each do |monitor, previous|
+        next if monitor.closed? || monitor.interests == previous || !monitor.selector.equal?(self)
+
+        @interest_arrays = nil
+        @interest_updates += 1
+      end
+    end
+
+    # Give rate limited monitors whose buckets have refilled their read
+    # interest back. Returns how long to wait for: the given timeout, or
+    # less if a monitor needs resuming sooner
+    def resume_throttled(timeout, deadline)
+      return remaining(timeout, deadline) if @throttled.empty?
+
+      now = Time.now
+      resumed = @throttled.select { |monitor| monitor.resume(now) }
+      unless resumed.empty?
+        @throttled -= resumed
+        @interest_arrays = nil
+      end
+
+      return remaining(timeout, deadline) if @throttled.empty?
+
+      wait = @throttled.map { |monitor| monitor.resume_at }.min - now
+      wait = deadline - now if deadline && deadline - now < wait
+      wait < 0 ? 0 : wait
+    end
+
+    # Select's wait just ended with ready events. Lag runs from here until
+    # the next select, and the events count towards the current window
+    def sample_load(ready)
+      now = Time.now
+      @waited_at = now
+      @window_events += ready
+
+      if !@window_started_at
+        @window_started_at = now
+      elsif now - @window_started_at >= EVENT_RATE_WINDOW
+        @event_rate = @window_events / (now - @window_started_at)
+        @window_events = 0
+        @window_started_at = now
+      end
+    end
+
+    # Time left before the deadline, if there is one
+    def remaining(timeout, deadline)
+      return timeout unless deadline
+
+      wait = deadline - Time.now
+      wait < 0 ? 0 : wait
+    end
+
+    # Is the GC close to collecting? Old objects or old malloc growth near
+    # their limits mean a major collection is on its way, and a minor one is
+    # near once the heap is almost out of free slots or malloc growth is
+    # near its limit
+    def idle_gc_due
+      if GC.stat(:old_objects) >= IDLE_GC_RATIO * GC.stat(:old_objects_limit) ||
+         GC.stat(:oldmalloc_increase_bytes) >= IDLE_GC_RATIO * GC.stat(:oldmalloc_increase_bytes_limit)
+        :major
+      elsif GC.stat(:heap_free_slots) < (1 - IDLE_GC_RATIO) * GC.stat(:heap_available_slots) ||
+            GC.stat(:malloc_increase_bytes) >= IDLE_GC_RATIO * GC.stat(:malloc_increase_bytes_limit)
+        :minor
+      end
+    end
+
+    # Leave sweeping to be done lazily as objects are allocated. Only
+    # marking has to happen all at once
+    def idle_gc(due)
+      GC.start(:full_mark => due == :major, :immediate_sweep => false)
+
+      if due == :major
+        @idle_gc_major += 1
+      else
+        @idle_gc_minor += 1
+      end
+    end
+
+    # Find or create the group with the given key. Ungrouped monitors share
+    # the group whose key is nil
+    def group(key)
+      @groups[key] ||= Group.new(key, 1, 0, 0, 0, [])
+    end
+
+    # Take a monitor out of its group, returning the group
+    def release_membership(monitor)
+      group = monitor.membership
+      return unless group
+
+      monitor.membership = nil
+      group.monitors -= 1
+      release_group(group)
+      group
+    end
+
+    # Forget a group once its last monitor has left and none are waiting for
+    # its turn. Ungrouped monitors always share the group whose key is nil
+    def release_group(group)
+      return unless group.monitors == 0 && group.pending.empty? && !group.key.nil?
+
+      @groups.delete(group.key) if @groups[group.key].equal?(group)
+      @next_group = nil if @next_group.equal?(group)
+    end
+
+    # Deficit round robin: each round, every group with monitors waiting
+    # earns its weight in events and spends it dispatching them, until the
+    # budget runs out. Groups cut short keep their credit for the next
+    # select. Monitors that don't get a turn are still ready, so the next
+    # select picks them up again
+    def share_budget(active)
+      return if active.empty?
+      queued, budget = active, @event_budget
+
+      # Pick up the round where the last select left off
+      if @next_group && (i = active.index { |group| group.equal? @next_group })
+        active = active[i..-1] + active[0...i]
+      end
+      @next_group = nil
+
+      until active.empty? || budget == 0
+        waiting = []
+
+        active.each do |group|
+          if budget == 0
+            # Missed out on this round, so go first next select
+            @next_group ||= group
+            next
+          end
+
+          group.deficit += group.weight
+          while group.deficit > 0 && budget > 0 && (monitor = group.pending.shift)
+            # An earlier handler may have closed it
+            next if monitor.closed?
+
+            group.deficit -= 1
+            group.events += 1
+            budget -= 1
+            yield monitor
+          end
+
+          if group.pending.empty?
+            # Idle groups don't get to bank credit
+            group.deficit = 0
+          else
+            waiting << group
+          end
+        end
+
+        active = waiting
+      end
+    ensure
+      if queued
+        queued.each do |group|
+          group.pending.clear
+
+          # Its last monitors may have left while they waited
+          release_group(group)
+        end
+      end
+    end
+
+    # Note when a monitor was handed out, for receive latency measurements
+    def stamp(monitor)
+      monitor.dispatched_at = Time.now.to_f if monitor.receive_timestamps?
+      monitor
+    end
+
+    # Run the select block for a monitor, timing it if accounting is on
+    def handle(monitor)
+      stamp(monitor)
+      return yield unless @accounting
+
+      started_at = Time.now
+      begin
+        yield
+      ensure
+        monitor.handler_time += Time.now - started_at
+      end
+    end
+
+    # The wakeup pipe, created the first time it's needed
+    def wakeup_pipe
+      @wakeup_lock.synchronize do
+        raise IOError, "selector is closed" if @closed
+        @wakeup, @waker = IO.pipe unless @waker
+        [@wakeup, @waker]
+      end
+    end
+
+    # Apply the slow client policy to a ready monitor. Returns true if it
+    # should be dispatched right away
+    def dispatchable?(monitor, deferred)
+      return true unless @slow_threshold
+
+      sampled = false
+      if (monitor.sample_countdown -= 1) <= 0
+        monitor.sample_countdown = @slow_interval
+        sampled = true
+
+        begin
+          queued = monitor.tcp_info(@tcp_sample ||= TCPInfo.new).notsent_bytes
+        rescue StandardError, NotImplementedError
+          queued = nil
+        end
+
+        if queued && queued > @slow_threshold
+          monitor.slow_samples += 1
+        else
+          monitor.slow_samples = 0
+        end
+      end
+
+      return true unless monitor.slow?
+
+      if @slow_action == :throttle
+        return true if sampled || !monitor.readable?
+
+        # Pause reads rather than skipping the event, which select would
+        # just report again
+        monitor.pause_reads(SLOW_CLIENT_PAUSE)
+        return false unless monitor.writable?
+
+        monitor.readiness = :w
+        return true
+      end
+
+      deferred << monitor
+      false
+    end
   end
 end
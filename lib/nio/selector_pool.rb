@@ -0,0 +1,87 @@
+module NIO
+  # A pool of selectors for code that needs lots of short-lived ones. Pooled
+  # selectors are reset rather than closed when they're checked back in, so
+  # their event loops and wakeup pipes get reused
+  class SelectorPool
+    # How many idle selectors are kept by default
+    DEFAULT_SIZE = 16
+
+    # Maximum number of idle selectors kept around
+    attr_reader :size
+
+    # Create a pool which keeps at most size idle selectors
+    def initialize(size = DEFAULT_SIZE)
+      raise ArgumentError, "size must be positive" unless size > 0
+
+      @size = size
+      @selectors = []
+      @lock = Mutex.new
+    end
+
+    # Take a selector out of the pool, creating one if none are idle
+    def checkout
+      @lock.synchronize { @selectors.pop } || Selector.new
+    end
+
+    # Return a selector to the pool. Anything still registered with it is
+    # deregistered. Selectors beyond the pool's size are closed
+    def checkin(selector)
+      return if selector.closed?
+      selector.reset
+
+      @lock.synchronize do
+        if @selectors.size < @size
+          @selectors << selector
+          return
+        end
+      end
+
+      selector.close
+      nil
+    end
+
+    # Check out a selector for the duration of the given block
+    def with
+      selector = checkout
+
+      begin
+        yield selector
+      ensure
+        checkin selector
+      end
+    end
+
+    # Number of idle selectors in the pool
+    def idle
+      @lock.synchronize { @selectors.size }
+    end
+
+    # Close all idle selectors
+    def close
+      selectors = @lock.synchronize do
+        idle, @selectors = @selectors, []
+        idle
+      end
+
+      selectors.each { |selector| selector.close }
+      nil
+    end
+  end
+
+  class Selector
+    POOL_LOCK = Mutex.new
+
+    # A process-wide selector pool. Forked children get a fresh pool, since
+    # they'd otherwise share their parent's event loops
+    def self.pool
+      POOL_LOCK.synchronize do
+        if @pool.nil? || @pool_pid != Process.pid
+          @pool = SelectorPool.new
+          @pool_pid = Process.pid
+        end
+
+        @pool
+      end
+    end
+  end
+end
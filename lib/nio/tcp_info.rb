@@ -0,0 +1,10 @@
+module NIO
+  # TCP statistics sampled from the kernel by NIO::Monitor#tcp_info
+  # * rtt: smoothed round trip time in microseconds
+  # * unacked: segments sent but not yet acknowledged
+  # * notsent_bytes: bytes queued in the kernel but not yet sent
+  # * delivery_rate: most recent delivery rate in bytes per second
+  #
+  # Fields the kernel doesn't report are nil
+  TCPInfo = Struct.new(:rtt, :unacked, :notsent_bytes, :delivery_rate)
+end
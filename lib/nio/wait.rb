@@ -0,0 +1,26 @@
+module NIO
+  # Wait up to timeout seconds (forever if nil) for io to be ready for
+  # interests (:r, :w or :rw) without going through a selector. Returns
+  # :r, :w or :rw as it is, or nil on timeout
+  def self.wait(io, interests, timeout = nil)
+    raise ArgumentError, "time interval must be positive" if timeout && timeout < 0
+
+    case interests
+    when :r  then readers, writers = [io], nil
+    when :w  then readers, writers = nil, [io]
+    when :rw then readers, writers = [io], [io]
+    else raise ArgumentError, "invalid event type #{interests.inspect} (must be :r, :w, or :rw)"
+    end
+
+    readable, writable = Kernel.select(readers, writers, nil, timeout)
+    return unless readable
+
+    if readable.empty?
+      :w
+    elsif writable.empty?
+      :r
+    else
+      :rw
+    end
+  end
+end
@@ -0,0 +1,55 @@
+require 'spec_helper'
+
+describe "NIO::Selector registration handoff" do
+  let(:pair)     { UNIXSocket.pair }
+  let(:sender)   { NIO::Selector.new }
+  let(:receiver) { NIO::Selector.new }
+  let(:pipes)    { IO.pipe }
+  let(:reader)   { pipes.first }
+  let(:writer)   { pipes.last }
+  let(:server)   { TCPServer.new("127.0.0.1", 0) }
+  let(:extra)    { [] }
+
+  after do
+    sender.close
+
+    # Imported IOs are new descriptors of their own
+    receiver.close(true)
+    (pair + pipes + extra).each { |io| io.close unless io.closed? }
+    server.close unless server.closed?
+  end
+
+  it "hands registered IO objects and their interests to another selector" do
+    sender.register(reader, :r).value = "reader"
+    sender.register(server, :r).value = "server"
+
+    sender.export_registrations(pair.first) { |monitor| monitor.value }.should == 2
+
+    tokens = {}
+    monitors = receiver.import_registrations(pair.last) { |monitor, token| tokens[token] = monitor }
+    monitors.size.should == 2
+
+    tokens["server"].io.should be_a TCPServer
+    tokens["server"].io.local_address.ip_port.should == server.local_address.ip_port
+    tokens["reader"].interests.should == :r
+
+    writer << "ohai"
+    receiver.select(0).should include tokens["reader"]
+  end
+
+  it "hands off more IO objects than fit in a single message" do
+    batch = (NIO::Selector::HANDOFF_BATCH_SIZE + 1).times.map { IO.pipe }
+    extra.concat batch.flatten
+    ios = batch.map { |pipe| pipe.first }
+    ios.each { |io| sender.register(io, :r) }
+
+    exporter = Thread.new { sender.export_registrations(pair.first) }
+    receiver.import_registrations(pair.last).size.should == ios.size
+    exporter.value.should == ios.size
+  end
+
+  it "only sends Strings as tokens" do
+    sender.register(reader, :r)
+    expect { sender.export_registrations(pair.first) { |monitor| [:state] } }.to raise_error(TypeError)
+  end
+end
@@ -0,0 +1,125 @@
+require 'spec_helper'
+
+# Steady state costs of the hot paths: Ruby objects allocated and kernel
+# polls made per operation. If one of these goes up, something started
+# doing more work per event than it used to. Only raise a budget on purpose.
+#
+# This covers what runs per event and per handler call. Setting things up
+# (registering, configuring selectors and monitors, stats) allocates by
+# design and isn't budgeted
+describe "NIO hot paths" do
+  let(:pipes)    { IO.pipe }
+  let(:reader)   { pipes.first }
+  let(:writer)   { pipes.last }
+  let(:idle)     { IO.pipe }
+  let(:selector) { NIO::Selector.new }
+  let(:monitor)  { selector.register(reader, :r) }
+  let(:sink)     { IO.pipe }
+  let(:outbox)   { selector.register(sink.last, :r) }
+  let(:reuse)    { { :reuse => true }.freeze }
+
+  after do
+    selector.close
+    (pipes + idle + sink).each { |io| io.close unless io.closed? }
+  end
+
+  # Operations that run over and over in a server's event loop. The reader
+  # is left readable throughout, so selecting it always finds it ready
+  let(:operations) do
+    {
+      :select_block  => lambda { selector.select { |m| m } },
+      :select_array  => lambda { selector.select },
+      :select_ready  => lambda { selector.select(0) { |m| m } },
+      :wakeup        => lambda { selector.wakeup; selector.select(1) { |m| m } },
+      :readiness     => lambda { monitor.readiness; monitor.readable?; monitor.writable? },
+      :value         => lambda { monitor.value = 1; monitor.value },
+      :registered    => lambda { selector.registered?(reader) },
+      :recycle       => lambda { selector.register(idle.first, :r, reuse).recycle },
+      :read_nonblock  => lambda { writer.write_nonblock("x"); monitor.read_nonblock(1) },
+      :write_nonblock => lambda { outbox.write_nonblock("x"); sink.first.read_nonblock(1) },
+      :wait           => lambda { NIO.wait(reader, :r, 0) },
+      :interests      => lambda { monitor.interests = :rw; monitor.interests = :r },
+      :counters       => lambda { monitor.bytes_read; monitor.bytes_written; monitor.events },
+      :state          => lambda { monitor.closed?; monitor.throttled?; monitor.selector }
+    }
+  end
+
+  # Most objects allocated per operation, by engine. Selecting without a
+  # block allocates the array it returns, and reading or writing allocates a
+  # literal and the string read. The pure Ruby engine's counts vary between
+  # Ruby versions, so its budgets leave some headroom
+  let(:allocation_budgets) do
+    {
+      "libev" => {
+        :select_block => 0, :select_array => 1, :select_ready => 0, :wakeup => 0,
+        :readiness => 0, :value => 0, :registered => 0, :recycle => 0, :read_nonblock => 2,
+        :write_nonblock => 2, :wait => 0, :interests => 0, :counters => 0, :state => 0
+      },
+      "select" => {
+        :select_block => 14, :select_array => 15, :select_ready => 14, :wakeup => 24,
+        :readiness => 0, :value => 0, :registered => 0, :recycle => 0, :read_nonblock => 4,
+        :write_nonblock => 4, :wait => 7, :interests => 0, :counters => 0, :state => 0
+      }
+    }
+  end
+
+  # Kernel polls per operation, the same for every engine
+  let(:poll_budgets) do
+    {
+      :select_block => 1, :select_array => 1, :select_ready => 1, :wakeup => 1,
+      :readiness => 0, :value => 0, :registered => 0, :recycle => 0, :read_nonblock => 0,
+      :write_nonblock => 0, :wait => 0, :interests => 0, :counters => 0, :state => 0
+    }
+  end
+
+  let(:iterations) { 100 }
+
+  before do
+    monitor
+    outbox
+    writer << "ready"
+  end
+
+  # Total cost of running each operation a number of times, after a few
+  # runs of everything to warm up caches and pools. Totals rather than
+  # averages, so one extra allocation every few operations still shows up
+  def costs
+    costs, runs = {}, iterations
+
+    operations.each_value { |operation| 5.times { operation.call } }
+    yield
+
+    operations.each do |name, operation|
+      before = yield
+      runs.times { operation.call }
+      costs[name] = yield - before
+    end
+
+    costs
+  end
+
+  # The operations whose total cost went over budget
+  def over_budget(costs, budget)
+    costs.keys.sort_by { |name| name.to_s }.should == budget.keys.sort_by { |name| name.to_s }
+    costs.reject { |name, cost| cost <= budget[name] * iterations }
+  end
+
+  it "keeps to its allocation budget", :if => GC.respond_to?(:stat) && GC.stat.key?(:total_allocated_objects) do
+    budget = allocation_budgets[NIO.engine]
+    pending "no allocation budget for the #{NIO.engine} engine" unless budget
+
+    GC.disable
+    begin
+      over_budget(costs { GC.stat(:total_allocated_objects) }, budget).should == {}
+    ensure
+      GC.enable
+    end
+  end
+
+  it "keeps to its poll budget" do
+    polls = costs { selector.stats[:polls] }
+
+    over_budget(polls, poll_budgets).should == {}
+    polls.each { |name, polls| polls.should == poll_budgets[name] * iterations }
+  end
+end
@@ -15,6 +15,43 @@ describe NIO::Monitor do
     peer.interests.should == :rw
   end
 
+  it "changes its interests at the next select" do
+    monitor = selector.register(writer, :r)
+    selector.select(0).should be_nil
+
+    monitor.interests = :w
+    monitor.interests = :r
+    monitor.interests = :w
+    monitor.interests.should == :w
+    selector.select(0).should == [monitor]
+
+    stats = selector.stats
+    stats[:interest_changes].should == 3
+    stats[:interest_updates].should == 1
+
+    expect { monitor.interests = :foo }.to raise_error(ArgumentError)
+    monitor.close
+    expect { monitor.interests = :r }.to raise_error(IOError)
+  end
+
+  it "counts an update per monitor whose interests really changed" do
+    pairs = (1..4).map { IO.pipe }
+    monitors = pairs.map { |r, _| selector.register(r, :r) }
+    selector.select(0).should be_nil
+
+    monitors[0].interests = :rw
+    monitors[1].interests = :rw
+    monitors[2].interests = :rw
+    monitors[2].interests = :r
+    monitors[3].interests = :rw
+    monitors[3].close
+    selector.select(0)
+
+    selector.stats[:interest_changes].should == 5
+    selector.stats[:interest_updates].should == 2
+    pairs.flatten.each { |io| io.close }
+  end
+
   it "knows its IO object" do
     subject.io.should == reader
   end
@@ -50,6 +87,20 @@ describe NIO::Monitor do
     reader_monitor.should_not be_writable
   end
 
+  it "samples TCP info", :if => RUBY_PLATFORM =~ /linux/ do
+    server = TCPServer.new("127.0.0.1", 0)
+    client = TCPSocket.new("127.0.0.1", server.addr[1])
+    monitor = selector.register(client, :r)
+
+    info = monitor.tcp_info
+    info.should be_a NIO::TCPInfo
+    info.rtt.should be_a Integer
+    info.unacked.should be_zero
+
+    # Reuses the given struct rather than allocating
+    monitor.tcp_info(info).should equal info
+  end
+
   it "closes" do
     subject.should_not be_closed
     selector.registered?(reader).should be_true
@@ -58,4 +109,347 @@ describe NIO::Monitor do
     subject.should be_closed
     selector.registered?(reader).should be_false
   end
+
+  it "closes after its IO has been closed" do
+    subject
+    reader.close
+
+    subject.close
+    subject.should be_closed
+    selector.registered?(reader).should be_false
+  end
+
+  it "closes its IO in the background" do
+    peer.close(:close_io => :async)
+    peer.should be_closed
+    writer.should be_closed
+    selector.registered?(writer).should be_false
+
+    # The reader sees EOF once the closer gets to the last write end
+    IO.select([reader], nil, nil, 1).should_not be_nil
+    reader.read.should == ""
+  end
+
+  it "keeps accounting when asked to" do
+    selector.accounting = true
+    monitor = selector.register(reader, :r)
+
+    writer << "ohai"
+    selector.select(0) { |m| m.read_nonblock(4096) }.should == 1
+
+    monitor.events.should == 1
+    monitor.bytes_read.should == 4
+    monitor.handler_time.should_not be_zero
+    monitor.last_activity.should be_within(5).of(Time.now.to_f)
+    selector.top(1, :by => :bytes_read).should == [monitor]
+    selector.top(2**31).should == [monitor]
+
+    # Handlers that break out of select still get timed
+    handler_time = monitor.handler_time
+    writer << "ohai"
+    selector.select(0) { |m| sleep 0.01; break }
+    monitor.handler_time.should be > handler_time
+  end
+
+  it "recycles" do
+    subject.value = 42
+    subject.recycle
+    subject.should be_closed
+    selector.registered?(reader).should be_false
+
+    monitor = selector.register(writer, :w, :reuse => true)
+    monitor.should equal subject
+    monitor.io.should == writer
+    monitor.interests.should == :w
+    monitor.value.should be_nil
+    monitor.should_not be_closed
+
+    stats = selector.stats
+    stats[:monitor_pool_hits].should == 1
+    stats[:monitor_pool_hit_ratio].should == 1.0
+  end
+
+  it "waits for its minimum readable bytes" do
+    monitor = selector.register(reader, :r)
+    monitor.min_readable_bytes = 16
+    monitor.min_readable_bytes.should == 16
+
+    writer << "x" * 8
+    selector.select(0.01).should be_nil
+
+    writer << "x" * 8
+    selector.select(1).should == [monitor]
+    reader.read_nonblock(16)
+
+    monitor.min_readable_bytes = nil
+    writer << "x"
+    selector.select(1).should == [monitor]
+  end
+
+  it "puts back the socket's low water mark when it's closed", :if => RUBY_PLATFORM =~ /linux/ do
+    server = TCPServer.new("127.0.0.1", 0)
+    client = TCPSocket.new("127.0.0.1", server.addr[1])
+    peer = server.accept
+
+    begin
+      monitor = selector.register(peer, :r)
+      monitor.min_readable_bytes = 16
+      peer.getsockopt(Socket::SOL_SOCKET, Socket::SO_RCVLOWAT).int.should == 16
+
+      selector.deregister(peer)
+      peer.getsockopt(Socket::SOL_SOCKET, Socket::SO_RCVLOWAT).int.should == 1
+    ensure
+      [server, client, peer].each { |io| io.close }
+    end
+  end
+
+  it "stays throttled when its minimum readable bytes change" do
+    monitor = selector.register(reader, :r)
+    monitor.min_readable_bytes = 16
+
+    writer << "x" * 8
+    selector.select(0.01).should be_nil
+
+    monitor.rate_limit(100, 1)
+    monitor.read_nonblock(8).size.should == 8
+    monitor.should be_throttled
+
+    monitor.min_readable_bytes = 4
+    writer << "y" * 8
+    selector.select(0.01).should be_nil
+    selector.select(1).should == [monitor]
+    monitor.should_not be_throttled
+  end
+
+  it "timestamps what it receives", :if => RUBY_PLATFORM =~ /linux/ do
+    server = TCPServer.new("127.0.0.1", 0)
+    client = TCPSocket.new("127.0.0.1", server.addr[1])
+    peer = server.accept
+
+    begin
+      monitor = selector.register(peer, :r)
+      monitor.receive_timestamps = true
+      monitor.should be_receive_timestamps
+
+      # Linux switches timestamping on for everyone a little after the
+      # first socket asks, so the first segments may not be stamped
+      sent_at = nil
+      10.times do
+        client << "ohai"
+        sent_at = Time.now.to_f
+        selector.select(1) { |m| m.read_nonblock(16).should == "ohai" }
+        break if monitor.received_at
+        sleep 0.01
+      end
+
+      monitor.received_at.should be_within(1).of(sent_at)
+      selector.receive_latency[:samples].should == 1
+    ensure
+      [server, client, peer].each { |io| io.close }
+    end
+  end
+
+  it "leaves wrapped IOs to read themselves when timestamping", :if => NIO.engine == "libev" && RUBY_PLATFORM =~ /linux/ do
+    wrapper = Class.new do
+      def initialize(io); @io = io; end
+      def to_io; @io; end
+      def read_nonblock(*args); @io.read_nonblock(*args).upcase; end
+    end
+
+    server = TCPServer.new("127.0.0.1", 0)
+    client = TCPSocket.new("127.0.0.1", server.addr[1])
+    peer = server.accept
+
+    begin
+      monitor = selector.register(wrapper.new(peer), :r)
+      monitor.receive_timestamps = true
+
+      client << "ohai"
+      selector.select(1).should == [monitor]
+      monitor.read_nonblock(16).should == "OHAI"
+    ensure
+      [server, client, peer].each { |io| io.close }
+    end
+  end
+
+  it "keeps the caller's buffer when there's nothing to read", :if => RUBY_PLATFORM =~ /linux/ do
+    server = TCPServer.new("127.0.0.1", 0)
+    client = TCPSocket.new("127.0.0.1", server.addr[1])
+    peer = server.accept
+
+    begin
+      monitor = selector.register(peer, :r)
+      monitor.receive_timestamps = true
+
+      buffer = "keep"
+      expect { monitor.read_nonblock(16, buffer) }.to raise_error(Errno::EAGAIN)
+      buffer.should == "keep"
+    ensure
+      [server, client, peer].each { |io| io.close }
+    end
+  end
+
+  it "stops reading when its rate limit runs out" do
+    monitor = selector.register(reader, :r)
+    monitor.rate_limit(1000, 100)
+    monitor.should_not be_throttled
+
+    writer << "x" * 150
+    monitor.read_nonblock(150).size.should == 150
+    monitor.should be_throttled
+
+    # Only the wakeup timer can end this select, not the readable pipe
+    writer << "y"
+    selector.select(0.01).should be_nil
+    selector.select(1).should == [monitor]
+    monitor.should_not be_throttled
+  end
+
+  it "accepts connections once they've sent something", :if => RUBY_PLATFORM =~ /linux/ do
+    server = TCPServer.new("127.0.0.1", 0)
+    listener = selector.register(server, :r)
+    listener.defer_accept = 5
+
+    client = TCPSocket.new("127.0.0.1", server.addr[1])
+    selector.select(0.1).should be_nil
+
+    client << "hello"
+    selector.select(1).should == [listener]
+
+    socket, data = listener.accept_nonblock
+    data.should == "hello"
+    [server, client, socket].each { |io| io.close }
+  end
+
+  it "reads what a new connection sent when accepting it" do
+    server = TCPServer.new("127.0.0.1", 0)
+    listener = selector.register(server, :r)
+
+    client = TCPSocket.new("127.0.0.1", server.addr[1])
+    client << "hello"
+    selector.select(1).should == [listener]
+    sleep 0.05 # let the data land behind the connection
+
+    socket, data = listener.accept_nonblock
+    data.should == "hello"
+    [server, client, socket].each { |io| io.close }
+  end
+
+  it "migrates to another selector" do
+    other = NIO::Selector.new
+    monitor = selector.register(reader, :r)
+    monitor.value = 42
+
+    monitor.migrate_to(other).should equal monitor
+    monitor.selector.should == other
+    monitor.value.should == 42
+    selector.should_not be_registered(reader)
+    other.should be_registered(reader)
+
+    writer << "x"
+    selector.select(0).should be_nil
+    other.select(0).should == [monitor]
+    other.close
+  end
+
+  it "migrates in batches, skipping closed monitors" do
+    other = NIO::Selector.new
+    pairs = (1..3).map { IO.pipe }
+    monitors = pairs.map { |r, _| selector.register(r, :r) }
+    monitors[1].close
+
+    selector.migrate(monitors, other).should == [monitors[0], monitors[2]]
+    monitors[0].selector.should == other
+    monitors[2].selector.should == other
+    expect { monitors[1].migrate_to(other) }.to raise_exception(IOError)
+
+    other.close
+    pairs.flatten.each(&:close)
+  end
+
+  it "isn't dispatched by the selector it left" do
+    other = NIO::Selector.new
+    pairs = (1..2).map { IO.pipe }
+    monitors = pairs.map { |r, w| w << "x"; selector.register(r, :r) }
+
+    dispatched = []
+    selector.select(1) do |monitor|
+      dispatched << monitor
+      (monitors - [monitor]).each { |m| m.migrate_to(other) unless m.selector == other }
+    end
+
+    dispatched.size.should == 1
+    other.select(0).should == monitors - dispatched
+
+    other.close
+    pairs.flatten.each(&:close)
+  end
+
+  it "reaps processes it watches", :if => Process.respond_to?(:fork) do
+    pid = fork { exit!(3) }
+    monitor = selector.watch_process(pid)
+
+    selector.select(5).should == [monitor]
+    status = monitor.reap
+    status.pid.should == pid
+    status.exitstatus.should == 3
+    monitor.should be_closed
+    monitor.reap.should == status
+  end
+
+  it "doesn't reap processes that are still running", :if => Process.respond_to?(:fork) do
+    pid = fork { sleep 10; exit! }
+    monitor = selector.watch_process(pid)
+    monitor.reap.should be_nil
+    monitor.should_not be_closed
+
+    Process.kill("KILL", pid)
+    selector.select(5).should == [monitor]
+    monitor.reap.termsig.should == 9
+  end
+
+  it "won't reap processes that aren't its children" do
+    monitor = selector.watch_process(Process.ppid)
+    selector.select(0.2)
+
+    expect { monitor.reap }.to raise_error(Errno::ECHILD)
+    monitor.close
+  end
+
+  it "stops watching processes when it's closed or recycled first", :if => Process.respond_to?(:fork) do
+    [:close, :recycle].each do |method|
+      threads = Thread.list.size
+      pid = fork { sleep 10; exit! }
+      monitor = selector.watch_process(pid)
+      io = monitor.io
+
+      monitor.send(method)
+      io.should be_closed
+      Thread.list.size.should == threads
+      expect { monitor.reap }.to raise_error(method == :close ? IOError : ArgumentError)
+
+      # Nobody else waited for it
+      Process.kill("KILL", pid)
+      Process.wait2(pid).last.termsig.should == 9
+    end
+  end
+
+  it "stops watching processes when its selector closes first", :if => Process.respond_to?(:fork) do
+    [false, true].each do |close_ios|
+      threads = Thread.list.size
+      other = NIO::Selector.new
+      pid = fork { sleep 10; exit! }
+      monitor = other.watch_process(pid)
+      io = monitor.io
+
+      other.close(close_ios)
+      io.should be_closed
+      Thread.list.size.should == threads
+      monitor.close
+
+      # Nobody else waited for it
+      Process.kill("KILL", pid)
+      Process.wait2(pid).last.termsig.should == 9
+    end
+  end
 end
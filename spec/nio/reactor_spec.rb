@@ -0,0 +1,70 @@
+require 'spec_helper'
+
+describe NIO::Reactor do
+  let(:server) { TCPServer.new("127.0.0.1", 0) }
+  let(:port)   { server.addr[1] }
+  subject      { NIO::Reactor.new }
+
+  let(:echo) do
+    Class.new(NIO::Reactor::Connection) do
+      def on_data(data)
+        write data
+      end
+    end
+  end
+
+  after do
+    subject.close
+    server.close
+  end
+
+  def run_until(reactor = subject)
+    20.times do
+      reactor.run_once(0.05)
+      return if yield
+    end
+  end
+
+  it "hands connections' data to their handlers" do
+    subject.listen(server, echo)
+    client = TCPSocket.new("127.0.0.1", port)
+    client << "hello"
+
+    run_until { subject.connections > 0 && IO.select([client], nil, nil, 0) }
+    client.readpartial(5).should == "hello"
+    client.close
+  end
+
+  it "queues writes the socket can't take yet" do
+    payload = "x" * (4 * 1024 * 1024)
+    subject.listen(server) { |connection| connection.write(payload) }
+    client = TCPSocket.new("127.0.0.1", port)
+
+    received = ""
+    until received.size == payload.size
+      subject.run_once(0.01)
+      begin
+        received << client.read_nonblock(65536)
+      rescue Errno::EAGAIN
+      end
+    end
+
+    received.should == payload
+    client.close
+  end
+
+  it "closes idle connections" do
+    reactor = NIO::Reactor.new(:idle_timeout => 0.2)
+    opened = []
+    reactor.listen(server) { |connection| opened << connection }
+    client = TCPSocket.new("127.0.0.1", port)
+
+    run_until(reactor) { opened.any? && opened.first.closed? }
+    opened.first.should be_closed
+    reactor.connections.should be_zero
+    client.read.should == ""
+
+    client.close
+    reactor.close
+  end
+end
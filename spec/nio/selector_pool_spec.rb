@@ -0,0 +1,35 @@
+require 'spec_helper'
+
+describe NIO::SelectorPool do
+  subject { NIO::SelectorPool.new(2) }
+  let(:pair)   { IO.pipe }
+  let(:reader) { pair.first }
+
+  after { subject.close }
+
+  it "reuses selectors which are checked back in" do
+    selector = subject.checkout
+    subject.checkin selector
+    subject.checkout.should equal selector
+  end
+
+  it "resets selectors when they're checked back in" do
+    subject.with { |selector| selector.register(reader, :r) }
+
+    selector = subject.checkout
+    selector.should_not be_registered(reader)
+    subject.checkin selector
+  end
+
+  it "closes selectors beyond its size" do
+    selectors = (1..3).map { subject.checkout }
+    selectors.each { |selector| subject.checkin selector }
+
+    subject.idle.should == 2
+    selectors.last.should be_closed
+  end
+
+  it "has a process-wide pool" do
+    NIO::Selector.pool.should equal NIO::Selector.pool
+  end
+end
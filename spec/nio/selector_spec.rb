@@ -1,10 +1,5 @@
 require 'spec_helper'
 
-# Timeouts should be at least this precise (in seconds) to pass the tests
-# Typical precision should be better than this, but if it's worse it will fail
-# the tests
-TIMEOUT_PRECISION = 0.1
-
 describe NIO::Selector do
   let(:pair)   { IO.pipe }
   let(:reader) { pair.first }
@@ -19,6 +14,26 @@ describe NIO::Selector do
     it "raises TypeError if asked to register non-IO objects" do
       expect { subject.register(42, :r) }.to raise_exception TypeError
     end
+
+    it "raises IOError if asked to register closed IO objects" do
+      reader.close
+      expect { subject.register(reader, :r) }.to raise_exception IOError
+    end
+
+    it "registers oneshot monitors on the epoll engine" do
+      unless NIO.engine == "epoll"
+        expect { subject.register(reader, :r, :oneshot => true) }.to raise_exception NotImplementedError
+        next
+      end
+
+      monitor = subject.register(reader, :r, :oneshot => true)
+      writer << "ohai"
+      subject.select(0).should == [monitor]
+      subject.select(0).should be_nil
+
+      monitor.rearm
+      subject.select(0).should == [monitor]
+    end
   end
 
   it "knows which IO objects are registered" do
@@ -115,6 +130,17 @@ describe NIO::Selector do
       selected.should_not include(unready_monitor)
     end
 
+    it "selects IO objects ready for both reading and writing once" do
+      server = TCPServer.new("127.0.0.1", 0)
+      client = TCPSocket.new("127.0.0.1", server.addr[1])
+      server.accept << "ohai"
+      select [client], [], [], 1
+
+      monitor = subject.register(client, :rw)
+      subject.select(0).should == [monitor]
+      monitor.readiness.should == :rw
+    end
+
     it "iterates across selected objects with a block" do
       readable1, writer = IO.pipe
       writer << "ohai"
@@ -138,8 +164,297 @@ describe NIO::Selector do
     end
   end
 
+  context "slow clients", :if => RUBY_PLATFORM =~ /linux/ do
+    let(:server) { TCPServer.new("127.0.0.1", 0) }
+    let(:client) do
+      sock = Socket.new(Socket::AF_INET, Socket::SOCK_STREAM, 0)
+      sock.setsockopt(Socket::SOL_SOCKET, Socket::SO_RCVBUF, 4096)
+      sock.connect Socket.sockaddr_in(server.addr[1], "127.0.0.1")
+      sock
+    end
+    let(:peer) do
+      client
+      server.accept
+    end
+
+    # Fill the kernel send queue of the peer since the client never reads
+    def clog(sock)
+      loop { sock.write_nonblock("X" * 65536) }
+    rescue Errno::EAGAIN, Errno::EWOULDBLOCK
+    end
+
+    it "times out clients whose send queue stays full" do
+      monitor = subject.register(peer, :r)
+      subject.slow_client_policy(1024, :timeout, 1)
+
+      clog(peer)
+      client << "ohai"
+
+      subject.select(0).should include monitor
+      monitor.should_not be_slow
+
+      subject.select(0).should include monitor
+      monitor.should be_slow
+      monitor.should be_closed
+      subject.should_not be_registered(peer)
+    end
+
+    it "demotes slow clients behind everyone else" do
+      slow = subject.register(peer, :r)
+      fast = subject.register(reader, :r)
+      subject.slow_client_policy(1024, :demote, 1)
+
+      clog(peer)
+      client << "ohai"
+      writer << "ohai"
+
+      2.times { subject.select(0) }
+      slow.should be_slow
+      subject.select(0).should == [fast, slow]
+    end
+
+    it "pauses the reads of throttled clients it doesn't sample" do
+      monitor = subject.register(peer, :r)
+      subject.slow_client_policy(1024, :throttle, 2)
+
+      clog(peer)
+      client << "ohai"
+
+      3.times { subject.select(0).should include monitor }
+      monitor.should be_slow
+      monitor.should_not be_throttled
+
+      # Not sampled: the still readable socket is left out until it resumes
+      (subject.select(0) || []).should be_empty
+      monitor.should be_throttled
+
+      subject.select(1).should include monitor
+      monitor.should_not be_throttled
+    end
+
+    it "leaves clients alone when disabled" do
+      monitor = subject.register(peer, :r)
+      subject.slow_client_policy(1024, :timeout, 1)
+      subject.slow_client_policy(nil)
+
+      clog(peer)
+      client << "ohai"
+
+      2.times { subject.select(0).should include monitor }
+      monitor.should_not be_closed
+    end
+
+    it "rejects unknown actions" do
+      expect { subject.slow_client_policy(1024, :explode) }.to raise_exception ArgumentError
+    end
+  end
+
+  context "event budget" do
+    let(:pipes) { Array.new(12) { IO.pipe } }
+    after { pipes.flatten.each { |io| io.close } }
+
+    it "shares the budget between groups by weight" do
+      pipes.each_with_index do |(r, w), i|
+        w << "ohai"
+        subject.register(r, :r, i < 6 ? { :group => :noisy } : { :group => :quiet, :weight => 2 })
+      end
+      subject.event_budget = 6
+
+      ready = subject.select(0)
+      ready.size.should == 6
+      ready.select { |monitor| monitor.group == :quiet }.size.should == 4
+
+      stats = subject.group_stats
+      stats[:noisy].should == { :weight => 1, :monitors => 6, :events => 2 }
+      stats[:quiet].should == { :weight => 2, :monitors => 6, :events => 4 }
+    end
+
+    it "dispatches everything without a budget" do
+      pipes.each do |r, w|
+        w << "ohai"
+        subject.register(r, :r, :group => :noisy)
+      end
+
+      subject.select(0).size.should == 12
+      subject.group_stats[:noisy][:events].should == 12
+    end
+
+    it "forgets groups once their last monitor has left" do
+      r, w = pipes.pop
+      subject.register(r, :r, :group => :solo).close
+      subject.group_stats.should_not have_key(:solo)
+
+      monitors = pipes.map do |r, w|
+        w << "ohai"
+        subject.register(r, :r, :group => :noisy)
+      end
+      subject.event_budget = 6
+
+      # Closed while the rest were still waiting for the group's turn
+      subject.select(0) { monitors.each { |monitor| monitor.close } }
+      subject.group_stats.should_not have_key(:noisy)
+    end
+  end
+
+  context "pipelined", :if => PIPELINED_SELECTORS do
+    subject { NIO::Selector.new(:pipelined => true) }
+
+    it "keeps reporting IOs until they're read from" do
+      monitor = subject.register(reader, :r)
+      subject.should be_pipelined
+      subject.select(0).should be_nil
+
+      writer << "ohai"
+      subject.select(1).should == [monitor]
+      subject.select(1).should == [monitor]
+
+      reader.read_nonblock(4).should == "ohai"
+      subject.select(0).should be_nil
+    end
+
+    it "wakes up if signaled to from another thread" do
+      subject.register(reader, :r)
+      Thread.new { sleep 0.1; subject.wakeup }
+
+      started_at = Time.now
+      subject.select.should be_nil
+      (Time.now - started_at).should be_within(TIMEOUT_PRECISION).of(0.1)
+    end
+
+    it "can't throttle slow clients" do
+      expect { subject.slow_client_policy(1024, :throttle) }.to raise_error(NotImplementedError)
+    end
+  end
+
+  it "selects with whichever backend it's asked to" do
+    [:epoll, :kqueue, :poll, :select].each do |backend|
+      begin
+        selector = NIO::Selector.new(:backend => backend)
+      rescue NotImplementedError
+        next
+      end
+
+      monitor = selector.register(reader, :r)
+      selector.backend.should == backend
+      selector.select(0).should be_nil
+
+      writer << "ohai"
+      selector.select(1).should == [monitor]
+      reader.read_nonblock(4).should == "ohai"
+      selector.close
+    end
+  end
+
+  # The poll and select backends skip over blocks of idle entries at a time,
+  # so spread a few ready IOs over more than 64 with some either side of the
+  # 64 bit word boundaries
+  it "finds a few ready IOs among many with the poll and select backends" do
+    pipes = (1..100).map { IO.pipe }
+    readers = pipes.map { |pipe| pipe.first }
+    boundaries = readers.select { |io| [63, 64, 127, 128, 191, 192].include?(io.fileno) }
+    ready = ([readers.first, readers[37], readers.last] + boundaries).uniq
+    ready.each { |io| pipes.assoc(io).last << "x" }
+
+    [:poll, :select].each do |backend|
+      begin
+        selector = NIO::Selector.new(:backend => backend)
+      rescue NotImplementedError
+        next
+      end
+
+      readers.each { |io| selector.register(io, :r) }
+      selector.register(pipes[50].last, :w)
+
+      expected = (ready + [pipes[50].last]).map { |io| io.fileno }.sort
+      selector.select(1).map { |monitor| monitor.io.fileno }.sort.should == expected
+      selector.close
+    end
+
+    pipes.flatten.each { |io| io.close }
+  end
+
+  context "gc when idle", :if => GC.respond_to?(:stat) && GC.stat.key?(:old_objects_limit) do
+    it "doesn't collect while there are IOs ready" do
+      subject.gc_when_idle = true
+      subject.should be_gc_when_idle
+
+      monitor = subject.register(reader, :r)
+      writer << "ohai"
+
+      # Enough garbage that a collection comes due along the way
+      ready = nil
+      200.times { Array.new(1000) { "x" * 32 }; ready = subject.select(1) }
+      ready.should == [monitor]
+
+      stats = subject.stats
+      (stats[:idle_gc_minor] + stats[:idle_gc_major]).should == 0
+    end
+
+    it "collects while there's nothing to do" do
+      subject.gc_when_idle = true
+      subject.register(reader, :r)
+      gc_count = GC.count
+      collected = 0
+
+      # Malloc growth in steps well inside the window before the GC's limit
+      1000.times do
+        "x" * 100_000
+        subject.select(0.001).should be_nil
+
+        stats = subject.stats
+        collected = stats[:idle_gc_minor] + stats[:idle_gc_major]
+        break if collected > 0
+      end
+
+      collected.should be > 0
+      GC.count.should be > gc_count
+    end
+  end
+
+  context "reset" do
+    it "deregisters everything but stays open" do
+      monitor = subject.register(reader, :r)
+      subject.reset.should equal subject
+
+      monitor.should be_closed
+      subject.should_not be_registered(reader)
+      subject.should_not be_closed
+    end
+
+    it "can be reused afterwards" do
+      subject.register(reader, :r)
+      subject.wakeup
+      subject.reset
+
+      subject.register(reader, :r)
+      writer << "ohai"
+      subject.select(0).map { |m| m.io }.should == [reader]
+    end
+  end
+
   it "closes" do
     subject.close
     subject.should be_closed
   end
+
+  it "closes its monitors when it closes" do
+    monitor = subject.register(reader, :r)
+    subject.close
+
+    monitor.should be_closed
+    subject.should_not be_registered(reader)
+    reader.should_not be_closed
+    expect { monitor.close }.not_to raise_exception
+  end
+
+  it "closes registered IO objects when asked to" do
+    subject.register(reader, :r)
+    subject.close(true)
+    reader.should be_closed
+  end
+
+  it "raises IOError when registering with a closed selector" do
+    subject.close
+    expect { subject.register(reader, :r) }.to raise_exception IOError
+  end
 end
@@ -0,0 +1,29 @@
+require 'spec_helper'
+
+describe "NIO.wait" do
+  let(:pipes)  { IO.pipe }
+  let(:reader) { pipes.first }
+  let(:writer) { pipes.last }
+
+  after { pipes.each { |io| io.close unless io.closed? } }
+
+  it "waits for a timeout" do
+    started_at = Time.now
+    NIO.wait(reader, :r, 0.1).should be_nil
+    (Time.now - started_at).should be_within(TIMEOUT_PRECISION).of(0.1)
+  end
+
+  it "reports readiness for what it was asked about" do
+    NIO.wait(writer, :w, 0).should == :w
+    NIO.wait(writer, :rw, 0).should == :w
+
+    Thread.new { sleep 0.05; writer << "ohai" }
+    NIO.wait(reader, :r, 1).should == :r
+    NIO.wait(reader, :rw, 0).should == :r
+  end
+
+  it "raises ArgumentError on bogus arguments" do
+    expect { NIO.wait(reader, :foo) }.to raise_error(ArgumentError)
+    expect { NIO.wait(reader, :r, -1) }.to raise_error(ArgumentError)
+  end
+end
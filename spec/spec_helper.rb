@@ -1,3 +1,16 @@
 require 'rubygems'
 require 'bundler/setup'
-require 'nio'
\ No newline at end of file
+require 'nio'
+
+# Timeouts should be at least this precise (in seconds) to pass the tests
+# Typical precision should be better than this, but if it's worse it will fail
+# the tests
+TIMEOUT_PRECISION = 0.1
+
+# Whether this engine, platform and Ruby can run pipelined selectors
+PIPELINED_SELECTORS = begin
+  NIO::Selector.new(:pipelined => true).close
+  true
+rescue NotImplementedError
+  false
+end